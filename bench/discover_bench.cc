@@ -0,0 +1,218 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <string>
+#include <vector>
+
+#include "PolarisConfig.h"
+#include "PolarisDecoder.h"
+#include "json.hpp"
+
+using namespace polaris;
+using nlohmann::json;
+
+namespace polaris {
+void from_json(const json &j, struct discover_result &response);
+};
+
+/*
+ * Decode a synthetic /v1/Discover response with the json DOM and
+ * from_json(), the way of PolarisConfig.cc, and with decode_discover_result().
+ * Print the time and the peak heap of each, the peak heap counts every
+ * operator new on top of the body, which is the part of RSS they add.
+ *
+ * USAGE:
+ *     ./discover_bench [<rounds>]
+ */
+
+static size_t heap_now = 0;
+static size_t heap_peak = 0;
+
+// keep the size before each block, to know how much operator delete frees
+void *operator new(size_t size)
+{
+	size_t *p = (size_t *)malloc(size + sizeof (size_t) * 2);
+
+	if (!p)
+		throw std::bad_alloc();
+
+	*p = size;
+	heap_now += size;
+	if (heap_now > heap_peak)
+		heap_peak = heap_now;
+
+	return p + 2;
+}
+
+void operator delete(void *ptr) noexcept
+{
+	size_t *p = (size_t *)ptr;
+
+	if (p)
+	{
+		heap_now -= p[-2];
+		free(p - 2);
+	}
+}
+
+struct bench_result
+{
+	double ms;
+	size_t peak;
+};
+
+static int64_t now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static std::string make_body(int n)
+{
+	json j;
+	json instances = json::array();
+
+	j["code"] = 200000;
+	j["info"] = "execute success";
+	j["type"] = "INSTANCE";
+	j["service"] = {
+		{ "name", "b" },
+		{ "namespace", "b_namespace" },
+		{ "revision", "rev_" + std::to_string(n) },
+		{ "metadata", { { "owner", "polaris" } } },
+	};
+
+	for (int i = 0; i < n; i++)
+	{
+		std::string ip = "10." + std::to_string((i >> 16) & 255) + "." +
+						 std::to_string((i >> 8) & 255) + "." +
+						 std::to_string(i & 255);
+
+		instances.push_back({
+			{ "id", "instance_" + std::to_string(i) + "_5f0a1b2c3d4e5f60718293a4" },
+			{ "service", "b" },
+			{ "namespace", "b_namespace" },
+			{ "host", ip },
+			{ "port", 8000 + i % 1000 },
+			{ "protocol", "http" },
+			{ "version", "1.0.0" },
+			{ "weight", 100 },
+			{ "priority", 0 },
+			{ "healthy", true },
+			{ "isolate", false },
+			{ "enableHealthCheck", true },
+			{ "healthCheck", { { "type", "HEARTBEAT" },
+							   { "heartbeat", { { "ttl", 5 } } } } },
+			{ "location", { { "region", "south" },
+							{ "zone", "zone_" + std::to_string(i % 4) },
+							{ "campus", "campus_1" } } },
+			{ "metadata", { { "env", i % 2 ? "base" : "grey" },
+							{ "set", "set_" + std::to_string(i % 8) },
+							{ "idc", "idc_1" } } },
+			{ "logic_set", "" },
+			{ "ctime", "2021-01-01 00:00:00" },
+			{ "mtime", "2021-01-01 00:00:00" },
+			{ "revision", "inst_rev_" + std::to_string(i) },
+		});
+	}
+
+	j["instances"] = std::move(instances);
+	return j.dump();
+}
+
+static struct bench_result run_dom(const std::string& body, int rounds,
+								   size_t *count)
+{
+	struct bench_result res;
+	int64_t start = now_ns();
+
+	res.peak = 0;
+	for (int i = 0; i < rounds; i++)
+	{
+		size_t base = heap_now;
+		struct discover_result result;
+
+		heap_peak = base;
+		json j = json::parse(body, nullptr, false);
+		from_json(j, result);
+		*count = result.instances.size();
+		if (heap_peak - base > res.peak)
+			res.peak = heap_peak - base;
+	}
+
+	res.ms = (now_ns() - start) / 1e6 / rounds;
+	return res;
+}
+
+static struct bench_result run_decoder(const std::string& body, int rounds,
+									   size_t *count)
+{
+	struct bench_result res;
+	int64_t start = now_ns();
+
+	res.peak = 0;
+	for (int i = 0; i < rounds; i++)
+	{
+		size_t base = heap_now;
+		struct discover_result result;
+
+		heap_peak = base;
+		if (!decode_discover_result(body.c_str(), body.size(), &result))
+		{
+			fprintf(stderr, "decode_discover_result() failed\n");
+			exit(1);
+		}
+
+		*count = result.instances.size();
+		if (heap_peak - base > res.peak)
+			res.peak = heap_peak - base;
+	}
+
+	res.ms = (now_ns() - start) / 1e6 / rounds;
+	return res;
+}
+
+int main(int argc, char *argv[])
+{
+	static const int sizes[] = { 100, 1000, 20000 };
+	int rounds = 5;
+
+	if (argc > 1)
+		rounds = atoi(argv[1]);
+
+	if (rounds <= 0)
+	{
+		fprintf(stderr, "USAGE:\n    %s [<rounds>]\n", argv[0]);
+		exit(1);
+	}
+
+	printf("%-10s %10s %-8s %10s %12s %10s\n",
+		   "instances", "body KB", "decoder", "ms", "peak KB", "peak/body");
+
+	for (int n : sizes)
+	{
+		std::string body = make_body(n);
+		struct bench_result dom;
+		struct bench_result sax;
+		size_t dom_count;
+		size_t sax_count;
+
+		dom = run_dom(body, rounds, &dom_count);
+		sax = run_decoder(body, rounds, &sax_count);
+		if (dom_count != (size_t)n || sax_count != (size_t)n)
+		{
+			fprintf(stderr, "decoded %zu and %zu of %d instances\n",
+					dom_count, sax_count, n);
+			exit(1);
+		}
+
+		printf("%-10d %10zu %-8s %10.2f %12zu %10.1f\n", n, body.size() / 1024,
+			   "dom", dom.ms, dom.peak / 1024, (double)dom.peak / body.size());
+		printf("%-10d %10zu %-8s %10.2f %12zu %10.1f\n", n, body.size() / 1024,
+			   "sax", sax.ms, sax.peak / 1024, (double)sax.peak / body.size());
+	}
+
+	return 0;
+}
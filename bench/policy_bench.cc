@@ -0,0 +1,459 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "PolarisPolicy.h"
+#include "PolarisRandom.h"
+
+#include "workflow/URIParser.h"
+
+using namespace polaris;
+
+/*
+ * Drive PolarisPolicy::select() with synthetic instances and rules, and
+ * print ns/op, allocs/op and, for more than one thread, the efficiency
+ * of scaling: ops per second of N threads / (N * ops per second of 1).
+ *
+ * USAGE:
+ *     ./policy_bench [<ops_per_thread>]
+ */
+
+static std::atomic<bool> count_alloc(false);
+static thread_local long alloc_count = 0;
+
+void *operator new(size_t size)
+{
+	void *p;
+
+	if (count_alloc.load(std::memory_order_relaxed))
+		alloc_count++;
+
+	p = malloc(size ? size : 1);
+	if (!p)
+		throw std::bad_alloc();
+
+	return p;
+}
+
+void operator delete(void *p) noexcept
+{
+	free(p);
+}
+
+struct bench_result
+{
+	double ns_per_op;
+	double allocs_per_op;
+	double ops_per_sec;
+};
+
+static PolarisConfig config;
+static long ops_per_thread = 10000;
+
+static int64_t now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * instance i has "group": "g<i % 10>", and meta_keys more keys
+ * "k<j>": "v<j>" besides "k0", which is "v<i % 2>".
+ * A quarter of them have no region, the same as the local one which is
+ * not configured here, so they are the nearby ones.
+ */
+static void fill_instances(std::vector<struct instance>& instances,
+						   int n, int meta_keys)
+{
+	struct instance inst;
+	char buf[64];
+
+	inst.service = "b";
+	inst.service_namespace = "b_namespace";
+	inst.priority = 0;
+	inst.weight = 100;
+	inst.enable_healthcheck = false;
+	inst.healthcheck_ttl = 0;
+	inst.healthy = true;
+	inst.isolate = false;
+
+	for (int i = 0; i < n; i++)
+	{
+		snprintf(buf, sizeof buf, "instance_%d", i);
+		inst.id = buf;
+		snprintf(buf, sizeof buf, "10.%d.%d.%d",
+				 (i >> 16) & 255, (i >> 8) & 255, i & 255);
+		inst.host = buf;
+		inst.port = 8000 + i % 1000;
+		inst.region = i % 4 == 0 ? "" : "remote";
+
+		inst.metadata.clear();
+		inst.metadata["group"] = "g" + std::to_string(i % 10);
+		for (int j = 0; j < meta_keys; j++)
+		{
+			inst.metadata["k" + std::to_string(j)] =
+				"v" + std::to_string(j == 0 ? i % 2 : j);
+		}
+
+		instances.push_back(inst);
+	}
+}
+
+/*
+ * n rules for caller "a", rule i matches "env": "e<i>" and routes to
+ * "group": "g<i % 10>". Callers use the last one, so that matching the
+ * bounds goes through all of them.
+ */
+static void fill_bounds(std::vector<struct routing_bound>& bounds, int n)
+{
+	struct meta_label label;
+	struct source_bound src;
+	struct destination_bound dst;
+
+	label.type = "EXACT";
+	src.service = "a";
+	src.service_namespace = "a_namespace";
+	dst.service = "b";
+	dst.service_namespace = "b_namespace";
+	dst.priority = 0;
+	dst.weight = 100;
+
+	for (int i = 0; i < n; i++)
+	{
+		struct routing_bound bound;
+
+		label.value = "e" + std::to_string(i);
+		src.metadata.clear();
+		src.metadata["env"] = label;
+		bound.source_bounds.push_back(src);
+
+		label.value = "g" + std::to_string(i % 10);
+		dst.metadata.clear();
+		dst.metadata["group"] = label;
+		bound.destination_bounds.push_back(dst);
+
+		bounds.push_back(bound);
+	}
+}
+
+/*
+ * n different fragments of "<prefix><key>=<i>&<suffix>", or "<prefix><suffix>"
+ * if n is 1. More of them than the fragment cache holds make every select()
+ * parse and match the fragment again.
+ */
+static void fill_uris(std::vector<ParsedURI>& uris, const std::string& prefix,
+					  const std::string& key, const std::string& suffix,
+					  int n)
+{
+	std::vector<ParsedURI> parsed(n);
+	std::string url;
+
+	for (int i = 0; i < n; i++)
+	{
+		url = "http://b_namespace.b:8080#" + prefix;
+		if (n > 1)
+			url += key + "=" + std::to_string(i) + "&";
+		url += suffix;
+
+		if (URIParser::parse(url, parsed[i]) != 0)
+		{
+			fprintf(stderr, "Invalid url %s\n", url.c_str());
+			exit(1);
+		}
+	}
+
+	uris.swap(parsed);
+}
+
+static void select_loop(PolarisPolicy *pp,
+						const std::vector<ParsedURI> *uris,
+						long ops, long *allocs, bool *failed)
+{
+	EndpointAddress *addr;
+	size_t n = uris->size();
+	long start = alloc_count;
+
+	for (long i = 0; i < ops; i++)
+	{
+		if (!pp->select((*uris)[i % n], NULL, &addr))
+		{
+			*failed = true;
+			break;
+		}
+
+		--addr->ref;
+	}
+
+	*allocs = alloc_count - start;
+}
+
+static struct bench_result run(PolarisPolicy& pp,
+							   const std::vector<ParsedURI>& uris,
+							   int threads)
+{
+	std::vector<std::thread> workers;
+	std::vector<long> allocs(threads);
+	bool *failed = new bool[threads]();
+	struct bench_result res;
+	long warmup;
+	int64_t start;
+	int64_t elapsed;
+	long total_allocs = 0;
+
+	// let the snapshot and the per thread buffers settle
+	select_loop(&pp, &uris, uris.size() * 2, &warmup, failed);
+
+	count_alloc = true;
+	start = now_ns();
+	for (int i = 0; i < threads; i++)
+	{
+		workers.emplace_back(select_loop, &pp, &uris, ops_per_thread,
+							 &allocs[i], &failed[i]);
+	}
+
+	for (std::thread& worker : workers)
+		worker.join();
+
+	elapsed = now_ns() - start;
+	count_alloc = false;
+
+	for (int i = 0; i < threads; i++)
+	{
+		if (failed[i])
+		{
+			fprintf(stderr, "select() failed\n");
+			exit(1);
+		}
+
+		total_allocs += allocs[i];
+	}
+
+	delete []failed;
+	res.ns_per_op = (double)elapsed / ops_per_thread;
+	res.allocs_per_op = (double)total_allocs / (ops_per_thread * threads);
+	res.ops_per_sec = ops_per_thread * threads * 1e9 / elapsed;
+	return res;
+}
+
+// the default chain has nearbyBasedRouter, leave it to bench_nearby()
+static void disable_nearby(PolarisPolicyConfig& conf)
+{
+	conf.set_nearby_based_router(false, "zone", "none", 100, true, false);
+}
+
+static void print_header(const char *title)
+{
+	printf("\n%s\n", title);
+	printf("%-32s %8s %12s %12s %12s\n",
+		   "case", "threads", "ns/op", "allocs/op", "efficiency");
+}
+
+static void print_result(const std::string& name, int threads,
+						 const struct bench_result& res,
+						 double efficiency = 0)
+{
+	printf("%-32s %8d %12.1f %12.3f ", name.c_str(), threads,
+		   res.ns_per_op, res.allocs_per_op);
+
+	if (efficiency > 0)
+		printf("%12.2f\n", efficiency);
+	else
+		printf("%12s\n", "-");
+}
+
+static void bench_instances()
+{
+	static const int sizes[] = { 10, 100, 1000, 10000, 50000 };
+	std::vector<ParsedURI> uris;
+
+	print_header("weighted random by number of instances, no rules");
+	fill_uris(uris, "", "", "a_namespace.a", 1);
+
+	for (int n : sizes)
+	{
+		std::vector<struct instance> instances;
+		PolarisPolicyConfig conf("b", config);
+
+		fill_instances(instances, n, 0);
+		disable_nearby(conf);
+		PolarisPolicy pp(&conf);
+		pp.update_instances(instances);
+
+		print_result("instances=" + std::to_string(n), 1, run(pp, uris, 1));
+	}
+}
+
+// matching_bounds() and matching_subset()
+static void bench_rules()
+{
+	static const int sizes[] = { 0, 10, 100, 500 };
+	std::vector<struct instance> instances;
+
+	print_header("rule base router by number of bounds, 1000 instances");
+	fill_instances(instances, 1000, 0);
+
+	for (int n : sizes)
+	{
+		std::vector<struct routing_bound> bounds;
+		std::string env = "env=e" + std::to_string(n ? n - 1 : 0) + "&";
+		PolarisPolicyConfig conf("b", config);
+
+		fill_bounds(bounds, n);
+		disable_nearby(conf);
+		PolarisPolicy pp(&conf);
+		pp.update_instances(instances);
+		pp.update_inbounds(bounds);
+
+		for (int u : { 1, 256 })
+		{
+			std::vector<ParsedURI> uris;
+
+			fill_uris(uris, env, "req", "a_namespace.a", u);
+			print_result("bounds=" + std::to_string(n) +
+						 " uris=" + std::to_string(u), 1, run(pp, uris, 1));
+		}
+	}
+}
+
+// matching_meta()
+static void bench_meta()
+{
+	static const int sizes[] = { 1, 4, 16, 64 };
+
+	print_header("dst meta router by keys per instance, 1000 instances");
+
+	for (int keys : sizes)
+	{
+		std::vector<struct instance> instances;
+		std::vector<ParsedURI> uris;
+		std::string meta;
+		PolarisPolicyConfig conf("b", config);
+
+		fill_instances(instances, 1000, keys);
+		conf.set_dst_meta_router(true);
+		disable_nearby(conf);
+		PolarisPolicy pp(&conf);
+		pp.update_instances(instances);
+
+		meta = "meta.k0=v0&";
+		for (int j = 1; j < keys && j < 4; j++)
+			meta += "meta.k" + std::to_string(j) + "=v" + std::to_string(j) + "&";
+
+		fill_uris(uris, meta, "", "a_namespace.a", 1);
+		print_result("keys=" + std::to_string(keys), 1, run(pp, uris, 1));
+	}
+}
+
+// nearby_router_filter()
+static void bench_nearby()
+{
+	static const int sizes[] = { 100, 1000, 10000 };
+	std::vector<ParsedURI> uris;
+
+	print_header("nearby router by number of instances, a quarter nearby");
+	fill_uris(uris, "", "", "a_namespace.a", 1);
+
+	for (int n : sizes)
+	{
+		std::vector<struct instance> instances;
+		PolarisPolicyConfig conf("b", config);
+
+		fill_instances(instances, n, 0);
+		conf.set_nearby_based_router(true, "region", "none", 100,
+									 false, false);
+		PolarisPolicy pp(&conf);
+		pp.update_instances(instances);
+
+		print_result("instances=" + std::to_string(n), 1, run(pp, uris, 1));
+	}
+}
+
+static void bench_balancers()
+{
+	static const struct
+	{
+		const char *name;
+		enum LoadBalancerType type;
+	} types[] = {
+		{ "weightedRandom", LoadBalancerWeightedRandom },
+		{ "ringHash", LoadBalancerRingHash },
+		{ "maglev", LoadBalancerMaglev },
+		{ "p2c", LoadBalancerP2C },
+	};
+	std::vector<struct instance> instances;
+	std::vector<ParsedURI> uris;
+
+	print_header("load balancers, 1000 instances, 256 hash keys");
+	fill_instances(instances, 1000, 0);
+	fill_uris(uris, "", "hash_key", "a_namespace.a", 256);
+
+	for (const auto& t : types)
+	{
+		PolarisPolicyConfig conf("b", config);
+
+		conf.set_load_balancer_type(t.type);
+		disable_nearby(conf);
+		PolarisPolicy pp(&conf);
+		pp.update_instances(instances);
+
+		print_result(t.name, 1, run(pp, uris, 1));
+	}
+}
+
+static void bench_threads()
+{
+	static const int sizes[] = { 1, 2, 4, 8 };
+	std::vector<struct instance> instances;
+	std::vector<struct routing_bound> bounds;
+	std::vector<ParsedURI> uris;
+	PolarisPolicyConfig conf("b", config);
+	struct bench_result single;
+
+	print_header("rule base router by threads, 100 bounds, 1000 instances");
+	fill_instances(instances, 1000, 0);
+	fill_bounds(bounds, 100);
+	fill_uris(uris, "env=e99&", "", "a_namespace.a", 1);
+
+	disable_nearby(conf);
+	PolarisPolicy pp(&conf);
+	pp.update_instances(instances);
+	pp.update_inbounds(bounds);
+
+	for (int threads : sizes)
+	{
+		struct bench_result res = run(pp, uris, threads);
+
+		if (threads == 1)
+			single = res;
+
+		print_result("bounds=100", threads, res,
+					 res.ops_per_sec / (threads * single.ops_per_sec));
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc > 1)
+		ops_per_thread = atol(argv[1]);
+
+	if (ops_per_thread <= 0)
+	{
+		fprintf(stderr, "USAGE:\n    %s [<ops_per_thread>]\n", argv[0]);
+		exit(1);
+	}
+
+	Random::seed(1);
+	bench_instances();
+	bench_rules();
+	bench_meta();
+	bench_nearby();
+	bench_balancers();
+	bench_threads();
+	return 0;
+}
@@ -0,0 +1,106 @@
+#ifndef _POLARISAWAITER_H_
+#define _POLARISAWAITER_H_
+
+#include <string>
+#include <functional>
+#include "PolarisManager.h"
+
+#if defined(__cpp_impl_coroutine)
+#include <coroutine>
+
+namespace polaris {
+
+/*
+ * co_await the async calls of PolarisManager in a C++20 coroutine:
+ *
+ *     int error = co_await co_watch_service(mgr, service_namespace, service_name);
+ *
+ * The value is 0 or one of POLARIS_ERR_*. No thread waits in the meantime,
+ * the coroutine is resumed in the thread of workflow that finishes the call.
+ * The heartbeats after register go on by themselves, as with register_service().
+ */
+class PolarisAwaiter
+{
+public:
+	using start_t = std::function<void (polaris_manager_callback_t)>;
+
+	PolarisAwaiter(start_t start) : start(std::move(start)), error(0) { }
+
+	bool await_ready() const noexcept { return false; }
+
+	void await_suspend(std::coroutine_handle<> handle)
+	{
+		// the callback may resume and destroy this before start() returns
+		start_t start = std::move(this->start);
+
+		start([this, handle](int error) {
+			this->error = error;
+			handle.resume();
+		});
+	}
+
+	int await_resume() const noexcept { return this->error; }
+
+private:
+	start_t start;
+	int error;
+};
+
+inline PolarisAwaiter co_watch_service(PolarisManager& mgr,
+									   const std::string& service_namespace,
+									   const std::string& service_name)
+{
+	return PolarisAwaiter([&mgr, service_namespace, service_name]
+						  (polaris_manager_callback_t callback) {
+		mgr.async_watch_service(service_namespace, service_name,
+								std::move(callback));
+	});
+}
+
+inline PolarisAwaiter co_unwatch_service(PolarisManager& mgr,
+										 const std::string& service_namespace,
+										 const std::string& service_name)
+{
+	return PolarisAwaiter([&mgr, service_namespace, service_name]
+						  (polaris_manager_callback_t callback) {
+		mgr.async_unwatch_service(service_namespace, service_name,
+								  std::move(callback));
+	});
+}
+
+inline PolarisAwaiter co_register_service(PolarisManager& mgr,
+										  const std::string& service_namespace,
+										  const std::string& service_name,
+										  const std::string& service_token,
+										  int heartbeat_interval,
+										  PolarisInstance instance)
+{
+	return PolarisAwaiter([&mgr, service_namespace, service_name, service_token,
+						   heartbeat_interval, instance]
+						  (polaris_manager_callback_t callback) {
+		mgr.async_register_service(service_namespace, service_name,
+								   service_token, heartbeat_interval,
+								   instance, std::move(callback));
+	});
+}
+
+inline PolarisAwaiter co_deregister_service(PolarisManager& mgr,
+											const std::string& service_namespace,
+											const std::string& service_name,
+											const std::string& service_token,
+											PolarisInstance instance)
+{
+	return PolarisAwaiter([&mgr, service_namespace, service_name, service_token,
+						   instance]
+						  (polaris_manager_callback_t callback) {
+		mgr.async_deregister_service(service_namespace, service_name,
+									 service_token, instance,
+									 std::move(callback));
+	});
+}
+
+}; // namespace polaris
+
+#endif
+
+#endif
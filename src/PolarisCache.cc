@@ -0,0 +1,506 @@
+#include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <atomic>
+#include <map>
+#include <string>
+#include <vector>
+#include "PolarisCache.h"
+
+namespace polaris {
+
+/*
+ * header:  "PLCH" | version: u8 | kind: u8 | 0: u16 | size: u32 | checksum: u32
+ * payload: size bytes, checksum is FNV-1a of them
+ *
+ * Integers are little-endian. A string is its u32 length followed by its
+ * bytes, and a vector or map is its u32 count followed by its elements.
+ */
+#define CACHE_MAGIC          "PLCH"
+#define CACHE_VERSION        1
+#define CACHE_HEADER_SIZE    16
+
+enum CacheKind {
+    CACHE_INSTANCES = 1,
+    CACHE_ROUTING = 2,
+};
+
+static uint32_t fnv1a(const char *data, size_t size) {
+    uint32_t hash = 2166136261u;
+
+    for (size_t i = 0; i < size; i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+class CacheWriter {
+  public:
+    void u8(uint8_t val) { this->buf.push_back((char)val); }
+
+    void u32(uint32_t val) {
+        for (int i = 0; i < 4; i++)
+            this->buf.push_back((char)(val >> (i * 8)));
+    }
+
+    void i32(int val) { this->u32((uint32_t)val); }
+
+    void str(const std::string &val) {
+        this->u32((uint32_t)val.size());
+        this->buf.append(val);
+    }
+
+    void str_map(const std::map<std::string, std::string> &val) {
+        this->u32((uint32_t)val.size());
+        for (const auto &kv : val) {
+            this->str(kv.first);
+            this->str(kv.second);
+        }
+    }
+
+    std::string &data() { return this->buf; }
+
+  private:
+    std::string buf;
+};
+
+// every read fails once anything is out of range, checked in the end
+class CacheReader {
+  public:
+    CacheReader(const char *data, size_t size) : pos(data), end(data + size), ok(true) {}
+
+    uint8_t u8() {
+        if (!this->has(1))
+            return 0;
+        return (uint8_t)*this->pos++;
+    }
+
+    uint32_t u32() {
+        uint32_t val = 0;
+
+        if (!this->has(4))
+            return 0;
+
+        for (int i = 0; i < 4; i++)
+            val |= (uint32_t)(unsigned char)*this->pos++ << (i * 8);
+
+        return val;
+    }
+
+    int i32() { return (int)this->u32(); }
+
+    // a count of elements, each one at least min_size bytes
+    uint32_t count(size_t min_size) {
+        uint32_t n = this->u32();
+
+        if (!this->has((size_t)n * min_size))
+            return 0;
+        return n;
+    }
+
+    void str(std::string &val) {
+        uint32_t size = this->u32();
+
+        if (!this->has(size))
+            return;
+
+        val.assign(this->pos, size);
+        this->pos += size;
+    }
+
+    void str_map(std::map<std::string, std::string> &val) {
+        uint32_t n = this->count(8);
+        std::string key;
+
+        val.clear();
+        for (uint32_t i = 0; i < n && this->ok; i++) {
+            this->str(key);
+            this->str(val[key]);
+        }
+    }
+
+    bool finish() const { return this->ok && this->pos == this->end; }
+
+  private:
+    bool has(size_t size) {
+        if (this->ok && (size_t)(this->end - this->pos) >= size)
+            return true;
+
+        this->ok = false;
+        return false;
+    }
+
+  private:
+    const char *pos;
+    const char *end;
+    bool ok;
+};
+
+static void write_instance(CacheWriter &w, const struct instance &inst) {
+    w.str(inst.id);
+    w.str(inst.service);
+    w.str(inst.service_namespace);
+    w.str(inst.vpc_id);
+    w.str(inst.host);
+    w.i32(inst.port);
+    w.str(inst.protocol);
+    w.str(inst.version);
+    w.i32(inst.priority);
+    w.i32(inst.weight);
+    w.u8(inst.enable_healthcheck);
+    w.str(inst.healthcheck_type);
+    w.i32(inst.healthcheck_ttl);
+    w.u8(inst.healthy);
+    w.u8(inst.isolate);
+    w.str(inst.logic_set);
+    w.str(inst.mtime);
+    w.str(inst.revision);
+    w.str(inst.region);
+    w.str(inst.zone);
+    w.str(inst.campus);
+    w.str_map(inst.metadata);
+}
+
+static void read_instance(CacheReader &r, struct instance &inst) {
+    r.str(inst.id);
+    r.str(inst.service);
+    r.str(inst.service_namespace);
+    r.str(inst.vpc_id);
+    r.str(inst.host);
+    inst.port = r.i32();
+    r.str(inst.protocol);
+    r.str(inst.version);
+    inst.priority = r.i32();
+    inst.weight = r.i32();
+    inst.enable_healthcheck = r.u8() != 0;
+    r.str(inst.healthcheck_type);
+    inst.healthcheck_ttl = r.i32();
+    inst.healthy = r.u8() != 0;
+    inst.isolate = r.u8() != 0;
+    r.str(inst.logic_set);
+    r.str(inst.mtime);
+    r.str(inst.revision);
+    r.str(inst.region);
+    r.str(inst.zone);
+    r.str(inst.campus);
+    r.str_map(inst.metadata);
+}
+
+static void write_labels(CacheWriter &w, const std::map<std::string, struct meta_label> &labels) {
+    w.u32((uint32_t)labels.size());
+    for (const auto &kv : labels) {
+        w.str(kv.first);
+        w.str(kv.second.type);
+        w.str(kv.second.value_type);
+        w.str(kv.second.value);
+    }
+}
+
+static void read_labels(CacheReader &r, std::map<std::string, struct meta_label> &labels) {
+    uint32_t n = r.count(16);
+    std::string key;
+
+    labels.clear();
+    for (uint32_t i = 0; i < n; i++) {
+        r.str(key);
+        struct meta_label &label = labels[key];
+        r.str(label.type);
+        r.str(label.value_type);
+        r.str(label.value);
+    }
+}
+
+static void write_bounds(CacheWriter &w, const std::vector<struct routing_bound> &bounds) {
+    w.u32((uint32_t)bounds.size());
+    for (const struct routing_bound &bound : bounds) {
+        w.u32((uint32_t)bound.source_bounds.size());
+        for (const struct source_bound &src : bound.source_bounds) {
+            w.str(src.service);
+            w.str(src.service_namespace);
+            write_labels(w, src.metadata);
+        }
+
+        w.u32((uint32_t)bound.destination_bounds.size());
+        for (const struct destination_bound &dst : bound.destination_bounds) {
+            w.str(dst.service);
+            w.str(dst.service_namespace);
+            write_labels(w, dst.metadata);
+            w.i32(dst.priority);
+            w.i32(dst.weight);
+        }
+    }
+}
+
+static void read_bounds(CacheReader &r, std::vector<struct routing_bound> &bounds) {
+    uint32_t n = r.count(8);
+
+    bounds.clear();
+    bounds.resize(n);
+    for (struct routing_bound &bound : bounds) {
+        bound.source_bounds.resize(r.count(12));
+        for (struct source_bound &src : bound.source_bounds) {
+            r.str(src.service);
+            r.str(src.service_namespace);
+            read_labels(r, src.metadata);
+        }
+
+        bound.destination_bounds.resize(r.count(20));
+        for (struct destination_bound &dst : bound.destination_bounds) {
+            r.str(dst.service);
+            r.str(dst.service_namespace);
+            read_labels(r, dst.metadata);
+            dst.priority = r.i32();
+            dst.weight = r.i32();
+        }
+    }
+}
+
+// the characters other than [A-Za-z0-9._-] are written as %XX
+static void append_escaped(std::string &path, const std::string &str) {
+    static const char hex[] = "0123456789ABCDEF";
+
+    for (unsigned char c : str) {
+        if (isalnum(c) || c == '.' || c == '_' || c == '-') {
+            path.push_back(c);
+        } else {
+            path.push_back('%');
+            path.push_back(hex[c >> 4]);
+            path.push_back(hex[c & 15]);
+        }
+    }
+}
+
+static std::string cache_path(const std::string &dir, const std::string &service_namespace,
+                              const std::string &service_name, int kind) {
+    std::string path = dir;
+
+    if (!path.empty() && path.back() != '/')
+        path.push_back('/');
+
+    append_escaped(path, service_namespace);
+    path.push_back('#');
+    append_escaped(path, service_name);
+    path.append(kind == CACHE_INSTANCES ? ".instances" : ".routing");
+    return path;
+}
+
+// mkdir -p, the parents made by another process at the same time are fine
+static bool make_dirs(const std::string &dir) {
+    std::string::size_type pos = 0;
+    std::string path;
+
+    do {
+        pos = dir.find('/', pos + 1);
+        path = dir.substr(0, pos);
+        if (!path.empty() && mkdir(path.c_str(), 0755) < 0 && errno != EEXIST)
+            return false;
+    } while (pos != std::string::npos);
+
+    return true;
+}
+
+static bool write_cache_file(const std::string &path, int kind, CacheWriter &w) {
+    static std::atomic<unsigned int> next_id(0);
+    std::string payload = std::move(w.data());
+    CacheWriter header;
+    bool ok;
+
+    header.data().append(CACHE_MAGIC, 4);
+    header.u8(CACHE_VERSION);
+    header.u8(kind);
+    header.u8(0);
+    header.u8(0);
+    header.u32((uint32_t)payload.size());
+    header.u32(fnv1a(payload.data(), payload.size()));
+
+    // unique among the writers of this process and others sharing the dir
+    std::string tmp = path + "." + std::to_string(getpid()) + "." +
+                      std::to_string(++next_id) + ".tmp";
+    FILE *fp = fopen(tmp.c_str(), "wb");
+
+    if (!fp)
+        return false;
+
+    ok = fwrite(header.data().data(), 1, CACHE_HEADER_SIZE, fp) == CACHE_HEADER_SIZE &&
+         fwrite(payload.data(), 1, payload.size(), fp) == payload.size();
+    ok = fclose(fp) == 0 && ok;
+
+    if (ok && rename(tmp.c_str(), path.c_str()) == 0)
+        return true;
+
+    unlink(tmp.c_str());
+    return false;
+}
+
+static bool read_cache_file(const std::string &path, int kind, uint64_t expire_time,
+                            std::string &payload) {
+    FILE *fp = fopen(path.c_str(), "rb");
+    char header[CACHE_HEADER_SIZE];
+    struct stat st;
+    bool ok;
+
+    if (!fp)
+        return false;
+
+    // too old to be used, or too short to hold even the header. a file from
+    // the future after the clock is set back is taken as just written
+    ok = fstat(fileno(fp), &st) == 0 && st.st_size >= CACHE_HEADER_SIZE;
+    if (ok) {
+        long long age = (long long)time(NULL) - (long long)st.st_mtime;
+        ok = (age <= 0 || (uint64_t)age * 1000 < expire_time) &&
+             fread(header, 1, CACHE_HEADER_SIZE, fp) == CACHE_HEADER_SIZE;
+    }
+    if (ok) {
+        CacheReader r(header + 4, CACHE_HEADER_SIZE - 4);
+        uint8_t version = r.u8();
+        uint8_t file_kind = r.u8();
+        r.u8();
+        r.u8();
+        uint32_t size = r.u32();
+        uint32_t checksum = r.u32();
+
+        // the size is checked against the file before anything is allocated
+        ok = memcmp(header, CACHE_MAGIC, 4) == 0 && version == CACHE_VERSION &&
+             file_kind == kind && (off_t)size == st.st_size - CACHE_HEADER_SIZE;
+        if (ok) {
+            payload.resize(size);
+            ok = fread(&payload[0], 1, size, fp) == size && fgetc(fp) == EOF &&
+                 fnv1a(payload.data(), size) == checksum;
+        }
+    }
+
+    fclose(fp);
+    return ok;
+}
+
+bool save_discover_cache(const std::string &dir, const struct discover_result &result) {
+    CacheWriter w;
+
+    w.str(result.type);
+    w.str(result.service_namespace);
+    w.str(result.service_name);
+    w.str(result.service_revision);
+    w.str_map(result.service_metadata);
+    w.str(result.service_ports);
+    w.str(result.service_business);
+    w.str(result.service_department);
+    w.str(result.service_cmdbmod1);
+    w.str(result.service_cmdbmod2);
+    w.str(result.service_cmdbmod3);
+    w.str(result.service_comment);
+    w.str(result.service_owners);
+    w.str(result.service_ctime);
+    w.str(result.service_mtime);
+    w.str(result.service_platform_id);
+    w.u32((uint32_t)result.instances.size());
+    for (const struct instance &inst : result.instances)
+        write_instance(w, inst);
+
+    if (!make_dirs(dir))
+        return false;
+
+    return write_cache_file(cache_path(dir, result.service_namespace, result.service_name,
+                                       CACHE_INSTANCES),
+                            CACHE_INSTANCES, w);
+}
+
+bool load_discover_cache(const std::string &dir, const std::string &service_namespace,
+                         const std::string &service_name, uint64_t expire_time,
+                         struct discover_result *result) {
+    std::string payload;
+
+    if (!read_cache_file(cache_path(dir, service_namespace, service_name, CACHE_INSTANCES),
+                         CACHE_INSTANCES, expire_time, payload)) {
+        return false;
+    }
+
+    CacheReader r(payload.data(), payload.size());
+
+    result->code = 200000;
+    result->info.clear();
+    r.str(result->type);
+    r.str(result->service_namespace);
+    r.str(result->service_name);
+    r.str(result->service_revision);
+    r.str_map(result->service_metadata);
+    r.str(result->service_ports);
+    r.str(result->service_business);
+    r.str(result->service_department);
+    r.str(result->service_cmdbmod1);
+    r.str(result->service_cmdbmod2);
+    r.str(result->service_cmdbmod3);
+    r.str(result->service_comment);
+    r.str(result->service_owners);
+    r.str(result->service_ctime);
+    r.str(result->service_mtime);
+    r.str(result->service_platform_id);
+    result->instances.clear();
+    result->instances.resize(r.count(64));
+    for (struct instance &inst : result->instances)
+        read_instance(r, inst);
+
+    // a file renamed by hand is not taken for another service
+    return r.finish() && result->service_namespace == service_namespace &&
+           result->service_name == service_name;
+}
+
+bool save_route_cache(const std::string &dir, const struct route_result &result) {
+    CacheWriter w;
+
+    w.str(result.type);
+    w.str(result.service_namespace);
+    w.str(result.service_name);
+    w.str(result.routing_service);
+    w.str(result.routing_namespace);
+    write_bounds(w, result.routing_inbounds);
+    write_bounds(w, result.routing_outbounds);
+    w.str(result.routing_ctime);
+    w.str(result.routing_mtime);
+    w.str(result.routing_revision);
+
+    if (!make_dirs(dir))
+        return false;
+
+    return write_cache_file(cache_path(dir, result.service_namespace, result.service_name,
+                                       CACHE_ROUTING),
+                            CACHE_ROUTING, w);
+}
+
+bool load_route_cache(const std::string &dir, const std::string &service_namespace,
+                      const std::string &service_name, uint64_t expire_time,
+                      struct route_result *result) {
+    std::string payload;
+
+    if (!read_cache_file(cache_path(dir, service_namespace, service_name, CACHE_ROUTING),
+                         CACHE_ROUTING, expire_time, payload)) {
+        return false;
+    }
+
+    CacheReader r(payload.data(), payload.size());
+
+    result->code = 200000;
+    result->info.clear();
+    r.str(result->type);
+    r.str(result->service_namespace);
+    r.str(result->service_name);
+    r.str(result->routing_service);
+    r.str(result->routing_namespace);
+    read_bounds(r, result->routing_inbounds);
+    read_bounds(r, result->routing_outbounds);
+    r.str(result->routing_ctime);
+    r.str(result->routing_mtime);
+    r.str(result->routing_revision);
+
+    return r.finish() && result->service_namespace == service_namespace &&
+           result->service_name == service_name;
+}
+
+};  // namespace polaris
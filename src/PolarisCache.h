@@ -0,0 +1,39 @@
+#ifndef _POLARISCACHE_H_
+#define _POLARISCACHE_H_
+
+#include <stdint.h>
+#include <string>
+#include "PolarisConfig.h"
+
+namespace polaris {
+
+/*
+ * The last discover_result and route_result of a service, kept in persistDir
+ * so that watching it again after a restart doesn`t wait for polaris server,
+ * or fail if the server is unreachable.
+ *
+ * Each one is a file of its own under dir, named by the namespace and name
+ * of the service. A file is a fixed header with a checksum followed by the
+ * fields in a compact binary form, and is replaced by rename() as a whole,
+ * so a reader never sees a half written one.
+ *
+ * Save returns false if the file can not be written. Load returns false if
+ * the file is missing, of another format version, damaged, or written more
+ * than expire_time milliseconds ago. A loaded result has code 200000 and
+ * the revision it was saved with.
+ */
+bool save_discover_cache(const std::string &dir, const struct discover_result &result);
+
+bool load_discover_cache(const std::string &dir, const std::string &service_namespace,
+                         const std::string &service_name, uint64_t expire_time,
+                         struct discover_result *result);
+
+bool save_route_cache(const std::string &dir, const struct route_result &result);
+
+bool load_route_cache(const std::string &dir, const std::string &service_namespace,
+                      const std::string &service_name, uint64_t expire_time,
+                      struct route_result *result);
+
+};  // namespace polaris
+
+#endif
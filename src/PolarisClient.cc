@@ -46,6 +46,7 @@ int PolarisClient::init(const std::string &url) {
         this->cluster = NULL;
         return -1;
     }
+    this->cluster->create_upstreams();
     return 0;
 }
 
@@ -110,6 +111,18 @@ PolarisTask *PolarisClient::create_heartbeat_task(const std::string &service_nam
     return task;
 }
 
+void PolarisClient::set_revision(const std::string &service_namespace,
+                                 const std::string &service_name,
+                                 const std::string &service_revision,
+                                 const std::string &routing_revision) {
+    std::string servicekey = service_namespace + "." + service_name;
+
+    this->cluster->get_mutex()->lock();
+    (*this->cluster->get_revision_map())[servicekey] = service_revision;
+    (*this->cluster->get_routing_revision_map())[servicekey] = routing_revision;
+    this->cluster->get_mutex()->unlock();
+}
+
 void PolarisClient::deinit() {
     delete this->cluster;
     this->cluster = NULL;
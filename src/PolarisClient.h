@@ -38,6 +38,11 @@ class PolarisClient {
                                        const std::string &service_name, int retry,
                                        polaris_callback_t cb);
 
+    // the revisions sent by the following discover tasks of the service
+    void set_revision(const std::string &service_namespace, const std::string &service_name,
+                      const std::string &service_revision,
+                      const std::string &routing_revision);
+
   public:
     virtual ~PolarisClient();
     void deinit();
@@ -1,6 +1,8 @@
 #ifndef _POLARISCLUSTER_H_
 #define _POLARISCLUSTER_H_
 
+#include "PolarisUpstream.h"
+
 namespace polaris {
 
 class PolarisCluster {
@@ -42,11 +44,20 @@ class PolarisCluster {
     std::vector<std::string> *get_monitor_clusters() { return &this->data->monitor_clusters; }
     std::vector<std::string> *get_metrics_clusters() { return &this->data->metrics_clusters; }
     std::map<std::string, std::string> *get_revision_map() { return &this->data->revision_map; }
+    std::map<std::string, std::string> *get_routing_revision_map() {
+        return &this->data->routing_revision_map;
+    }
 
-    int discover_failed() { return ++this->data->discover_failed_cnt; }
-    void clear_discover_failed() { this->data->discover_failed_cnt = 0; }
-    int healthcheck_failed() { return ++this->data->healthcheck_failed_cnt; }
-    void clear_healthcheck_failed() { this->data->healthcheck_failed_cnt = 0; }
+    // once for all the copies, not in the constructor, or every task would
+    // register and remove upstreams of its own in the global name service
+    void create_upstreams() {
+        this->data->discover_upstream = PolarisUpstream::create("polaris.discover");
+        this->data->healthcheck_upstream = PolarisUpstream::create("polaris.healthcheck");
+    }
+
+    // the requests to discover/healthcheck clusters are sent to these upstreams
+    PolarisUpstream *get_discover_upstream() { return this->data->discover_upstream; }
+    PolarisUpstream *get_healthcheck_upstream() { return this->data->healthcheck_upstream; }
 
   private:
     void incref() { (*this->ref)++; }
@@ -69,14 +80,18 @@ class PolarisCluster {
         std::vector<std::string> monitor_clusters;
         std::vector<std::string> metrics_clusters;
         std::map<std::string, std::string> revision_map;
-        int discover_failed_cnt;
-        int healthcheck_failed_cnt;
-        //TODO: add other fail count when other cluster requests are supported
+        std::map<std::string, std::string> routing_revision_map;
+        PolarisUpstream *discover_upstream;
+        PolarisUpstream *healthcheck_upstream;
+
+        cluster_data() : discover_upstream(NULL), healthcheck_upstream(NULL) { }
 
-        cluster_data()
+        ~cluster_data()
         {
-            discover_failed_cnt = 0;
-            healthcheck_failed_cnt = 0;
+            if (discover_upstream)
+                PolarisUpstream::destroy(discover_upstream);
+            if (healthcheck_upstream)
+                PolarisUpstream::destroy(healthcheck_upstream);
         }
     };
 
@@ -1,3 +1,4 @@
+#include <stdlib.h>
 #include "PolarisConfig.h"
 #include "json.hpp"
 #include "yaml-cpp/yaml.h"
@@ -587,6 +588,25 @@ int init_global_from_yaml(struct polaris_config *ptr, const YAML::Node &node) {
                 return -1;
             }
             ptr->discover_refresh_interval = discover_interval_ms;
+            // the same as refreshInterval if not set, which turns off adaption
+            std::string min_interval = discover["minRefreshInterval"].as<std::string>("");
+            std::string max_interval = discover["maxRefreshInterval"].as<std::string>("");
+            uint64_t min_interval_ms = discover_interval_ms;
+            uint64_t max_interval_ms = discover_interval_ms;
+            if ((!min_interval.empty() && !ParseTimeValue(min_interval, min_interval_ms)) ||
+                (!max_interval.empty() && !ParseTimeValue(max_interval, max_interval_ms)) ||
+                min_interval_ms == 0 || min_interval_ms > discover_interval_ms ||
+                max_interval_ms < discover_interval_ms) {
+                return -1;
+            }
+            ptr->discover_min_refresh_interval = min_interval_ms;
+            ptr->discover_max_refresh_interval = max_interval_ms;
+            std::string long_poll_timeout = discover["longPollTimeout"].as<std::string>("0");
+            uint64_t long_poll_timeout_ms;
+            if (!ParseTimeValue(long_poll_timeout, long_poll_timeout_ms)) {
+                return -1;
+            }
+            ptr->discover_long_poll_timeout = long_poll_timeout_ms;
         }
         // init system's helathCluster
         if (system["healthCheckCluster"].IsDefined() && !system["healthCheckCluster"].IsNull()) {
@@ -728,6 +748,19 @@ int init_consumer_from_yaml(struct polaris_config *ptr, const YAML::Node &node)
             return -1;
         }
         ptr->service_expire_time = service_expire_time_ms;
+        ptr->service_refresh_batch = local_cache["serviceRefreshBatch"].as<bool>(false);
+        ptr->service_refresh_batch_size =
+            local_cache["serviceRefreshBatchSize"].as<int>(16);
+        if (ptr->service_refresh_batch_size <= 0) {
+            return -1;
+        }
+        if (local_cache["persistDir"].IsDefined() && !local_cache["persistDir"].IsNull()) {
+            ptr->persist_dir = local_cache["persistDir"].as<std::string>();
+            const char *home = getenv("HOME");
+            if (ptr->persist_dir.compare(0, 5, "$HOME") == 0 && home) {
+                ptr->persist_dir.replace(0, 5, home);
+            }
+        }
     }
     // init circuitBreaker config
     if (consumer["circuitBreaker"].IsDefined() && !consumer["circuitBreaker"].IsNull()) {
@@ -942,7 +975,10 @@ void PolarisInstance::instance_init() {
 void PolarisConfig::polaris_config_init_global() {
     this->ptr->discover_namespace = "Polaris";
     this->ptr->discover_name = "polaris.discover";
-    this->ptr->discover_refresh_interval = 6000000;  // 10 * 60 * 1000 milliseconds
+    this->ptr->discover_refresh_interval = 600000;  // 10 * 60 * 1000 milliseconds
+    this->ptr->discover_min_refresh_interval = 600000;
+    this->ptr->discover_max_refresh_interval = 600000;
+    this->ptr->discover_long_poll_timeout = 0;
     this->ptr->healthcheck_namespace = "Polaris";
     this->ptr->healthcheck_name = "polaris.healthcheck";
     this->ptr->healthcheck_refresh_interval = 6000000;
@@ -970,6 +1006,8 @@ void PolarisConfig::polaris_config_init_global() {
 void PolarisConfig::polaris_config_init_consumer() {
     this->ptr->service_refresh_interval = 2000;
     this->ptr->service_expire_time = 86400000;
+    this->ptr->service_refresh_batch = false;
+    this->ptr->service_refresh_batch_size = 16;
     this->ptr->circuit_breaker_enable = true;
     this->ptr->circuit_breaker_check_period = 500;
     this->ptr->circuit_breaker_chain.push_back("errorCount");
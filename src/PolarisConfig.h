@@ -33,6 +33,10 @@ struct polaris_config {
     std::string discover_namespace;
     std::string discover_name;
     uint64_t discover_refresh_interval;
+    // bounds of the adaptive refresh interval of each watched service
+    uint64_t discover_min_refresh_interval;
+    uint64_t discover_max_refresh_interval;
+    uint64_t discover_long_poll_timeout;
     std::string healthcheck_namespace;
     std::string healthcheck_name;
     uint64_t healthcheck_refresh_interval;
@@ -69,6 +73,11 @@ struct polaris_config {
     // 服务定期刷新周期
     uint64_t service_refresh_interval;
     uint64_t service_expire_time;
+    // 是否由一个定时器批量刷新所有服务，以及每批并发的请求数
+    bool service_refresh_batch;
+    int service_refresh_batch_size;
+    // 服务数据持久化目录，为空则不持久化
+    std::string persist_dir;
     // consumer/circuitBreaker: 熔断
     // 是否启用节点熔断功能
     bool circuit_breaker_enable;
@@ -547,6 +556,15 @@ class PolarisConfig {
     uint64_t get_discover_refresh_interval() const {
         return this->ptr->discover_refresh_interval;
     }
+    uint64_t get_discover_min_refresh_interval() const {
+        return this->ptr->discover_min_refresh_interval;
+    }
+    uint64_t get_discover_max_refresh_interval() const {
+        return this->ptr->discover_max_refresh_interval;
+    }
+    uint64_t get_discover_long_poll_timeout() const {
+        return this->ptr->discover_long_poll_timeout;
+    }
     std::string get_healthcheck_namespace() const {
         return this->ptr->healthcheck_namespace;
     }
@@ -606,6 +624,15 @@ class PolarisConfig {
     uint64_t get_service_expire_time() const {
         return this->ptr->service_expire_time;
     }
+    bool get_service_refresh_batch() const {
+        return this->ptr->service_refresh_batch;
+    }
+    int get_service_refresh_batch_size() const {
+        return this->ptr->service_refresh_batch_size;
+    }
+    const std::string &get_persist_dir() const {
+        return this->ptr->persist_dir;
+    }
     bool get_circuit_breaker_enable() const {
         return this->ptr->circuit_breaker_enable;
     }
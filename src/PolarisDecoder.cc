@@ -0,0 +1,464 @@
+#include <stdint.h>
+#include <iterator>
+#include <string>
+#include <vector>
+#include "workflow/HttpUtil.h"
+#include "PolarisDecoder.h"
+#include "json.hpp"
+
+using nlohmann::json;
+
+namespace polaris {
+
+// the same defaults as from_json() in PolarisConfig.cc
+static const int kDefaultInstancePort = 0;
+static const int kDefaultInstancePriority = 0;
+static const int kDefaultInstanceWeight = 100;
+static const int kDefaultInstanceHealthCheckTTL = 5;
+static const char kDefaultInstanceHealthCheckType[] = "HEARTBEAT";
+
+enum DecodeContext {
+    CTX_ROOT,
+    CTX_RESPONSE,
+    CTX_SERVICE,
+    CTX_SERVICE_META,
+    CTX_INSTANCES,
+    CTX_INSTANCE,
+    CTX_INSTANCE_META,
+    CTX_HEALTHCHECK,
+    CTX_HEARTBEAT,
+    CTX_SKIP,
+};
+
+// required fields seen, the same as the ones json::at() in from_json()
+#define FIELD_CODE         1
+#define FIELD_INFO        (1 << 1)
+#define FIELD_TYPE        (1 << 2)
+#define FIELD_NAMESPACE   (1 << 3)
+#define FIELD_NAME        (1 << 4)
+#define FIELD_REVISION    (1 << 5)
+#define FIELDS_RESPONSE   (FIELD_CODE | FIELD_INFO | FIELD_TYPE | \
+                           FIELD_NAMESPACE | FIELD_NAME | FIELD_REVISION)
+
+#define FIELD_INST_ID         1
+#define FIELD_INST_SERVICE   (1 << 1)
+#define FIELD_INST_NAMESPACE (1 << 2)
+#define FIELD_INST_HOST      (1 << 3)
+#define FIELD_INST_MTIME     (1 << 4)
+#define FIELD_INST_REVISION  (1 << 5)
+#define FIELDS_INSTANCE      (FIELD_INST_ID | FIELD_INST_SERVICE | \
+                              FIELD_INST_NAMESPACE | FIELD_INST_HOST | \
+                              FIELD_INST_MTIME | FIELD_INST_REVISION)
+
+class DiscoverDecoder : public nlohmann::json_sax<json> {
+  public:
+    DiscoverDecoder(struct discover_result *result) : result(result) {
+        this->fields = 0;
+        this->inst_fields = 0;
+        this->unchanged = false;
+        this->inst = NULL;
+        this->context.reserve(8);
+        this->context.push_back(CTX_ROOT);
+        this->result->code = 0;
+        this->result->instances.clear();
+        this->result->service_metadata.clear();
+    }
+
+    bool finish(bool parsed) {
+        if (this->unchanged) {
+            this->result->instances.clear();
+            return true;
+        }
+
+        if (!parsed || !(this->fields & FIELD_CODE))
+            return false;
+
+        if (this->result->code != 200000)
+            return true;
+
+        return (this->fields & FIELDS_RESPONSE) == FIELDS_RESPONSE;
+    }
+
+    virtual bool null() {
+        // null is the same as absent, the defaults are already there
+        return true;
+    }
+
+    virtual bool boolean(bool val) {
+        switch (this->context.back()) {
+            case CTX_INSTANCE:
+                if (this->current_key == "enableHealthCheck")
+                    this->inst->enable_healthcheck = val;
+                else if (this->current_key == "healthy")
+                    this->inst->healthy = val;
+                else if (this->current_key == "isolate")
+                    this->inst->isolate = val;
+                else
+                    return this->unknown();
+                return true;
+            default:
+                return this->unknown();
+        }
+    }
+
+    virtual bool number_integer(number_integer_t val) { return this->number((int64_t)val); }
+
+    virtual bool number_unsigned(number_unsigned_t val) { return this->number((int64_t)val); }
+
+    virtual bool number_float(number_float_t val, const string_t &) {
+        return this->number((int64_t)val);
+    }
+
+    virtual bool string(string_t &val) {
+        std::string *field = NULL;
+
+        switch (this->context.back()) {
+            case CTX_RESPONSE:
+                if (this->current_key == "info") {
+                    field = &this->result->info;
+                    this->fields |= FIELD_INFO;
+                } else if (this->current_key == "type") {
+                    field = &this->result->type;
+                    this->fields |= FIELD_TYPE;
+                }
+                break;
+            case CTX_SERVICE:
+                field = this->service_field();
+                break;
+            case CTX_SERVICE_META:
+                field = &this->result->service_metadata[this->current_key];
+                break;
+            case CTX_INSTANCE:
+                field = this->instance_field();
+                break;
+            case CTX_INSTANCE_META:
+                field = &this->inst->metadata[this->current_key];
+                break;
+            case CTX_HEALTHCHECK:
+                if (this->current_key == "type")
+                    field = &this->inst->healthcheck_type;
+                break;
+            default:
+                break;
+        }
+
+        if (!field)
+            return this->unknown();
+
+        *field = std::move(val);
+        return true;
+    }
+
+    virtual bool binary(binary_t &) { return this->unknown(); }
+
+    virtual bool start_object(std::size_t) {
+        int next = CTX_SKIP;
+
+        switch (this->context.back()) {
+            case CTX_ROOT:
+                next = CTX_RESPONSE;
+                break;
+            case CTX_RESPONSE:
+                if (this->current_key == "service")
+                    next = CTX_SERVICE;
+                break;
+            case CTX_SERVICE:
+                if (this->current_key == "metadata")
+                    next = CTX_SERVICE_META;
+                break;
+            case CTX_INSTANCES:
+                this->result->instances.emplace_back();
+                this->inst = &this->result->instances.back();
+                this->init_instance();
+                next = CTX_INSTANCE;
+                break;
+            case CTX_INSTANCE:
+                if (this->current_key == "metadata") {
+                    next = CTX_INSTANCE_META;
+                } else if (this->current_key == "healthCheck") {
+                    this->inst->healthcheck_type = kDefaultInstanceHealthCheckType;
+                    next = CTX_HEALTHCHECK;
+                }
+                break;
+            case CTX_HEALTHCHECK:
+                if (this->current_key == "heartbeat") {
+                    this->inst->healthcheck_ttl = kDefaultInstanceHealthCheckTTL;
+                    next = CTX_HEARTBEAT;
+                }
+                break;
+            default:
+                break;
+        }
+
+        this->context.push_back(next);
+        return true;
+    }
+
+    virtual bool key(string_t &val) {
+        this->current_key.assign(val);
+        return true;
+    }
+
+    virtual bool end_object() {
+        if (this->context.back() == CTX_INSTANCE &&
+            (this->inst_fields & FIELDS_INSTANCE) != FIELDS_INSTANCE)
+            return false;
+
+        this->context.pop_back();
+        return true;
+    }
+
+    virtual bool start_array(std::size_t) {
+        int next = CTX_SKIP;
+
+        if (this->context.back() == CTX_RESPONSE &&
+            this->current_key == "instances")
+            next = CTX_INSTANCES;
+
+        this->context.push_back(next);
+        return true;
+    }
+
+    virtual bool end_array() {
+        this->context.pop_back();
+        return true;
+    }
+
+    virtual bool parse_error(std::size_t, const std::string &,
+                             const nlohmann::detail::exception &) {
+        return false;
+    }
+
+  private:
+    bool number(int64_t val) {
+        switch (this->context.back()) {
+            case CTX_RESPONSE:
+                if (this->current_key == "code") {
+                    this->result->code = (int)val;
+                    this->fields |= FIELD_CODE;
+                    // the revision we sent is current, stop reading the rest
+                    if (val == 200001) {
+                        this->unchanged = true;
+                        return false;
+                    }
+                    return true;
+                }
+                break;
+            case CTX_INSTANCE:
+                if (this->current_key == "priority") {
+                    this->inst->priority = (int)val;
+                    return true;
+                } else if (this->current_key == "port") {
+                    this->inst->port = (int)val;
+                    return true;
+                } else if (this->current_key == "weight") {
+                    this->inst->weight = (int)val;
+                    return true;
+                }
+                break;
+            case CTX_HEARTBEAT:
+                if (this->current_key == "ttl") {
+                    this->inst->healthcheck_ttl = (int)val;
+                    return true;
+                }
+                break;
+            default:
+                break;
+        }
+
+        return this->unknown();
+    }
+
+    // a value of a key we don't know is fine, a known key of another type is not
+    bool unknown() {
+        switch (this->context.back()) {
+            case CTX_SKIP:
+            case CTX_ROOT:
+                return true;
+            case CTX_RESPONSE:
+                return this->current_key != "code" &&
+                       this->current_key != "info" &&
+                       this->current_key != "type";
+            case CTX_SERVICE:
+                return this->service_field() == NULL;
+            case CTX_INSTANCE:
+                return this->instance_field() == NULL &&
+                       this->current_key != "priority" &&
+                       this->current_key != "port" &&
+                       this->current_key != "weight" &&
+                       this->current_key != "enableHealthCheck" &&
+                       this->current_key != "healthy" &&
+                       this->current_key != "isolate";
+            case CTX_HEALTHCHECK:
+                return this->current_key != "type";
+            case CTX_HEARTBEAT:
+                return this->current_key != "ttl";
+            default:
+                return false;
+        }
+    }
+
+    std::string *service_field() {
+        const std::string &k = this->current_key;
+
+        if (k == "namespace") {
+            this->fields |= FIELD_NAMESPACE;
+            return &this->result->service_namespace;
+        } else if (k == "name") {
+            this->fields |= FIELD_NAME;
+            return &this->result->service_name;
+        } else if (k == "revision") {
+            this->fields |= FIELD_REVISION;
+            return &this->result->service_revision;
+        } else if (k == "ports") {
+            return &this->result->service_ports;
+        } else if (k == "business") {
+            return &this->result->service_business;
+        } else if (k == "department") {
+            return &this->result->service_department;
+        } else if (k == "cmdb_mod1") {
+            return &this->result->service_cmdbmod1;
+        } else if (k == "cmdb_mod2") {
+            return &this->result->service_cmdbmod2;
+        } else if (k == "cmdb_mod3") {
+            return &this->result->service_cmdbmod3;
+        } else if (k == "comment") {
+            return &this->result->service_comment;
+        } else if (k == "owners") {
+            return &this->result->service_owners;
+        } else if (k == "ctime") {
+            return &this->result->service_ctime;
+        } else if (k == "mtime") {
+            return &this->result->service_mtime;
+        } else if (k == "platform_id") {
+            return &this->result->service_platform_id;
+        }
+
+        return NULL;
+    }
+
+    std::string *instance_field() {
+        const std::string &k = this->current_key;
+
+        if (k == "id") {
+            this->inst_fields |= FIELD_INST_ID;
+            return &this->inst->id;
+        } else if (k == "service") {
+            this->inst_fields |= FIELD_INST_SERVICE;
+            return &this->inst->service;
+        } else if (k == "namespace") {
+            this->inst_fields |= FIELD_INST_NAMESPACE;
+            return &this->inst->service_namespace;
+        } else if (k == "host") {
+            this->inst_fields |= FIELD_INST_HOST;
+            return &this->inst->host;
+        } else if (k == "mtime") {
+            this->inst_fields |= FIELD_INST_MTIME;
+            return &this->inst->mtime;
+        } else if (k == "revision") {
+            this->inst_fields |= FIELD_INST_REVISION;
+            return &this->inst->revision;
+        } else if (k == "vpc_id") {
+            return &this->inst->vpc_id;
+        } else if (k == "protocol") {
+            return &this->inst->protocol;
+        } else if (k == "version") {
+            return &this->inst->version;
+        } else if (k == "logic_set") {
+            return &this->inst->logic_set;
+        }
+
+        return NULL;
+    }
+
+    void init_instance() {
+        this->inst_fields = 0;
+        this->inst->port = kDefaultInstancePort;
+        this->inst->priority = kDefaultInstancePriority;
+        this->inst->weight = kDefaultInstanceWeight;
+        this->inst->enable_healthcheck = false;
+        this->inst->healthcheck_ttl = 0;
+        this->inst->healthy = true;
+        this->inst->isolate = false;
+    }
+
+  private:
+    struct discover_result *result;
+    struct instance *inst;
+    std::vector<int> context;
+    std::string current_key;
+    int fields;
+    int inst_fields;
+    bool unchanged;
+};
+
+// walks through the chunks of a message as one sequence of chars
+class ChunkIterator {
+  public:
+    using iterator_category = std::input_iterator_tag;
+    using value_type = char;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const char *;
+    using reference = const char &;
+
+    ChunkIterator() : cursor(NULL), pos(NULL), end(NULL) {}
+
+    explicit ChunkIterator(protocol::HttpChunkCursor *cursor) : cursor(cursor) {
+        this->next_chunk();
+    }
+
+    reference operator*() const { return *this->pos; }
+
+    ChunkIterator &operator++() {
+        if (++this->pos == this->end)
+            this->next_chunk();
+        return *this;
+    }
+
+    bool operator==(const ChunkIterator &other) const { return this->pos == other.pos; }
+    bool operator!=(const ChunkIterator &other) const { return this->pos != other.pos; }
+
+  private:
+    void next_chunk() {
+        const void *chunk;
+        size_t size;
+
+        while (this->cursor->next(&chunk, &size)) {
+            if (size > 0) {
+                this->pos = (const char *)chunk;
+                this->end = this->pos + size;
+                return;
+            }
+        }
+
+        this->pos = NULL;
+        this->end = NULL;
+    }
+
+  private:
+    protocol::HttpChunkCursor *cursor;
+    const char *pos;
+    const char *end;
+};
+
+bool decode_discover_result(const char *body, size_t size,
+                            struct discover_result *result) {
+    DiscoverDecoder decoder(result);
+
+    bool parsed = json::sax_parse(body, body + size, &decoder);
+
+    return decoder.finish(parsed);
+}
+
+bool decode_discover_result(const protocol::HttpMessage *msg,
+                            struct discover_result *result) {
+    protocol::HttpChunkCursor cursor(msg);
+    DiscoverDecoder decoder(result);
+
+    bool parsed = json::sax_parse(ChunkIterator(&cursor), ChunkIterator(),
+                                  &decoder);
+
+    return decoder.finish(parsed);
+}
+
+};  // namespace polaris
@@ -0,0 +1,29 @@
+#ifndef _POLARISDECODER_H_
+#define _POLARISDECODER_H_
+
+#include <stddef.h>
+#include "workflow/HttpMessage.h"
+#include "PolarisConfig.h"
+
+namespace polaris {
+
+/*
+ * Decode the response of /v1/Discover for instances straight into result,
+ * without building the json DOM first. Fields and defaults are the same as
+ * from_json(const json &, struct discover_result &).
+ *
+ * Returns false if the body is not valid json or misses a required field.
+ * Otherwise result->code is the code of the response, and the other fields
+ * are only meaningful if it is 200000. Decoding stops at code 200001, which
+ * means the revision in the request is current and nothing else is needed.
+ */
+bool decode_discover_result(const char *body, size_t size,
+                            struct discover_result *result);
+
+// read the body chunk by chunk, with no decode_chunked_body() copy
+bool decode_discover_result(const protocol::HttpMessage *msg,
+                            struct discover_result *result);
+
+};  // namespace polaris
+
+#endif
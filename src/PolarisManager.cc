@@ -1,8 +1,58 @@
+#include <chrono>
+#include <algorithm>
+#include <set>
 #include "PolarisManager.h"
+#include "PolarisCache.h"
+#include "PolarisRandom.h"
+#include "PolarisTimingWheel.h"
 
 namespace polaris {
 
 #define RETRY_MAX	2
+// unchanged refreshes in a row before the interval of a service doubles
+#define REFRESH_BACKOFF_ROUNDS	3
+// heartbeats on the way to the server at the same time in one tick
+#define HEARTBEAT_BATCH_SIZE	128
+// the wheel of the refreshes and the heartbeats turns a slot every tick, its
+// timer sleeps until the earliest entry, but at most a lap of the slots
+#define WHEEL_TICK_MS	100
+#define WHEEL_SLOTS		512
+// the go tasks writing the cache of persistDir
+#define PERSIST_QUEUE	"polaris_persist"
+
+struct consumer_context;
+struct provider_context;
+
+enum
+{
+	WHEEL_REFRESH			=	0,
+	WHEEL_BATCH_REFRESH		=	1,
+	WHEEL_HEARTBEAT			=	2,
+};
+
+struct wheel_entry
+{
+	int type;
+	// the service and its refresh_id for WHEEL_REFRESH
+	std::string policy_name;
+	uint64_t refresh_id;
+	// the bucket for WHEEL_HEARTBEAT
+	int heartbeat_interval;
+	// in ticks, set by TimingWheel::add()
+	long long expire;
+};
+
+// the clock of the wheel
+static long long wheel_now_ms()
+{
+	auto now = std::chrono::steady_clock::now().time_since_epoch();
+	return std::chrono::duration_cast<std::chrono::milliseconds>(now).count();
+}
+
+static long long wheel_ticks(uint64_t ms)
+{
+	return (ms + WHEEL_TICK_MS - 1) / WHEEL_TICK_MS;
+}
 
 class Manager
 {
@@ -13,18 +63,36 @@ public:
 
 	int watch_service(const std::string& service_namespace,
 					  const std::string& service_name);
+	void async_watch_service(const std::string& service_namespace,
+							 const std::string& service_name,
+							 polaris_manager_callback_t callback);
+	int watch_services(const std::vector<std::pair<std::string, std::string>>& services);
 	int unwatch_service(const std::string& service_namespace,
 						const std::string& service_name);
+	void async_unwatch_service(const std::string& service_namespace,
+							   const std::string& service_name,
+							   polaris_manager_callback_t callback);
 
 	int register_service(const std::string& service_namespace,
 						 const std::string& service_name,
 						 const std::string& service_token,
 						 int heartbeat_interval,
 						 PolarisInstance instance);
+	void async_register_service(const std::string& service_namespace,
+								const std::string& service_name,
+								const std::string& service_token,
+								int heartbeat_interval,
+								PolarisInstance instance,
+								polaris_manager_callback_t callback);
 	int deregister_service(const std::string& service_namespace,
 						   const std::string& service_name,
 						   const std::string& service_token,
 						   PolarisInstance instance);
+	void async_deregister_service(const std::string& service_namespace,
+								  const std::string& service_name,
+								  const std::string& service_token,
+								  PolarisInstance instance,
+								  polaris_manager_callback_t callback);
 
 	int get_error() const { return this->error; }
 	void get_watching_list(std::vector<std::string>& list);
@@ -32,6 +100,7 @@ public:
 
 public:
 	void exit_locked();
+	void batch_refresh_done();
 	void incref() { ++this->ref; }
 	void decref()
 	{
@@ -52,19 +121,40 @@ private:
 	struct watch_info
 	{
 		bool watching;
+		std::string service_namespace;
+		std::string service_name;
 		std::string service_revision;
 		std::string routing_revision;
-		std::condition_variable cond;
+		uint64_t refresh_interval;
+		int unchanged_rounds;
+		// a poll was held by the server until its revision changed
+		bool long_poll_supported;
+		// of the refresh on the wheel, the ones of an earlier watch are dropped
+		uint64_t refresh_id;
+		// for the contexts of the refreshes
+		std::shared_ptr<const struct discover_body> discover_body;
+		// an unwatch waiting for the refresh on the way
+		polaris_manager_callback_t unwatch_callback;
 	};
 	struct register_info
 	{
 		bool heartbeating;
-		std::condition_variable cond;
+		// for the heartbeats, heartbeat_body is null if it has none
+		std::string service_namespace;
+		std::string service_name;
+		std::string service_token;
+		int heartbeat_interval;
+		PolarisInstance instance;
+		std::shared_ptr<const std::string> heartbeat_body;
+		// a deregister waiting for the heartbeat on the way
+		polaris_manager_callback_t deregister_callback;
 	};
 	std::mutex mutex;
 	std::unordered_map<std::string, struct watch_info> watch_status;
 	std::unordered_map<std::string, PolarisPolicy *> unwatch_policies;
 	std::unordered_map<std::string, struct register_info> register_status;
+	// the heartbeat intervals on the wheel
+	std::set<int> heartbeat_buckets;
 
 	enum
 	{
@@ -73,31 +163,61 @@ private:
 		MANAGER_EXITED	=	2,
 	};
 	int status;
+	// the batch refresh is on the wheel
+	bool batch_refreshing;
+	// the works of the last batch refresh are still on the way
+	bool batch_in_flight;
+	// one timer drives all the periodic work, it runs while the wheel is not
+	// empty. wheel_expire is the tick it is armed for, -1 if none, a timer
+	// armed for another tick was put off by an earlier entry and just exits
+	TimingWheel<struct wheel_entry> wheel;
+	long long wheel_expire;
+	// cancelled on exit, so a sleeping timer doesn`t hold the manager
+	std::string wheel_timer_name;
+	uint64_t next_refresh_id;
 
 	std::function<void (PolarisTask *task)> discover_cb;
-	std::function<void (WFTimerTask *task)> discover_timer_cb;
 	std::function<void (PolarisTask *task)> register_cb;
 	std::function<void (PolarisTask *task)> deregister_cb;
 	std::function<void (PolarisTask *task)> heartbeat_cb;
-	std::function<void (WFTimerTask *task)> heartbeat_timer_cb;
 
 private:
-	void set_error(int state, int error);
+	static int get_state_error(int state, int error);
+	static void user_request_done(PolarisTask *task, int error);
+	PolarisTask *create_discover_task(const std::string& service_namespace,
+									  const std::string& service_name);
+	PolarisTask *create_refresh_task(struct consumer_context *ctx, bool long_poll);
+	PolarisTask *create_heartbeat_task(const struct provider_context *ctx);
+	long long schedule_locked(struct wheel_entry entry, uint64_t ms);
+	void start_wheel(long long expire);
+	WFTimerTask *create_wheel_timer(long long expire);
+	SeriesWork *refresh_due_locked(const struct wheel_entry& entry);
+	SeriesWork *batch_refresh_due_locked();
+	SeriesWork *heartbeat_due_locked(int heartbeat_interval);
+	uint64_t next_refresh_interval_locked(struct watch_info& info,
+										  bool changed, bool failed);
 	bool update_policy_locked(const std::string& policy_name,
 							  struct discover_result *discover,
 							  struct route_result *route,
 							  bool is_user_request,
 							  bool update_instance,
-							  bool update_routing);
+							  bool update_routing,
+							  int *error,
+							  polaris_manager_callback_t *unwatch_callback);
 	bool update_heartbeat_locked(const std::string& instance_name,
-								 bool is_user_request);
+								 bool is_user_request,
+								 int *error,
+								 polaris_manager_callback_t *deregister_callback);
+	void unwatch_locked(const std::string& policy_name);
+	bool watch_from_cache(const std::string& service_namespace,
+						  const std::string& service_name,
+						  polaris_manager_callback_t& callback);
 
 	void discover_callback(PolarisTask *task);
 	void register_callback(PolarisTask *task);
 	void deregister_callback(PolarisTask *task);
 	void heartbeat_callback(PolarisTask *task);
-	void discover_timer_callback(WFTimerTask *task);
-	void heartbeat_timer_callback(WFTimerTask *task);
+	void wheel_timer_callback(WFTimerTask *task, long long expire);
 };
 
 struct consumer_context
@@ -105,8 +225,39 @@ struct consumer_context
 	std::string service_namespace;
 	std::string service_name;
 	Manager *mgr;
+	// when the last long poll was sent
+	std::chrono::steady_clock::time_point poll_start;
+	// serialized once for all the refreshes
+	std::shared_ptr<const struct discover_body> discover_body;
 };
 
+static void consumer_series_callback(const SeriesWork *series)
+{
+	struct consumer_context *ctx;
+	ctx = (struct consumer_context *)series->get_context();
+	ctx->mgr->decref();
+	delete ctx;
+}
+
+static void batch_series_callback(const SeriesWork *series)
+{
+	Manager *mgr = (Manager *)series->get_context();
+
+	mgr->batch_refresh_done();
+	mgr->decref();
+}
+
+static void save_cache(const std::string& dir,
+					   bool save_discover, const struct discover_result& discover,
+					   bool save_route, const struct route_result& route)
+{
+	if (save_discover)
+		save_discover_cache(dir, discover);
+
+	if (save_route)
+		save_route_cache(dir, route);
+}
+
 struct provider_context
 {
 	std::string service_namespace;
@@ -114,15 +265,23 @@ struct provider_context
 	std::string service_token;
 	int heartbeat_interval;
 	PolarisInstance instance;
+	// serialized once for all the heartbeats
+	std::shared_ptr<const std::string> heartbeat_body;
 	Manager *mgr;
 };
 
-struct deregister_context
+static void provider_series_callback(const SeriesWork *series)
 {
-	deregister_context() : wait_group(1) { }
+	struct provider_context *ctx;
+	ctx = (struct provider_context *)series->get_context();
+	ctx->mgr->decref();
+	delete ctx;
+}
 
-	WFFacilities::WaitGroup wait_group;
+struct deregister_context
+{
 	std::string instance_name;
+	polaris_manager_callback_t callback;
 };
 
 PolarisManager::PolarisManager(const std::string& polaris_url)
@@ -162,6 +321,8 @@ int PolarisManager::get_error() const
 
 void Manager::exit_locked()
 {
+	// the manager may be gone once unlocked
+	std::string timer_name = this->wheel_timer_name;
 	bool flag = false;
 
 	this->mutex.lock();
@@ -173,6 +334,8 @@ void Manager::exit_locked()
 
 	if (flag)
 		delete this;
+	else // wake up the timer of the wheel to let go of the manager
+		WFTaskFactory::cancel_by_name(timer_name);
 }
 
 int PolarisManager::watch_service(const std::string& service_namespace,
@@ -181,12 +344,34 @@ int PolarisManager::watch_service(const std::string& service_namespace,
 	return this->ptr->watch_service(service_namespace, service_name);
 }
 
+void PolarisManager::async_watch_service(const std::string& service_namespace,
+										 const std::string& service_name,
+										 polaris_manager_callback_t callback)
+{
+	this->ptr->async_watch_service(service_namespace, service_name,
+								   std::move(callback));
+}
+
+int PolarisManager::watch_services(const std::vector<std::pair<std::string,
+															   std::string>>& services)
+{
+	return this->ptr->watch_services(services);
+}
+
 int PolarisManager::unwatch_service(const std::string& service_namespace,
 									const std::string& service_name)
 {
 	return this->ptr->unwatch_service(service_namespace, service_name);
 }
 
+void PolarisManager::async_unwatch_service(const std::string& service_namespace,
+										   const std::string& service_name,
+										   polaris_manager_callback_t callback)
+{
+	this->ptr->async_unwatch_service(service_namespace, service_name,
+									 std::move(callback));
+}
+
 int PolarisManager::register_service(const std::string& service_namespace,
 									 const std::string& service_name,
 									 PolarisInstance instance)
@@ -215,6 +400,18 @@ int PolarisManager::register_service(const std::string& service_namespace,
 									   std::move(instance));
 }
 
+void PolarisManager::async_register_service(const std::string& service_namespace,
+											const std::string& service_name,
+											const std::string& service_token,
+											int heartbeat_interval,
+											PolarisInstance instance,
+											polaris_manager_callback_t callback)
+{
+	this->ptr->async_register_service(service_namespace, service_name,
+									  service_token, heartbeat_interval,
+									  std::move(instance), std::move(callback));
+}
+
 int PolarisManager::deregister_service(const std::string& service_namespace,
 									   const std::string& service_name,
 									   PolarisInstance instance)
@@ -232,6 +429,17 @@ int PolarisManager::deregister_service(const std::string& service_namespace,
 										 service_token, std::move(instance));
 }
 
+void PolarisManager::async_deregister_service(const std::string& service_namespace,
+											  const std::string& service_name,
+											  const std::string& service_token,
+											  PolarisInstance instance,
+											  polaris_manager_callback_t callback)
+{
+	this->ptr->async_deregister_service(service_namespace, service_name,
+										service_token, std::move(instance),
+										std::move(callback));
+}
+
 void PolarisManager::get_watching_list(std::vector<std::string>& list)
 {
 	this->ptr->get_watching_list(list);
@@ -251,7 +459,12 @@ Manager::Manager(const std::string& polaris_url,
 	polaris_url(polaris_url),
 	platform_id(platform_id),
 	platform_token(platform_token),
-	config(std::move(config))
+	config(std::move(config)),
+	batch_refreshing(false),
+	batch_in_flight(false),
+	wheel(WHEEL_SLOTS),
+	wheel_expire(-1),
+	next_refresh_id(0)
 {
 	if (client.init(polaris_url) == 0)
 		this->status = INIT_SUCCESS;
@@ -265,16 +478,13 @@ Manager::Manager(const std::string& polaris_url,
 
 	this->discover_cb = std::bind(&Manager::discover_callback,
 								  this, std::placeholders::_1);
-	this->discover_timer_cb = std::bind(&Manager::discover_timer_callback,
-										this, std::placeholders::_1);
 	this->register_cb = std::bind(&Manager::register_callback,
 								  this, std::placeholders::_1);
 	this->deregister_cb = std::bind(&Manager::deregister_callback,
 								    this, std::placeholders::_1);
 	this->heartbeat_cb = std::bind(&Manager::heartbeat_callback,
 								   this, std::placeholders::_1);
-	this->heartbeat_timer_cb = std::bind(&Manager::heartbeat_timer_callback,
-										 this, std::placeholders::_1);
+	this->wheel_timer_name = "polaris_wheel_" + std::to_string((uintptr_t)this);
 }
 
 Manager::~Manager()
@@ -292,74 +502,258 @@ Manager::~Manager()
 int Manager::watch_service(const std::string& service_namespace,
 						   const std::string& service_name)
 {
-	if (this->status == INIT_FAILED)
+	WFFacilities::WaitGroup wait_group(1);
+	int error;
+
+	this->async_watch_service(service_namespace, service_name,
+							  [&wait_group, &error](int ret) {
+		error = ret;
+		wait_group.done();
+	});
+	wait_group.wait();
+
+	if (error != 0)
+	{
+		this->error = error;
 		return -1;
+	}
 
-	PolarisTask *task;
-	task = this->client.create_discover_task(service_namespace.c_str(),
-											 service_name.c_str(),
-											 this->retry_max,
-											 this->discover_cb);
+	return 0;
+}
 
-	WFFacilities::WaitGroup wait_group(1);
-	task->user_data = &wait_group;
-	task->set_config(this->config);
-	if (!this->platform_id.empty() && !this->platform_token.empty())
+void Manager::async_watch_service(const std::string& service_namespace,
+								  const std::string& service_name,
+								  polaris_manager_callback_t callback)
+{
+	if (this->status == INIT_FAILED)
 	{
-		task->set_platform_id(platform_id);
-		task->set_platform_token(platform_token);
+		callback(POLARIS_ERR_INIT_FAILED);
+		return;
 	}
 
+	if (!this->config.get_persist_dir().empty() &&
+		this->watch_from_cache(service_namespace, service_name, callback))
+		return;
+
+	PolarisTask *task = this->create_discover_task(service_namespace,
+												   service_name);
+	task->user_data = new polaris_manager_callback_t(std::move(callback));
+
 	struct consumer_context *ctx = new consumer_context();
 	ctx->service_namespace = service_namespace;
 	ctx->service_name = service_name;
+	ctx->discover_body = PolarisTask::create_discover_body(service_namespace,
+														   service_name);
+	task->set_discover_body(ctx->discover_body);
 	ctx->mgr = this;
 	this->incref();
 
 	SeriesWork *series = Workflow::create_series_work(task,
-											[](const SeriesWork *series) {
-		struct consumer_context *ctx;
-		ctx = (struct consumer_context *)series->get_context();
-		ctx->mgr->decref();
-		delete ctx;
-	});
-
+													  consumer_series_callback);
 	series->set_context(ctx);
 	series->start();
+}
+
+int Manager::watch_services(const std::vector<std::pair<std::string,
+														std::string>>& services)
+{
+	if (services.empty())
+		return 0;
+
+	WFFacilities::WaitGroup wait_group(services.size());
+	std::mutex mutex;
+	int error = 0;
+
+	// all at once, so it takes about as long as watching one of them
+	for (const auto& service : services)
+	{
+		this->async_watch_service(service.first, service.second,
+								  [&wait_group, &mutex, &error](int ret) {
+			if (ret != 0)
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				if (error == 0)
+					error = ret;
+			}
+
+			wait_group.done();
+		});
+	}
+
 	wait_group.wait();
 
-	return this->error == 0 ? 0 : -1;
+	if (error != 0)
+	{
+		this->error = error;
+		return -1;
+	}
+
+	return 0;
 }
 
 int Manager::unwatch_service(const std::string& service_namespace,
 							 const std::string& service_name)
 {
-	if (this->status == INIT_FAILED)
+	WFFacilities::WaitGroup wait_group(1);
+	int error;
+
+	this->async_unwatch_service(service_namespace, service_name,
+								[&wait_group, &error](int ret) {
+		error = ret;
+		wait_group.done();
+	});
+	wait_group.wait();
+
+	if (error != 0)
+	{
+		this->error = error;
 		return -1;
+	}
+
+	return 0;
+}
+
+void Manager::async_unwatch_service(const std::string& service_namespace,
+									const std::string& service_name,
+									polaris_manager_callback_t callback)
+{
+	if (this->status == INIT_FAILED)
+	{
+		callback(POLARIS_ERR_INIT_FAILED);
+		return;
+	}
 
 	std::string policy_name = service_namespace + "." + service_name;
 
-	std::unique_lock<std::mutex> lock(this->mutex);
+	this->mutex.lock();
 	auto iter = this->watch_status.find(policy_name);
 
 	if (iter == this->watch_status.end())
 	{
-		this->error = POLARIS_ERR_SERVICE_NOT_FOUND;
-		return -1;
+		this->mutex.unlock();
+		callback(POLARIS_ERR_SERVICE_NOT_FOUND);
+		return;
+	}
+
+	if (iter->second.unwatch_callback)
+	{
+		this->mutex.unlock();
+		callback(POLARIS_ERR_DOUBLE_OPERATION);
+		return;
 	}
 
 	if (iter->second.watching == true)
 	{
+		// finished by update_policy_locked() of the refresh on the way
 		iter->second.watching = false;
-		iter->second.cond.wait(lock);
+		iter->second.unwatch_callback = std::move(callback);
+		this->mutex.unlock();
+		return;
 	}
-	this->watch_status.erase(iter);
 
+	this->unwatch_locked(policy_name);
+	this->mutex.unlock();
+	callback(0);
+}
+
+void Manager::unwatch_locked(const std::string& policy_name)
+{
 	PolarisPolicy *pp;
+
+	this->watch_status.erase(policy_name);
 	pp = (PolarisPolicy *)WFGlobal::get_name_service()->del_policy(policy_name.c_str());
 	this->unwatch_policies.emplace(policy_name, pp);
+}
 
-	return 0;
+/*
+ * Seeds the policy from the cache in persistDir, so the watch succeeds at
+ * once, even if polaris server is unreachable. A cache older than
+ * serviceExpireTime is not used. Then a refresh sends the
+ * cached revisions to the server in the background, and from its callback
+ * on the service is refreshed the same as after a watch from the server.
+ *
+ * Returns false without calling back if there is no valid cache.
+ */
+bool Manager::watch_from_cache(const std::string& service_namespace,
+							   const std::string& service_name,
+							   polaris_manager_callback_t& callback)
+{
+	const std::string& dir = this->config.get_persist_dir();
+	std::string policy_name = service_namespace + "." + service_name;
+	struct discover_result discover;
+	struct route_result route;
+	polaris_manager_callback_t unwatch_callback;
+	long long timer_expire = -1;
+	int error = 0;
+	bool ret;
+
+	uint64_t expire_time = this->config.get_service_expire_time();
+
+	if (!load_discover_cache(dir, service_namespace, service_name,
+							 expire_time, &discover) ||
+		!load_route_cache(dir, service_namespace, service_name,
+						  expire_time, &route))
+		return false;
+
+	struct consumer_context *ctx = new consumer_context();
+	ctx->service_namespace = service_namespace;
+	ctx->service_name = service_name;
+	ctx->discover_body = PolarisTask::create_discover_body(service_namespace,
+														   service_name);
+	ctx->mgr = this;
+
+	this->mutex.lock();
+	ret = this->update_policy_locked(policy_name, &discover, &route, true,
+									 true, true, &error, &unwatch_callback);
+	if (ret == true)
+	{
+		struct watch_info& info = this->watch_status[policy_name];
+
+		info.service_namespace = service_namespace;
+		info.service_name = service_name;
+		info.refresh_interval = this->config.get_discover_refresh_interval();
+		info.unchanged_rounds = 0;
+		info.long_poll_supported = false;
+		info.discover_body = ctx->discover_body;
+		// the batch refresh skips it until the revalidation is back
+		info.watching = true;
+		if (this->config.get_service_refresh_batch() && !this->batch_refreshing)
+		{
+			struct wheel_entry entry;
+
+			this->batch_refreshing = true;
+			entry.type = WHEEL_BATCH_REFRESH;
+			timer_expire = this->schedule_locked(std::move(entry),
+								this->config.get_discover_refresh_interval());
+		}
+	}
+	this->mutex.unlock();
+
+	if (timer_expire >= 0)
+		this->start_wheel(timer_expire);
+
+	if (ret == true)
+	{
+		this->client.set_revision(service_namespace, service_name,
+								  discover.service_revision,
+								  route.routing_revision);
+		this->incref();
+
+		// no long poll in batch mode, or the rounds skip it while held
+		PolarisTask *refresh_task;
+		refresh_task = this->create_refresh_task(ctx,
+										!this->config.get_service_refresh_batch());
+
+		SeriesWork *series = Workflow::create_series_work(refresh_task,
+														  consumer_series_callback);
+		series->set_context(ctx);
+		series->start();
+	}
+	else
+		delete ctx;
+
+	callback(ret ? 0 : error);
+	return true;
 }
 
 int Manager::register_service(const std::string& service_namespace,
@@ -368,8 +762,39 @@ int Manager::register_service(const std::string& service_namespace,
 							  int heartbeat_interval,
 							  PolarisInstance instance)
 {
-	if (this->status == INIT_FAILED)
+	WFFacilities::WaitGroup wait_group(1);
+	int error;
+
+	this->async_register_service(service_namespace, service_name,
+								 service_token, heartbeat_interval,
+								 std::move(instance),
+								 [&wait_group, &error](int ret) {
+		error = ret;
+		wait_group.done();
+	});
+	wait_group.wait();
+
+	if (error != 0)
+	{
+		this->error = error;
 		return -1;
+	}
+
+	return 0;
+}
+
+void Manager::async_register_service(const std::string& service_namespace,
+									 const std::string& service_name,
+									 const std::string& service_token,
+									 int heartbeat_interval,
+									 PolarisInstance instance,
+									 polaris_manager_callback_t callback)
+{
+	if (this->status == INIT_FAILED)
+	{
+		callback(POLARIS_ERR_INIT_FAILED);
+		return;
+	}
 
 	PolarisTask *task;
 	task = this->client.create_register_task(service_namespace.c_str(),
@@ -384,8 +809,7 @@ int Manager::register_service(const std::string& service_namespace,
 		task->set_platform_token(platform_token);
 	}
 
-	WFFacilities::WaitGroup wait_group(1);
-	task->user_data = &wait_group;
+	task->user_data = new polaris_manager_callback_t(std::move(callback));
 	task->set_config(this->config);
 	task->set_polaris_instance(instance);
 
@@ -399,18 +823,9 @@ int Manager::register_service(const std::string& service_namespace,
 	this->incref();
 
 	SeriesWork *series = Workflow::create_series_work(task,
-											[](const SeriesWork *series) {
-		struct provider_context *ctx;
-		ctx = (struct provider_context *)series->get_context();
-		ctx->mgr->decref();
-		delete ctx;
-	});
-
+													  provider_series_callback);
 	series->set_context(ctx);
 	series->start();
-	wait_group.wait();
-
-	return this->error == 0 ? 0 : -1;
 }
 
 int Manager::deregister_service(const std::string& service_namespace,
@@ -418,8 +833,37 @@ int Manager::deregister_service(const std::string& service_namespace,
 								const std::string& service_token,
 								PolarisInstance instance)
 {
-	if (this->status == INIT_FAILED)
+	WFFacilities::WaitGroup wait_group(1);
+	int error;
+
+	this->async_deregister_service(service_namespace, service_name,
+								   service_token, std::move(instance),
+								   [&wait_group, &error](int ret) {
+		error = ret;
+		wait_group.done();
+	});
+	wait_group.wait();
+
+	if (error != 0)
+	{
+		this->error = error;
 		return -1;
+	}
+
+	return 0;
+}
+
+void Manager::async_deregister_service(const std::string& service_namespace,
+									   const std::string& service_name,
+									   const std::string& service_token,
+									   PolarisInstance instance,
+									   polaris_manager_callback_t callback)
+{
+	if (this->status == INIT_FAILED)
+	{
+		callback(POLARIS_ERR_INIT_FAILED);
+		return;
+	}
 
 	std::string inst = instance.get_host() + ":" +
 					   std::to_string(instance.get_port());
@@ -427,9 +871,9 @@ int Manager::deregister_service(const std::string& service_namespace,
 	this->mutex.lock();
 	if (this->register_status.find(inst) == this->register_status.end())
 	{
-		this->error = POLARIS_ERR_SERVICE_NOT_FOUND;
 		this->mutex.unlock();
-		return -1;
+		callback(POLARIS_ERR_SERVICE_NOT_FOUND);
+		return;
 	}
 	this->mutex.unlock();
 
@@ -443,14 +887,12 @@ int Manager::deregister_service(const std::string& service_namespace,
 
 	struct deregister_context *ctx = new deregister_context();
 	ctx->instance_name = std::move(inst);
+	ctx->callback = std::move(callback);
 
 	task->user_data = ctx;
 	task->set_config(this->config);
 	task->set_polaris_instance(std::move(instance));
 	task->start();
-	ctx->wait_group.wait();
-
-	return this->error == 0 ? 0 : -1;
 }
 
 void Manager::get_watching_list(std::vector<std::string>& list)
@@ -469,38 +911,44 @@ void Manager::get_register_list(std::vector<std::string>& list)
 	this->mutex.unlock();
 }
 
-void Manager::set_error(int state, int error)
+int Manager::get_state_error(int state, int error)
 {
 	switch (state)
 	{
 	case POLARIS_STATE_ERROR:
-		this->error = error;
-		break;
+		return error;
 	case WFT_STATE_SYS_ERROR:
-		this->error = POLARIS_ERR_SYS_ERROR;
 		errno = error;
-		break;
+		return POLARIS_ERR_SYS_ERROR;
 	case WFT_STATE_SSL_ERROR:
-		this->error = POLARIS_ERR_SSL_ERROR;
-		break;
+		return POLARIS_ERR_SSL_ERROR;
 	case WFT_STATE_DNS_ERROR:
-		this->error = POLARIS_ERR_DNS_ERROR;
-		break;
+		return POLARIS_ERR_DNS_ERROR;
 	case WFT_STATE_TASK_ERROR:
-		this->error = POLARIS_ERR_TASK_ERROR;
-		break;
+		return POLARIS_ERR_TASK_ERROR;
 	default:
-		this->error = POLARIS_ERR_UNKNOWN_ERROR;
-		break;
+		return POLARIS_ERR_UNKNOWN_ERROR;
 	}
 }
 
+// user_data of the task of a user request is its callback
+void Manager::user_request_done(PolarisTask *task, int error)
+{
+	polaris_manager_callback_t *callback;
+
+	callback = (polaris_manager_callback_t *)task->user_data;
+	(*callback)(error);
+	delete callback;
+}
+
 bool Manager::update_policy_locked(const std::string& policy_name,
 								   struct discover_result *discover,
 								   struct route_result *route,
 								   bool is_user_request,
 								   bool update_instance,
-								   bool update_routing)
+								   bool update_routing,
+								   int *error,
+								   polaris_manager_callback_t *unwatch_callback)
 {
 	auto iter = this->watch_status.find(policy_name);
 
@@ -508,13 +956,14 @@ bool Manager::update_policy_locked(const std::string& policy_name,
 	{
 		if (is_user_request)
 		{
-			this->error = POLARIS_ERR_DOUBLE_OPERATION;
+			*error = POLARIS_ERR_DOUBLE_OPERATION;
 			return false;
 		}
 
-		if (!iter->second.watching)
+		if (!iter->second.watching) // some one calling unwatch()
 		{
-			iter->second.cond.notify_one();
+			*unwatch_callback = std::move(iter->second.unwatch_callback);
+			this->unwatch_locked(policy_name);
 			return false;
 		}
 
@@ -524,6 +973,13 @@ bool Manager::update_policy_locked(const std::string& policy_name,
 		if (update_routing)
 			update_routing = (iter->second.routing_revision !=
 							  route->routing_revision);
+
+		// nothing to apply, leave the name service and the policy alone
+		if (!update_instance && !update_routing)
+		{
+			iter->second.watching = false;
+			return true;
+		}
 	}
 
 	WFNameService *ns = WFGlobal::get_name_service();
@@ -550,7 +1006,7 @@ bool Manager::update_policy_locked(const std::string& policy_name,
 		}
 		else
 		{
-			this->error = POLARIS_ERR_EXISTED_POLICY;
+			*error = POLARIS_ERR_EXISTED_POLICY;
 			return false;
 		}
 	}
@@ -575,7 +1031,11 @@ bool Manager::update_policy_locked(const std::string& policy_name,
 void Manager::discover_callback(PolarisTask *task)
 {
 	if (this->status == MANAGER_EXITED)
+	{
+		if (task->user_data)
+			user_request_done(task, POLARIS_ERR_INIT_FAILED);
 		return;
+	}
 
 	int state = task->get_state();
 	int error = task->get_error();
@@ -585,29 +1045,36 @@ void Manager::discover_callback(PolarisTask *task)
 	struct consumer_context *ctx;
 	bool update_instance = false;
 	bool update_routing = false;
+	bool instance_unchanged = false;
+	bool routing_unchanged = false;
+	polaris_manager_callback_t unwatch_callback;
+	int ret_error = 0;
 	bool ret;
 
 	if (state == WFT_STATE_SUCCESS)
 	{
 		update_instance = task->get_discover_result(&discover);
 		update_routing = task->get_route_result(&route);
+		instance_unchanged = task->is_instances_unchanged();
+		routing_unchanged = task->is_routing_unchanged();
 	}
 
 	if (task->user_data)
 	{
 		if (state != WFT_STATE_SUCCESS)
-			this->set_error(state, error);
+			ret_error = get_state_error(state, error);
 		else
 		{
-			if (!update_instance)
-				this->error = POLARIS_ERR_NO_INSTANCE;
-			else if (!update_routing)
-				this->error = POLARIS_ERR_INVALID_ROUTE_RULE;
+			// unchanged on watch again, the policy kept by unwatch is current
+			if (!update_instance && !instance_unchanged)
+				ret_error = POLARIS_ERR_NO_INSTANCE;
+			else if (!update_routing && !routing_unchanged)
+				ret_error = POLARIS_ERR_INVALID_ROUTE_RULE;
 		}
 
-		if (this->error != 0)
+		if (ret_error != 0)
 		{
-			((WFFacilities::WaitGroup *)task->user_data)->done();
+			user_request_done(task, ret_error);
 			return;
 		}
 	}
@@ -616,59 +1083,278 @@ void Manager::discover_callback(PolarisTask *task)
 	std::string policy_name = ctx->service_namespace +
 							  "." + ctx->service_name;
 
+	bool batch = this->config.get_service_refresh_batch();
+	uint64_t long_poll = this->config.get_discover_long_poll_timeout();
+	bool poll_again = false;
+	long long timer_expire = -1;
+	struct wheel_entry entry;
+	uint64_t ms;
+
 	this->mutex.lock();
 	ret = this->update_policy_locked(policy_name, &discover, &route,
 									 task->user_data ? true : false,
-									 update_instance, update_routing);
+									 update_instance, update_routing,
+									 &ret_error, &unwatch_callback);
+	if (ret == true)
+	{
+		struct watch_info& info = this->watch_status[policy_name];
+
+		if (task->user_data)
+		{
+			info.service_namespace = ctx->service_namespace;
+			info.service_name = ctx->service_name;
+			info.refresh_interval = this->config.get_discover_refresh_interval();
+			info.unchanged_rounds = 0;
+			info.long_poll_supported = false;
+			info.discover_body = ctx->discover_body;
+			if (batch && !this->batch_refreshing)
+			{
+				this->batch_refreshing = true;
+				entry.type = WHEEL_BATCH_REFRESH;
+				timer_expire = this->schedule_locked(std::move(entry),
+									this->config.get_discover_refresh_interval());
+			}
+		}
+
+		ms = this->next_refresh_interval_locked(info,
+							!task->user_data && (update_instance || update_routing),
+							state != WFT_STATE_SUCCESS);
+
+		// the watch is followed by a poll to find out if the server holds
+		// them. it does if a poll comes back after half of longPollTimeout,
+		// then a poll answered early for a change is followed at once by the
+		// next one. a server that ignores the header answers every poll
+		// early, changed or not, and is refreshed by the refresh interval
+		if (!batch && long_poll > 0 && state == WFT_STATE_SUCCESS)
+		{
+			auto elapsed = std::chrono::steady_clock::now() - ctx->poll_start;
+
+			if (task->user_data)
+				poll_again = true;
+			else
+			{
+				if (elapsed >= std::chrono::milliseconds(long_poll / 2))
+					info.long_poll_supported = true;
+				else if (!update_instance)
+					info.long_poll_supported = false;
+
+				poll_again = info.long_poll_supported;
+			}
+		}
+
+		// the batch refresh of the wheel refreshes this service from now on
+		if (poll_again)
+			info.watching = true;
+		else if (!batch)
+		{
+			info.refresh_id = ++this->next_refresh_id;
+			entry.type = WHEEL_REFRESH;
+			entry.policy_name = policy_name;
+			entry.refresh_id = info.refresh_id;
+			timer_expire = this->schedule_locked(std::move(entry), ms);
+		}
+	}
 	this->mutex.unlock();
 
-	if (ret == true)
+	if (poll_again)
+		series_of(task)->push_back(this->create_refresh_task(ctx, true));
+
+	if (timer_expire >= 0)
+		this->start_wheel(timer_expire);
+
+	// only the results just received, the same ones are not written again
+	if (ret == true && (update_instance || update_routing) &&
+		!this->config.get_persist_dir().empty())
 	{
-		WFTimerTask *timer_task;
-		unsigned int us = this->config.get_discover_refresh_interval() * 1000;
-		timer_task = WFTaskFactory::create_timer_task(us, this->discover_timer_cb);
-		series_of(task)->push_back(timer_task);
+		WFGoTask *go_task;
+		go_task = WFTaskFactory::create_go_task(PERSIST_QUEUE, save_cache,
+												this->config.get_persist_dir(),
+												update_instance, std::move(discover),
+												update_routing, std::move(route));
+		go_task->start();
 	}
 
+	if (unwatch_callback)
+		unwatch_callback(0);
+
 	if (task->user_data)
-		((WFFacilities::WaitGroup *)task->user_data)->done();
+		user_request_done(task, ret ? 0 : ret_error);
 
 	return;
 }
 
-void Manager::discover_timer_callback(WFTimerTask *task)
+// a long poll if longPollTimeout is set and long_poll is true
+PolarisTask *Manager::create_refresh_task(struct consumer_context *ctx, bool long_poll)
 {
-	struct consumer_context *ctx;
-	ctx =(struct consumer_context *)series_of(task)->get_context();
-	std::string policy_name = ctx->service_namespace + "." + ctx->service_name;
-
-	if (this->status == MANAGER_EXITED)
-		return;
+	uint64_t long_poll_timeout = this->config.get_discover_long_poll_timeout();
+	PolarisTask *task = this->create_discover_task(ctx->service_namespace,
+												   ctx->service_name);
 
-	this->mutex.lock();
-	auto iter = this->watch_status.find(policy_name);
-	if (iter == this->watch_status.end())
+	task->set_discover_body(ctx->discover_body);
+	if (long_poll && long_poll_timeout > 0)
 	{
-		this->mutex.unlock();
-		return;
+		task->set_long_poll_timeout(long_poll_timeout);
+		ctx->poll_start = std::chrono::steady_clock::now();
 	}
 
+	return task;
+}
+
+SeriesWork *Manager::refresh_due_locked(const struct wheel_entry& entry)
+{
+	auto iter = this->watch_status.find(entry.policy_name);
+
+	// unwatched, or unwatched and watched again with a refresh of its own
+	if (iter == this->watch_status.end() ||
+		iter->second.refresh_id != entry.refresh_id)
+		return NULL;
+
+	struct consumer_context *ctx = new consumer_context();
+	ctx->service_namespace = iter->second.service_namespace;
+	ctx->service_name = iter->second.service_name;
+	ctx->discover_body = iter->second.discover_body;
+	ctx->mgr = this;
+	this->incref();
+
+	SeriesWork *series = Workflow::create_series_work(this->create_refresh_task(ctx, true),
+													  consumer_series_callback);
+	series->set_context(ctx);
 	iter->second.watching = true;
-	this->mutex.unlock();
+	return series;
+}
+
+/*
+ * The interval of a service doubles after REFRESH_BACKOFF_ROUNDS refreshes
+ * without a change, up to maxRefreshInterval, and drops to minRefreshInterval
+ * after a change or a failure. Up to 10% of it is taken off at random, so the
+ * services watched at the same time, or by processes started together, do
+ * not refresh together.
+ */
+uint64_t Manager::next_refresh_interval_locked(struct watch_info& info,
+											   bool changed, bool failed)
+{
+	uint64_t min_interval = this->config.get_discover_min_refresh_interval();
+	uint64_t max_interval = this->config.get_discover_max_refresh_interval();
+	uint64_t jitter;
+
+	if (changed || failed)
+	{
+		info.refresh_interval = min_interval;
+		info.unchanged_rounds = 0;
+	}
+	else if (++info.unchanged_rounds >= REFRESH_BACKOFF_ROUNDS)
+	{
+		info.refresh_interval = std::min(info.refresh_interval * 2, max_interval);
+		info.unchanged_rounds = 0;
+	}
+
+	jitter = std::min<uint64_t>(info.refresh_interval / 10, UINT32_MAX - 1);
+	return info.refresh_interval - Random::uniform((uint32_t)jitter + 1);
+}
 
-	PolarisTask *discover_task;
-	discover_task = this->client.create_discover_task(ctx->service_namespace.c_str(),
-													  ctx->service_name.c_str(),
-													  this->retry_max,
-													  this->discover_cb);
-	discover_task->set_config(this->config);
+PolarisTask *Manager::create_discover_task(const std::string& service_namespace,
+										   const std::string& service_name)
+{
+	PolarisTask *task;
+	task = this->client.create_discover_task(service_namespace.c_str(),
+											 service_name.c_str(),
+											 this->retry_max,
+											 this->discover_cb);
+	task->set_config(this->config);
 	if (!this->platform_id.empty() && !this->platform_token.empty())
 	{
-		discover_task->set_platform_id(platform_id);
-		discover_task->set_platform_token(platform_token);
+		task->set_platform_id(platform_id);
+		task->set_platform_token(platform_token);
+	}
+
+	return task;
+}
+
+/*
+ * Refreshes all the watched services every refreshInterval, in parallel
+ * works of at most serviceRefreshBatchSize series, one work after another,
+ * so no more requests than that are on the way to the server at the same
+ * time, and the keep-alive connections to it are reused. A round still on
+ * the way when the next one is due puts that one off, and a service whose
+ * last refresh is still on the way, as after a watch from persistDir, is
+ * skipped.
+ *
+ * All the services are refreshed together, so neither the adaptive
+ * interval of each service nor its jitter applies here.
+ */
+SeriesWork *Manager::batch_refresh_due_locked()
+{
+	size_t batch_size = this->config.get_service_refresh_batch_size();
+	SeriesWork *batch_series = NULL;
+	ParallelWork *parallel = NULL;
+	struct wheel_entry entry;
+	size_t n = 0;
+
+	if (this->watch_status.empty())
+	{
+		// put on the wheel again by the next watch_service()
+		this->batch_refreshing = false;
+		return NULL;
+	}
+
+	entry.type = WHEEL_BATCH_REFRESH;
+	this->wheel.add(std::move(entry),
+					wheel_ticks(this->config.get_discover_refresh_interval()),
+					wheel_now_ms() / WHEEL_TICK_MS);
+
+	// the last round is still on the way, this one is put off
+	if (this->batch_in_flight)
+		return NULL;
+
+	for (auto& kv : this->watch_status)
+	{
+		if (kv.second.watching)
+			continue;
+
+		struct consumer_context *ctx = new consumer_context();
+		ctx->service_namespace = kv.second.service_namespace;
+		ctx->service_name = kv.second.service_name;
+		ctx->discover_body = kv.second.discover_body;
+		ctx->mgr = this;
+		this->incref();
+
+		PolarisTask *discover_task = this->create_discover_task(ctx->service_namespace,
+																ctx->service_name);
+		discover_task->set_discover_body(ctx->discover_body);
+		SeriesWork *discover_series;
+		discover_series = Workflow::create_series_work(discover_task,
+													   consumer_series_callback);
+		discover_series->set_context(ctx);
+
+		if (n++ % batch_size == 0)
+		{
+			parallel = Workflow::create_parallel_work(nullptr);
+			if (batch_series)
+				batch_series->push_back(parallel);
+			else
+				batch_series = Workflow::create_series_work(parallel,
+															batch_series_callback);
+		}
+
+		parallel->add_series(discover_series);
+		kv.second.watching = true;
 	}
 
-	series_of(task)->push_back(discover_task);
+	if (batch_series)
+	{
+		batch_series->set_context(this);
+		this->batch_in_flight = true;
+		this->incref();
+	}
+
+	return batch_series;
+}
+
+void Manager::batch_refresh_done()
+{
+	this->mutex.lock();
+	this->batch_in_flight = false;
+	this->mutex.unlock();
 }
 
 void Manager::register_callback(PolarisTask *task)
@@ -683,28 +1369,17 @@ void Manager::register_callback(PolarisTask *task)
 
 	if (state != WFT_STATE_SUCCESS)
 	{
-		this->set_error(state, error);
-		((WFFacilities::WaitGroup *)task->user_data)->done();
+		user_request_done(task, get_state_error(state, error));
 		return;
 	}
 
 	if (ctx->instance.get_enable_healthcheck() && ctx->heartbeat_interval != 0)
 	{
-		heartbeat_task = this->client.create_heartbeat_task(
-												ctx->service_namespace.c_str(),
-												ctx->service_name.c_str(),
-												this->retry_max,
-												this->heartbeat_cb);
-
-		heartbeat_task->set_config(this->config);
-		heartbeat_task->set_polaris_instance(ctx->instance);
-		heartbeat_task->set_service_token(ctx->service_token);
-		if (!this->platform_id.empty() && !this->platform_token.empty())
-		{
-			heartbeat_task->set_platform_id(platform_id);
-			heartbeat_task->set_platform_token(platform_token);
-		}
-
+		ctx->heartbeat_body = PolarisTask::create_heartbeat_body(ctx->service_namespace,
+																 ctx->service_name,
+																 ctx->service_token,
+																 ctx->instance);
+		heartbeat_task = this->create_heartbeat_task(ctx);
 		heartbeat_task->user_data = task->user_data;
 		series_of(task)->push_back(heartbeat_task);
 	}
@@ -716,7 +1391,7 @@ void Manager::register_callback(PolarisTask *task)
 		this->mutex.lock();
 		this->register_status[instance].heartbeating = false;
 		this->mutex.unlock();
-		((WFFacilities::WaitGroup *)task->user_data)->done();
+		user_request_done(task, 0);
 	}
 
 	return;
@@ -725,21 +1400,27 @@ void Manager::register_callback(PolarisTask *task)
 void Manager::deregister_callback(PolarisTask *task)
 {
 	struct deregister_context *ctx = (struct deregister_context *)task->user_data;
-	std::unique_lock<std::mutex> lock(this->mutex);
 
+	this->mutex.lock();
 	auto iter = this->register_status.find(ctx->instance_name);
 
 	if (iter != this->register_status.end())
 	{
 		if (iter->second.heartbeating == true)
 		{
+			// finished by update_heartbeat_locked() of the heartbeat on the way
 			iter->second.heartbeating = false;
-			iter->second.cond.wait(lock);
+			iter->second.deregister_callback = std::move(ctx->callback);
+			this->mutex.unlock();
+			delete ctx;
+			return;
 		}
+
 		this->register_status.erase(iter);
 	}
+	this->mutex.unlock();
 
-	ctx->wait_group.done();
+	ctx->callback(0);
 	delete ctx;
 
 	return;
@@ -748,13 +1429,19 @@ void Manager::deregister_callback(PolarisTask *task)
 void Manager::heartbeat_callback(PolarisTask *task)
 {
 	if (this->status == MANAGER_EXITED)
+	{
+		if (task->user_data)
+			user_request_done(task, POLARIS_ERR_INIT_FAILED);
 		return;
+	}
 
 	int state = task->get_state();
 	int error = task->get_error();
 
-	WFTimerTask *timer_task;
 	struct provider_context *ctx;
+	polaris_manager_callback_t deregister_callback;
+	long long timer_expire = -1;
+	int ret_error = 0;
 	bool ret = true;
 
 	if (task->user_data &&
@@ -762,7 +1449,7 @@ void Manager::heartbeat_callback(PolarisTask *task)
 		error == POLARIS_ERR_HEARTBEAT_DISABLE)
 	{
 		// will continue even if the first heartbeat network failed
-		this->set_error(state, error);
+		ret_error = get_state_error(state, error);
 		ret = false;
 	}
 
@@ -773,25 +1460,48 @@ void Manager::heartbeat_callback(PolarisTask *task)
 							   std::to_string(ctx->instance.get_port());
 
 		this->mutex.lock();
-		ret = this->update_heartbeat_locked(instance, task->user_data ? true : false);
-		this->mutex.unlock();
-
-		if (ret == true)
+		ret = this->update_heartbeat_locked(instance, task->user_data ? true : false,
+											&ret_error, &deregister_callback);
+		// the bucket of its interval on the wheel sends the following heartbeats
+		if (ret == true && task->user_data)
 		{
-			timer_task = WFTaskFactory::create_timer_task(ctx->heartbeat_interval, 0,
-														  this->heartbeat_timer_cb);
-			series_of(task)->push_back(timer_task);
+			struct register_info& info = this->register_status[instance];
+
+			info.service_namespace = ctx->service_namespace;
+			info.service_name = ctx->service_name;
+			info.service_token = ctx->service_token;
+			info.heartbeat_interval = ctx->heartbeat_interval;
+			info.instance = ctx->instance;
+			info.heartbeat_body = ctx->heartbeat_body;
+			if (this->heartbeat_buckets.insert(ctx->heartbeat_interval).second)
+			{
+				struct wheel_entry entry;
+
+				entry.type = WHEEL_HEARTBEAT;
+				entry.heartbeat_interval = ctx->heartbeat_interval;
+				timer_expire = this->schedule_locked(std::move(entry),
+										(uint64_t)ctx->heartbeat_interval * 1000);
+			}
 		}
+		this->mutex.unlock();
 	}
 
+	if (timer_expire >= 0)
+		this->start_wheel(timer_expire);
+
+	if (deregister_callback)
+		deregister_callback(0);
+
 	if (task->user_data)
-		((WFFacilities::WaitGroup *)task->user_data)->done();
+		user_request_done(task, ret_error);
 
 	return;
 }
 
 bool Manager::update_heartbeat_locked(const std::string& instance_name,
-									  bool is_user_request)
+									  bool is_user_request,
+									  int *error,
+									  polaris_manager_callback_t *deregister_callback)
 {
 	auto iter = this->register_status.find(instance_name);
 
@@ -799,13 +1509,14 @@ bool Manager::update_heartbeat_locked(const std::string& instance_name,
 	{
 		if (is_user_request)
 		{
-			this->error = POLARIS_ERR_DOUBLE_OPERATION;
+			*error = POLARIS_ERR_DOUBLE_OPERATION;
 			return false;
 		}
 
 		if (!iter->second.heartbeating) // some one calling deregister()
 		{
-			iter->second.cond.notify_one();
+			*deregister_callback = std::move(iter->second.deregister_callback);
+			this->register_status.erase(iter);
 			return false;
 		}
 	}
@@ -814,43 +1525,182 @@ bool Manager::update_heartbeat_locked(const std::string& instance_name,
 	return true;
 }
 
-void Manager::heartbeat_timer_callback(WFTimerTask *task)
+PolarisTask *Manager::create_heartbeat_task(const struct provider_context *ctx)
 {
-	struct provider_context *ctx;
-	ctx =(struct provider_context *)series_of(task)->get_context();
-	std::string instance = ctx->instance.get_host() + ":" +
-						   std::to_string(ctx->instance.get_port());
+	PolarisTask *task;
+	task = this->client.create_heartbeat_task(ctx->service_namespace.c_str(),
+											  ctx->service_name.c_str(),
+											  this->retry_max,
+											  this->heartbeat_cb);
+
+	task->set_config(this->config);
+	task->set_service_token(ctx->service_token);
+	task->set_polaris_instance(ctx->instance);
+	task->set_heartbeat_body(ctx->heartbeat_body);
+	if (!this->platform_id.empty() && !this->platform_token.empty())
+	{
+		task->set_platform_id(platform_id);
+		task->set_platform_token(platform_token);
+	}
+
+	return task;
+}
+
+/*
+ * Sends the heartbeats of all the instances of the same heartbeat interval
+ * in parallel works of at most HEARTBEAT_BATCH_SIZE, over the keep-alive
+ * connections to the healthcheck cluster. An instance whose last heartbeat
+ * is still on the way is skipped.
+ */
+SeriesWork *Manager::heartbeat_due_locked(int heartbeat_interval)
+{
+	SeriesWork *batch_series = NULL;
+	ParallelWork *parallel = NULL;
+	struct wheel_entry entry;
+	bool found = false;
+	size_t n = 0;
+
+	for (auto& kv : this->register_status)
+	{
+		struct register_info& info = kv.second;
+
+		if (!info.heartbeat_body || info.heartbeat_interval != heartbeat_interval)
+			continue;
+
+		found = true;
+		if (info.heartbeating || info.deregister_callback)
+			continue;
+
+		struct provider_context *ctx = new provider_context();
+		ctx->service_namespace = info.service_namespace;
+		ctx->service_name = info.service_name;
+		ctx->service_token = info.service_token;
+		ctx->heartbeat_interval = info.heartbeat_interval;
+		ctx->instance = info.instance;
+		ctx->heartbeat_body = info.heartbeat_body;
+		ctx->mgr = this;
+		this->incref();
+
+		SeriesWork *series;
+		series = Workflow::create_series_work(this->create_heartbeat_task(ctx),
+											  provider_series_callback);
+		series->set_context(ctx);
+
+		if (n++ % HEARTBEAT_BATCH_SIZE == 0)
+		{
+			parallel = Workflow::create_parallel_work(nullptr);
+			if (batch_series)
+				batch_series->push_back(parallel);
+			else
+				batch_series = Workflow::create_series_work(parallel, nullptr);
+		}
+
+		parallel->add_series(series);
+		info.heartbeating = true;
+	}
+
+	if (found)
+	{
+		entry.type = WHEEL_HEARTBEAT;
+		entry.heartbeat_interval = heartbeat_interval;
+		this->wheel.add(std::move(entry), wheel_ticks((uint64_t)heartbeat_interval * 1000),
+						wheel_now_ms() / WHEEL_TICK_MS);
+	}
+	else // put on the wheel again by the next register_service() of this interval
+		this->heartbeat_buckets.erase(heartbeat_interval);
 
+	return batch_series;
+}
+
+// returns the tick to start a timer of the wheel for after unlock, or -1
+long long Manager::schedule_locked(struct wheel_entry entry, uint64_t ms)
+{
+	long long expire = this->wheel.add(std::move(entry), wheel_ticks(ms),
+									   wheel_now_ms() / WHEEL_TICK_MS);
+
+	// the timer armed wakes up before it
+	if (this->wheel_expire >= 0 && this->wheel_expire <= expire)
+		return -1;
+
+	this->wheel_expire = expire;
+	return expire;
+}
+
+void Manager::start_wheel(long long expire)
+{
+	this->incref();
+	SeriesWork *series = Workflow::create_series_work(this->create_wheel_timer(expire),
+											[](const SeriesWork *series) {
+		((Manager *)series->get_context())->decref();
+	});
+
+	series->set_context(this);
+	series->start();
+}
+
+WFTimerTask *Manager::create_wheel_timer(long long expire)
+{
+	long long ms = std::max(expire * WHEEL_TICK_MS - wheel_now_ms(), 0LL);
+
+	return WFTaskFactory::create_timer_task(this->wheel_timer_name,
+											ms / 1000, ms % 1000 * 1000000,
+											[this, expire](WFTimerTask *task) {
+		this->wheel_timer_callback(task, expire);
+	});
+}
+
+/*
+ * One timer for all the refreshes and heartbeats, however many services are
+ * watched or registered. It sleeps until the earliest entry of the wheel,
+ * or a lap of it, and the works due are started in series of their own
+ * after the lock is released, so a slow server doesn`t put off the timer.
+ */
+void Manager::wheel_timer_callback(WFTimerTask *task, long long expire)
+{
 	if (this->status == MANAGER_EXITED)
 		return;
 
+	std::vector<struct wheel_entry> due;
+	std::vector<SeriesWork *> works;
+	SeriesWork *work;
+	long long next = -1;
+
 	this->mutex.lock();
-	auto iter = this->register_status.find(instance);
-	if (iter == this->register_status.end())
+	this->wheel.advance(wheel_now_ms() / WHEEL_TICK_MS, due);
+	for (const struct wheel_entry& entry : due)
 	{
-		this->mutex.unlock();
-		return;
-	}
+		switch (entry.type)
+		{
+		case WHEEL_REFRESH:
+			work = this->refresh_due_locked(entry);
+			break;
+		case WHEEL_BATCH_REFRESH:
+			work = this->batch_refresh_due_locked();
+			break;
+		default:
+			work = this->heartbeat_due_locked(entry.heartbeat_interval);
+			break;
+		}
 
-	iter->second.heartbeating = true;
-	this->mutex.unlock();
+		if (work)
+			works.push_back(work);
+	}
 
-	PolarisTask *heartbeat_task;
-	heartbeat_task = this->client.create_heartbeat_task(
-											ctx->service_namespace.c_str(),
-											ctx->service_name.c_str(),
-											this->retry_max,
-											this->heartbeat_cb);
-
-	heartbeat_task->set_config(this->config);
-	heartbeat_task->set_service_token(ctx->service_token);
-	heartbeat_task->set_polaris_instance(ctx->instance);
-	if (!this->platform_id.empty() && !this->platform_token.empty())
+	// a timer put off by an earlier entry leaves it to the one started for it
+	if (this->wheel_expire == expire)
 	{
-		heartbeat_task->set_platform_id(platform_id);
-		heartbeat_task->set_platform_token(platform_token);
+		if (!this->wheel.empty())
+			next = this->wheel.next_expire();
+
+		this->wheel_expire = next;
 	}
-	series_of(task)->push_back(heartbeat_task);
+	this->mutex.unlock();
+
+	for (SeriesWork *series : works)
+		series->start();
+
+	if (next >= 0)
+		series_of(task)->push_back(this->create_wheel_timer(next));
 }
 
 }; // namespace polaris
@@ -3,8 +3,9 @@
 
 #include <mutex>
 #include <string>
+#include <utility>
+#include <vector>
 #include <functional>
-#include <condition_variable>
 #include "workflow/WFTask.h"
 #include "workflow/WFTaskFactory.h"
 #include "workflow/WFFacilities.h"
@@ -15,6 +16,9 @@ namespace polaris {
 
 class Manager;
 
+// error is 0 on success, or one of POLARIS_ERR_*
+using polaris_manager_callback_t = std::function<void (int error)>;
+
 class PolarisManager
 {
 public:
@@ -29,6 +33,9 @@ public:
 
 	int watch_service(const std::string& service_namespace,
 					  const std::string& service_name);
+	// watch all the services at the same time, -1 if any of them fails
+	int watch_services(const std::vector<std::pair<std::string,
+												   std::string>>& services);
 	int unwatch_service(const std::string& service_namespace,
 						const std::string& service_name);
 
@@ -52,6 +59,30 @@ public:
 						   const std::string& service_token,
 						   PolarisInstance instance);
 	int get_error() const;
+
+	/*
+	 * Return at once and call callback when done, in a thread of workflow,
+	 * so it must not call the blocking functions above. Use these in a
+	 * server handler, or to start many requests together.
+	 */
+	void async_watch_service(const std::string& service_namespace,
+							 const std::string& service_name,
+							 polaris_manager_callback_t callback);
+	void async_unwatch_service(const std::string& service_namespace,
+							   const std::string& service_name,
+							   polaris_manager_callback_t callback);
+	void async_register_service(const std::string& service_namespace,
+								const std::string& service_name,
+								const std::string& service_token,
+								int heartbeat_interval,
+								PolarisInstance instance,
+								polaris_manager_callback_t callback);
+	void async_deregister_service(const std::string& service_namespace,
+								  const std::string& service_name,
+								  const std::string& service_token,
+								  PolarisInstance instance,
+								  polaris_manager_callback_t callback);
+
 	void get_watching_list(std::vector<std::string>& list);
 	void get_register_list(std::vector<std::string>& list);
 
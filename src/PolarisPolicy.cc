@@ -1,12 +1,23 @@
 #include <set>
+#include <algorithm>
+#include <math.h>
+#include <time.h>
 #include <string.h>
-#include "workflow/StringUtil.h"
 #include "PolarisPolicy.h"
+#include "PolarisRandom.h"
 
 namespace polaris {
 
 static constexpr char const *META_LABLE_EXACT = "EXACT";
 static constexpr char const *META_LABLE_REGEX = "REGEX";
+static constexpr int GET_ONE_MAX_RETRY = 8;
+static constexpr char const *FRAGMENT_HASH_KEY = "hash_key";
+static constexpr size_t RING_HASH_MIN_POINTS = 1024;
+static constexpr size_t RING_HASH_MAX_POINTS = 1 << 20;
+static constexpr size_t RING_HASH_POINTS_PER_SERVER = 100;
+static constexpr size_t MAGLEV_MIN_TABLE_SIZE = 1021;
+static constexpr size_t MAGLEV_SLOTS_PER_SERVER = 100;
+static constexpr size_t MAGLEV_SMALL_TABLE_SIZE = 65537;
 
 static inline bool meta_lable_equal(const struct meta_label& meta,
 									const std::string& str)
@@ -29,6 +40,15 @@ PolarisPolicyConfig::PolarisPolicyConfig(const std::string& policy_name,
 	this->enable_nearby_based_router = false;
 	this->failover_type = MetadataFailoverNone;
 
+	if (conf.get_load_balancer_type() == "ringHash")
+		this->load_balancer_type = LoadBalancerRingHash;
+	else if (conf.get_load_balancer_type() == "maglev")
+		this->load_balancer_type = LoadBalancerMaglev;
+	else if (conf.get_load_balancer_type() == "p2c")
+		this->load_balancer_type = LoadBalancerP2C;
+	else
+		this->load_balancer_type = LoadBalancerWeightedRandom;
+
 	std::vector<std::string> router_chain = conf.get_service_router_chain();
 	for (auto router : router_chain)
 	{
@@ -91,10 +111,13 @@ void PolarisPolicyConfig::set_nearby_based_router(bool enable,
 PolarisInstanceParams::PolarisInstanceParams(const struct instance *inst,
 											 const AddressParams *params) :
 	PolicyAddrParams(params),
+	inflight(0),
 	logic_set(inst->logic_set),
 	service_namespace(inst->service_namespace),
 	metadata(inst->metadata)
 {
+	this->id = inst->id;
+	this->revision = inst->revision;
 	this->priority = inst->priority;
 	this->enable_healthcheck = inst->enable_healthcheck;
 	this->healthy = inst->healthy;
@@ -108,42 +131,175 @@ PolarisInstanceParams::PolarisInstanceParams(const struct instance *inst,
 	// this->weight == 0 has special meaning
 }
 
+void PolarisInstanceParams::dec_inflight()
+{
+	int n = this->inflight.load(std::memory_order_relaxed);
+
+	// never below 0, even if a request finished twice
+	while (n > 0 && !this->inflight.compare_exchange_weak(n, n - 1,
+												std::memory_order_relaxed))
+	{
+	}
+}
+
+static void prefix_weights(const std::vector<EndpointAddress *>& servers,
+						   std::vector<int>& weights)
+{
+	PolarisInstanceParams *params;
+	int sum = 0;
+
+	weights.clear();
+	weights.reserve(servers.size());
+	for (const EndpointAddress *addr : servers)
+	{
+		params = static_cast<PolarisInstanceParams *>(addr->params);
+		if (params->get_weight() > 0)
+			sum += params->get_weight();
+
+		weights.push_back(sum);
+	}
+}
+
+// FNV-1a with the splitmix64 finalizer, FNV alone mixes the high bits poorly
+static uint64_t hash_bytes(const char *data, size_t len, uint64_t seed)
+{
+	uint64_t h = 14695981039346656037ULL ^ seed;
+
+	for (size_t i = 0; i < len; i++)
+	{
+		h ^= (unsigned char)data[i];
+		h *= 1099511628211ULL;
+	}
+
+	h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+	return h ^ (h >> 31);
+}
+
+static size_t next_prime(size_t n)
+{
+	for (;; n++)
+	{
+		size_t i;
+
+		for (i = 2; i * i <= n; i++)
+		{
+			if (n % i == 0)
+				break;
+		}
+
+		if (i * i > n)
+			return n;
+	}
+}
+
+static inline unsigned long long next_rules_revision()
+{
+	static std::atomic<unsigned long long> revision(0);
+
+	return ++revision;
+}
+
 PolarisPolicy::PolarisPolicy(const PolarisPolicyConfig *config) :
 	config(*config),
-	inbound_rwlock(PTHREAD_RWLOCK_INITIALIZER),
-	outbound_rwlock(PTHREAD_RWLOCK_INITIALIZER)
+	update_lock(PTHREAD_MUTEX_INITIALIZER)
 {
+	struct policy_snapshot *snap = new struct policy_snapshot;
+
+	snap->inbound_rules = std::make_shared<const BoundRulesMap>();
+	snap->outbound_rules = std::make_shared<const BoundRulesMap>();
+	snap->rules_revision = next_rules_revision();
+	this->snapshot = snap;
+	this->snapshot_epoch = 0;
+	this->drained_epoch = 0;
+
+	for (size_t i = 0; i < SNAPSHOT_READER_SLOTS; i++)
+	{
+		this->readers[i].count[0] = 0;
+		this->readers[i].count[1] = 0;
+	}
+
+	this->next_breaker_check = 0;
 	this->total_weight = 0;
 	this->available_weight = 0;
 }
 
+PolarisPolicy::~PolarisPolicy()
+{
+	// the servers are still held by this->servers, base class frees them
+	for (const auto& kv : this->retired)
+		this->delete_snapshot(kv.first);
+
+	this->delete_snapshot(this->snapshot.load());
+}
+
+/*
+ * Instances are matched with the current ones by id. The ones with the
+ * same revision and address keep their EndpointAddress, so their fail
+ * count and breaker state survive. Only the changed ones are added or
+ * removed under the write lock.
+ */
 void PolarisPolicy::update_instances(const std::vector<struct instance>& instances)
 {
-	std::vector<EndpointAddress *> addrs;
+	std::unordered_map<std::string, EndpointAddress *> ids;
+	std::vector<EndpointAddress *> servers;
+	std::vector<EndpointAddress *> added;
+	std::vector<EndpointAddress *> removed;
 	EndpointAddress *addr;
 	std::string name;
+	struct policy_snapshot *snap = new struct policy_snapshot;
 
 	AddressParams params = ADDRESS_PARAMS_DEFAULT;
 
+	pthread_mutex_lock(&this->update_lock);
+	ids.reserve(instances.size());
+	servers.reserve(instances.size());
+
 	for (size_t i = 0; i < instances.size(); i++)
 	{
 		name = instances[i].host + ":" + std::to_string(instances[i].port);
-		addr = new EndpointAddress(name,
-						new PolarisInstanceParams(&instances[i], &params));
-		addrs.push_back(addr);
+		const std::string& key = instances[i].id.empty() ? name : instances[i].id;
+
+		if (ids.find(key) != ids.end())
+			continue;
+
+		const auto it = this->instance_ids.find(key);
+		if (it != this->instance_ids.end() &&
+			this->instance_unchanged(it->second, &instances[i], name))
+		{
+			addr = it->second;
+		}
+		else
+		{
+			addr = new EndpointAddress(name,
+							new PolarisInstanceParams(&instances[i], &params));
+			added.push_back(addr);
+		}
+
+		ids.emplace(key, addr);
+		servers.push_back(addr);
+	}
+
+	for (const auto& kv : this->instance_ids)
+	{
+		const auto it = ids.find(kv.first);
+
+		if (it == ids.end() || it->second != kv.second)
+			removed.push_back(kv.second);
 	}
 
 	pthread_rwlock_wrlock(&this->rwlock);
-	this->clear_instances_locked();
+	for (EndpointAddress *addr : removed)
+		this->remove_instance_locked(addr);
+
+	for (EndpointAddress *addr : added)
+		this->add_instance_locked(addr);
 
-	for (size_t i = 0; i < addrs.size(); i++)
-		this->add_server_locked(addrs[i]);
+	this->servers.swap(servers);
 	pthread_rwlock_unlock(&this->rwlock);
-}
 
-void PolarisPolicy::clear_instances_locked()
-{
-	for (EndpointAddress *addr : this->servers)
+	this->instance_ids.swap(ids);
+	for (EndpointAddress *addr : removed)
 	{
 		if (--addr->ref == 0)
 		{
@@ -152,11 +308,66 @@ void PolarisPolicy::clear_instances_locked()
 		}
 	}
 
-	this->servers.clear();
-	this->server_map.clear();
-	this->nalives = 0;
-	this->total_weight = 0;
-	this->available_weight = 0;
+	snap->servers = this->servers;
+	for (EndpointAddress *addr : snap->servers)
+		++addr->ref;
+
+	prefix_weights(snap->servers, snap->server_weights);
+	if (this->config.load_balancer_type == LoadBalancerRingHash ||
+		this->config.load_balancer_type == LoadBalancerMaglev)
+	{
+		struct hash_ring *ring = new struct hash_ring;
+
+		this->build_hash_ring(snap->servers, *ring);
+		snap->server_ring.reset(ring);
+	}
+
+	snap->inbound_rules = this->snapshot.load()->inbound_rules;
+	snap->outbound_rules = this->snapshot.load()->outbound_rules;
+	snap->rules_revision = this->snapshot.load()->rules_revision;
+	this->build_rule_index(snap);
+	this->publish_snapshot(snap);
+	pthread_mutex_unlock(&this->update_lock);
+}
+
+bool PolarisPolicy::instance_unchanged(const EndpointAddress *addr,
+									   const struct instance *inst,
+									   const std::string& name) const
+{
+	PolarisInstanceParams *params = static_cast<PolarisInstanceParams *>(addr->params);
+
+	// without revision there is no telling whether it changed
+	return !inst->revision.empty() &&
+		   inst->revision == params->get_revision() &&
+		   addr->address == name;
+}
+
+// keeps this->servers untouched, the caller replaces it as a whole
+void PolarisPolicy::add_instance_locked(EndpointAddress *addr)
+{
+	PolarisInstanceParams *params = static_cast<PolarisInstanceParams *>(addr->params);
+
+	this->server_map[addr->address].push_back(addr);
+	this->recover_one_server(addr);
+	this->total_weight += params->get_weight();
+}
+
+void PolarisPolicy::remove_instance_locked(EndpointAddress *addr)
+{
+	PolarisInstanceParams *params = static_cast<PolarisInstanceParams *>(addr->params);
+	auto map_it = this->server_map.find(addr->address);
+
+	if (map_it != this->server_map.end())
+	{
+		std::vector<EndpointAddress *>& addrs = map_it->second;
+
+		addrs.erase(std::remove(addrs.begin(), addrs.end(), addr), addrs.end());
+		if (addrs.empty())
+			this->server_map.erase(map_it);
+	}
+
+	// still counted in nalives until pre_delete_server()
+	this->total_weight -= params->get_weight();
 }
 
 void PolarisPolicy::add_server_locked(EndpointAddress *addr)
@@ -184,147 +395,337 @@ void PolarisPolicy::fuse_one_server(const EndpointAddress *addr)
 	this->available_weight -= params->get_weight();
 }
 
-void PolarisPolicy::update_inbounds(const std::vector<struct routing_bound>& inbounds)
+static inline unsigned int snapshot_reader_slot()
 {
-	std::set<std::string> cleared_set;
-	BoundRulesMap::iterator it;
+	static std::atomic<unsigned int> next_slot(0);
+	static thread_local unsigned int slot = next_slot++;
 
-	pthread_rwlock_wrlock(&this->inbound_rwlock);
-	for (size_t i = 0; i < inbounds.size(); i++)
+	return slot;
+}
+
+struct PolarisPolicy::policy_snapshot *
+PolarisPolicy::acquire_snapshot(unsigned int *side)
+{
+	unsigned int slot = snapshot_reader_slot() % SNAPSHOT_READER_SLOTS;
+
+	*side = this->snapshot_epoch.load(std::memory_order_acquire) & 1;
+	this->readers[slot].count[*side]++;
+	return this->snapshot.load();
+}
+
+void PolarisPolicy::release_snapshot(unsigned int side)
+{
+	unsigned int slot = snapshot_reader_slot() % SNAPSHOT_READER_SLOTS;
+
+	this->readers[slot].count[side].fetch_sub(1, std::memory_order_release);
+}
+
+/*
+ * Readers of epoch e count themselves on side e & 1. The epoch moves on
+ * only after the side of the previous one drained, so once drained_epoch
+ * reaches e + 1, nobody can still see a snapshot replaced in epoch e.
+ * A reader counts itself in before loading the snapshot pointer.
+ * Must be called with update_lock held.
+ */
+bool PolarisPolicy::try_advance_epoch()
+{
+	unsigned int epoch = this->snapshot_epoch.load();
+	unsigned int side = (epoch - 1) & 1;
+
+	for (size_t i = 0; i < SNAPSHOT_READER_SLOTS; i++)
 	{
-		std::string src_name;
+		if (this->readers[i].count[side].load() != 0)
+			return false;
+	}
 
-		if (inbounds[i].source_bounds.size())
-			src_name = inbounds[i].source_bounds[0].service;
+	this->drained_epoch = epoch - 1;
+	this->snapshot_epoch.store(epoch + 1);
+	return true;
+}
 
-		// clear the previous
-		if (cleared_set.find(src_name) == cleared_set.end())
-		{
-			it = this->inbound_rules.find(src_name);
+/*
+ * Free the retired snapshots nobody can see. Never waits for readers,
+ * the ones still in use are left to the next update.
+ * Must be called with update_lock held.
+ */
+void PolarisPolicy::reclaim_snapshots()
+{
+	for (int i = 0; i < 3 && !this->retired.empty(); i++)
+	{
+		if (!this->try_advance_epoch())
+			break;
+	}
 
-			if (it != this->inbound_rules.end())
-				it->second.clear();
-			else
-				this->inbound_rules[src_name]; // construct vector
+	while (!this->retired.empty() &&
+		   (int)(this->drained_epoch - this->retired.front().second - 1) >= 0)
+	{
+		this->delete_snapshot(this->retired.front().first);
+		this->retired.pop_front();
+	}
+}
 
-			cleared_set.insert(src_name);
-		}
+// Must be called with update_lock held.
+void PolarisPolicy::publish_snapshot(struct policy_snapshot *snap)
+{
+	struct policy_snapshot *old = this->snapshot.exchange(snap);
 
-		this->inbound_rules[src_name].push_back(inbounds[i]);
+	this->retired.emplace_back(old, this->snapshot_epoch.load());
+	this->reclaim_snapshots();
+}
+
+void PolarisPolicy::delete_snapshot(struct policy_snapshot *snap)
+{
+	for (EndpointAddress *addr : snap->servers)
+	{
+		if (--addr->ref == 0)
+		{
+			this->pre_delete_server(addr);
+			delete addr;
+		}
 	}
 
-	pthread_rwlock_unlock(&this->inbound_rwlock);
+	delete snap;
 }
 
-void PolarisPolicy::update_outbounds(const std::vector<struct routing_bound>& outbounds)
+/*
+ * Fused servers wait at least one second in the breaker,
+ * so there is no need to lock and scan it on every select().
+ */
+void PolarisPolicy::check_breaker_periodically()
+{
+	struct timespec ts;
+	long long now;
+	long long next;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	now = ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+	next = this->next_breaker_check.load(std::memory_order_relaxed);
+
+	if (now >= next &&
+		this->next_breaker_check.compare_exchange_strong(next, now + 1000))
+	{
+		this->check_breaker();
+	}
+}
+
+void PolarisPolicy::update_bounds(const std::vector<struct routing_bound>& bounds,
+								  const BoundRulesMap *prev_rules,
+								  BoundRulesMap& rules)
 {
 	std::set<std::string> cleared_set;
-	BoundRulesMap::iterator it;
 
-	pthread_rwlock_wrlock(&this->outbound_rwlock);
-	for (size_t i = 0; i < outbounds.size(); i++)
+	rules = *prev_rules;
+	for (size_t i = 0; i < bounds.size(); i++)
 	{
 		std::string src_name;
 
-		if (outbounds[i].source_bounds.size())
-			src_name = outbounds[i].source_bounds[0].service;
+		if (bounds[i].source_bounds.size())
+			src_name = bounds[i].source_bounds[0].service;
 
 		// clear the previous
 		if (cleared_set.find(src_name) == cleared_set.end())
 		{
-			it = this->outbound_rules.find(src_name);
-
-			if (it != this->inbound_rules.end())
-				it->second.clear();
-			else
-				this->outbound_rules[src_name]; // construct vector
-
+			rules[src_name].clear();
 			cleared_set.insert(src_name);
 		}
 
-		this->outbound_rules[src_name].push_back(outbounds[i]);
+		rules[src_name].push_back(bounds[i]);
+	}
+}
+
+/*
+ * Match every dst_bound against the instances once per snapshot,
+ * so that select() only has to pick among the prepared subsets.
+ */
+void PolarisPolicy::build_rule_index(struct policy_snapshot *snap)
+{
+	this->index_rules(snap, snap->inbound_rules.get());
+	this->index_rules(snap, snap->outbound_rules.get());
+}
+
+void PolarisPolicy::index_rules(struct policy_snapshot *snap,
+								const BoundRulesMap *rules)
+{
+	std::map<int, std::vector<struct bound_subset>> priority_map;
+
+	for (const auto& kv : *rules)
+	{
+		for (const struct routing_bound& rule : kv.second)
+		{
+			const std::vector<struct destination_bound> *dst_bounds;
+			BoundSubsets& subsets = snap->rule_index[&rule.destination_bounds];
+
+			dst_bounds = &rule.destination_bounds;
+			priority_map.clear();
+			for (size_t i = 0; i < dst_bounds->size(); i++)
+			{
+				struct bound_subset subset;
+
+				subset.bound = &(*dst_bounds)[i];
+				this->matching_instances(snap, subset.bound, subset.servers);
+				prefix_weights(subset.servers, subset.weights);
+				if (this->config.load_balancer_type == LoadBalancerRingHash ||
+					this->config.load_balancer_type == LoadBalancerMaglev)
+				{
+					this->build_hash_ring(subset.servers, subset.ring);
+				}
+				priority_map[subset.bound->priority].push_back(std::move(subset));
+			}
+
+			subsets.reserve(priority_map.size());
+			for (auto& group : priority_map)
+				subsets.push_back(std::move(group.second));
+		}
 	}
+}
 
-	pthread_rwlock_unlock(&this->outbound_rwlock);
+void PolarisPolicy::update_inbounds(const std::vector<struct routing_bound>& inbounds)
+{
+	struct policy_snapshot *snap;
+	struct policy_snapshot *old;
+	BoundRulesMap *rules = new BoundRulesMap;
+
+	pthread_mutex_lock(&this->update_lock);
+	old = this->snapshot.load();
+	this->update_bounds(inbounds, old->inbound_rules.get(), *rules);
+
+	snap = new struct policy_snapshot;
+	snap->servers = old->servers;
+	snap->server_weights = old->server_weights;
+	snap->server_ring = old->server_ring;
+	for (EndpointAddress *addr : snap->servers)
+		++addr->ref;
+
+	snap->inbound_rules.reset(rules);
+	snap->outbound_rules = old->outbound_rules;
+	snap->rules_revision = next_rules_revision();
+	this->build_rule_index(snap);
+	this->publish_snapshot(snap);
+	pthread_mutex_unlock(&this->update_lock);
+}
+
+void PolarisPolicy::update_outbounds(const std::vector<struct routing_bound>& outbounds)
+{
+	struct policy_snapshot *snap;
+	struct policy_snapshot *old;
+	BoundRulesMap *rules = new BoundRulesMap;
+
+	pthread_mutex_lock(&this->update_lock);
+	old = this->snapshot.load();
+	this->update_bounds(outbounds, old->outbound_rules.get(), *rules);
+
+	snap = new struct policy_snapshot;
+	snap->servers = old->servers;
+	snap->server_weights = old->server_weights;
+	snap->server_ring = old->server_ring;
+	for (EndpointAddress *addr : snap->servers)
+		++addr->ref;
+
+	snap->inbound_rules = old->inbound_rules;
+	snap->outbound_rules.reset(rules);
+	snap->rules_revision = next_rules_revision();
+	this->build_rule_index(snap);
+	this->publish_snapshot(snap);
+	pthread_mutex_unlock(&this->update_lock);
 }
 
 bool PolarisPolicy::select(const ParsedURI& uri, WFNSTracing *tracing,
 						   EndpointAddress **addr)
 {
-	std::vector<struct destination_bound> *dst_bounds = NULL;
-	std::vector<EndpointAddress *> matched_subset;
-	std::string caller_name;
-	std::string caller_namespace;
-	std::map<std::string, std::string> meta;
+	static thread_local struct select_scratch scratch;
+	const std::vector<struct destination_bound> *dst_bounds;
+	const std::vector<EndpointAddress *> *instances = NULL;
+	const std::vector<int> *weights = NULL;
+	const struct hash_ring *ring = NULL;
+	const struct bound_subset *subset = NULL;
+	const struct fragment_entry *frag;
+	struct policy_snapshot *snap;
+	unsigned int side;
 	bool ret = true;
 
-	this->check_breaker();
+	this->check_breaker_periodically();
+
+	if (uri.fragment == NULL)
+		return false;
+
+	snap = this->acquire_snapshot(&side);
+	frag = this->parse_fragment(uri.fragment, snap, &scratch);
 
-	if (!this->split_fragment(uri.fragment, caller_name, caller_namespace, meta))
+	if (!frag->valid)
+	{
+		this->release_snapshot(side);
 		return false;
+	}
 
-	if (meta.size())
+	if (frag->meta.size)
 	{
 		// will be refactored as chain mode
 		if (this->config.enable_rule_base_router)
 		{
-			this->matching_bounds(caller_name, caller_namespace, meta, &dst_bounds);
+			dst_bounds = frag->dst_bounds;
 			if (dst_bounds && dst_bounds->size())
+				ret = this->matching_subset(snap, dst_bounds, &subset);
+
+			if (subset)
 			{
-				pthread_rwlock_rdlock(&this->rwlock);
-				ret = this->matching_subset(dst_bounds, matched_subset);
-				pthread_rwlock_unlock(&this->rwlock);
+				instances = &subset->servers;
+				weights = &subset->weights;
+				ring = &subset->ring;
 			}
 		}
 		else if (this->config.enable_dst_meta_router)
 		{
-			pthread_rwlock_rdlock(&this->rwlock);
-			ret = this->matching_meta(meta, matched_subset);
-			pthread_rwlock_unlock(&this->rwlock);
+			scratch.subset.clear();
+			scratch.unhealthy.clear();
+			ret = this->matching_meta(snap, frag->meta,
+									  scratch.subset, scratch.unhealthy);
+			instances = &scratch.subset;
 		}
 	}
 
 	if (ret)
 	{
-		pthread_rwlock_rdlock(&this->rwlock);
-		if (matched_subset.size())
+		EndpointAddress *one = NULL;
+
+		if (!instances || instances->empty())
 		{
-			EndpointAddress *one = this->get_one(matched_subset, tracing);
+			instances = &snap->servers;
+			weights = &snap->server_weights;
+			ring = snap->server_ring.get();
+		}
 
-			for (size_t i = 0; i < matched_subset.size(); i++)
+		if (this->config.enable_nearby_based_router)
+		{
+			scratch.nearby.clear();
+			if (!this->nearby_router_filter(*instances, scratch.nearby))
+				instances = NULL;
+			else if (scratch.nearby.size())
 			{
-				if (one != matched_subset[i])
-				{
-					if (--matched_subset[i]->ref == 0)
-					{
-						this->pre_delete_server(matched_subset[i]);
-						delete matched_subset[i];
-					}
-				}
+				instances = &scratch.nearby;
+				weights = NULL;
+				ring = NULL;
 			}
-
-			if (one)
-				*addr = one;
-			else
-				ret = false;
 		}
-		else if (this->servers.size())
+
+		if (!instances)
+			one = NULL;
+		else if (this->config.load_balancer_type == LoadBalancerWeightedRandom)
+			one = this->get_one(*instances, weights, tracing);
+		else if (this->config.load_balancer_type == LoadBalancerP2C)
+			one = this->get_one_by_load(*instances, weights, tracing);
+		else
+			one = this->get_one_by_hash(*instances, ring, frag->hash);
+
+		if (one)
 		{
-			EndpointAddress *one = this->get_one(this->servers, tracing);
-			if (one)
-			{
-				*addr = one;
-				++(*addr)->ref;
-			}
-			else
-				ret = false;
+			++one->ref;
+			*addr = one;
 		}
 		else
 			ret = false;
-
-		pthread_rwlock_unlock(&this->rwlock);
 	}
 
+	this->release_snapshot(side);
 	return ret;
 }
 
@@ -335,35 +736,26 @@ bool PolarisPolicy::select(const ParsedURI& uri, WFNSTracing *tracing,
  *	If the chosen dsts` subsets are all unhealthy, maching_bounds doesn`t care.
 */
 void PolarisPolicy::matching_bounds(
+					const struct policy_snapshot *snap,
 					const std::string& caller_name,
 					const std::string& caller_namespace,
-					const std::map<std::string, std::string>& meta,
-					std::vector<struct destination_bound> **dst_bounds)
+					const struct fragment_meta& meta,
+					const std::vector<struct destination_bound> **dst_bounds)
 {
-	std::vector<struct destination_bound> *dst = NULL;
+	const std::vector<struct destination_bound> *dst = NULL;
+	const BoundRulesMap *rules = snap->inbound_rules.get();
+	BoundRulesMap::const_iterator iter = rules->find(caller_name);
 
-	pthread_rwlock_t *lock = &this->inbound_rwlock;
-	pthread_rwlock_rdlock(lock);
+	if (iter == rules->end() && rules->find("*") == rules->end())
+		rules = snap->outbound_rules.get();
 
-	BoundRulesMap& rules = this->inbound_rules;
-	BoundRulesMap::iterator iter = this->inbound_rules.find(caller_name);
+	iter = rules->find(caller_name);
+	if (iter == rules->end())
+		iter = rules->find("*");
 
-	if (iter == this->inbound_rules.end() &&
-		this->inbound_rules.find("*") == this->inbound_rules.end())
+	if (iter != rules->end())
 	{
-		pthread_rwlock_unlock(lock);
-		lock = &this->outbound_rwlock;
-		pthread_rwlock_rdlock(lock);
-		rules = this->outbound_rules;
-	}
-
-	iter = rules.find(caller_name);
-	if (iter == rules.end())
-		iter = rules.find("*");
-
-	if (iter != rules.end())
-	{
-		for (struct routing_bound& rule : iter->second)
+		for (const struct routing_bound& rule : iter->second)
 		{
 			if (this->matching_rules(caller_name, caller_namespace,
 									 meta, rule.source_bounds))
@@ -376,8 +768,6 @@ void PolarisPolicy::matching_bounds(
 		if (dst)
 			*dst_bounds = dst;
 	}
-
-	pthread_rwlock_unlock(lock);
 }
 
 /*
@@ -385,122 +775,123 @@ void PolarisPolicy::matching_bounds(
  * Return the healthy subset whose matched dst_bound has top priority.
  * If multiple healthy dst_bounds have the same priority,
  * select one bound randomly according to their weight and return its subset.
- * If no instancs is matched by any dst_bounds, return false.
+ * If no subset has healthy instances, fall back to the top priority ones.
+ * If no instances is matched by any dst_bounds, return false, so the
+ * request fails instead of going to the instances the rule keeps it off.
  */
 bool PolarisPolicy::matching_subset(
-			std::vector<struct destination_bound> *dst_bounds,
-			std::vector<EndpointAddress *>& matched_subset)
-{
-	std::map<int, std::vector<struct destination_bound *>> bound_map;
-	std::map<int, std::vector<struct destination_bound *>>::iterator it;
-	std::vector<std::vector<EndpointAddress *>> top_subsets;
-	std::vector<std::vector<EndpointAddress *>> cur_subsets;
-	std::vector<std::vector<EndpointAddress *>>& subsets = top_subsets;
-	bool found = false;
-	size_t i;
+			const struct policy_snapshot *snap,
+			const std::vector<struct destination_bound> *dst_bounds,
+			const struct bound_subset **matched_subset)
+{
+	RuleIndex::const_iterator it = snap->rule_index.find(dst_bounds);
+	const struct bound_subset *subset = NULL;
 
-	for (i = 0; i < dst_bounds->size(); i++)
-		bound_map[(*dst_bounds)[i].priority].push_back(&((*dst_bounds)[i]));
+	if (it == snap->rule_index.end() || it->second.empty())
+		return false;
 
-	for (it = bound_map.begin(); it != bound_map.end() && !found; it++)
+	for (const std::vector<struct bound_subset>& group : it->second)
 	{
-		if (top_subsets.size())
-		{
-			cur_subsets.clear();
-			subsets = cur_subsets;
-		}
-
-		subsets.resize(it->second.size());
-		for (i = 0; i < it->second.size(); i++)
-		{
-			if (this->matching_instances(it->second[i], subsets[i]))
-				found = true;
-		}
-
-		if (found == true)
+		subset = this->subsets_weighted_random(group, true);
+		if (subset)
 			break;
 	}
 
-	if (found == false)
+	if (!subset)
 	{
-		if (top_subsets.size())
+		for (const std::vector<struct bound_subset>& group : it->second)
 		{
-			subsets = top_subsets;
-			it = bound_map.begin();
+			subset = this->subsets_weighted_random(group, false);
+			if (subset)
+				break;
 		}
-		else
-			return false;
 	}
 
-	if (subsets.size() == 1)
-		i = 0;
-	else // should move
-		i = this->subsets_weighted_random(it->second, subsets);
+	if (!subset)
+		return false;
+
+	*matched_subset = subset;
+	return true;
+}
+
+bool PolarisPolicy::subset_available(const struct bound_subset& subset,
+									 bool healthy_only)
+{
+	if (!healthy_only)
+		return !subset.servers.empty();
 
-	for (size_t j = 0; j < subsets[i].size(); j++)
+	for (const EndpointAddress *addr : subset.servers)
 	{
-		++subsets[i][j]->ref;
-		matched_subset.push_back(subsets[i][j]);
+		if (this->check_server_health(addr))
+			return true;
 	}
 
-	return true;
+	return false;
 }
 
-size_t PolarisPolicy::subsets_weighted_random(
-					const std::vector<struct destination_bound *>& bounds,
-					const std::vector<std::vector<EndpointAddress *>>& subsets)
+const struct PolarisPolicy::bound_subset *
+PolarisPolicy::subsets_weighted_random(
+					const std::vector<struct bound_subset>& subsets,
+					bool healthy_only)
 {
+	const struct bound_subset *last = NULL;
 	int x, s = 0;
 	int total_weight = 0;
 	int available_bounds_count = 0;
 	size_t i;
 
-	for (i = 0; i < bounds.size(); i++)
+	for (i = 0; i < subsets.size(); i++)
 	{
-		if (subsets[i].size())
+		if (this->subset_available(subsets[i], healthy_only))
 		{
-			total_weight += bounds[i]->weight;
+			total_weight += subsets[i].bound->weight;
 			available_bounds_count++;
 		}
 	}
 
-	if (total_weight == 0)
-		total_weight = available_bounds_count;
+	if (available_bounds_count == 0)
+		return NULL;
 
-	x = rand() % total_weight;
+	if (total_weight <= 0)
+	{
+		// pick uniformly when there is no weight to follow
+		x = Random::uniform(available_bounds_count);
+		for (i = 0; i < subsets.size(); i++)
+		{
+			if (this->subset_available(subsets[i], healthy_only) && x-- == 0)
+				break;
+		}
 
-	for (i = 0; i < bounds.size(); i++)
+		return &subsets[i];
+	}
+
+	x = Random::uniform(total_weight);
+	for (i = 0; i < subsets.size(); i++)
 	{
-		if (subsets[i].size() == 0)
+		if (!this->subset_available(subsets[i], healthy_only))
 			continue;
 
-		s += bounds[i]->weight;
+		last = &subsets[i];
+		s += subsets[i].bound->weight;
 		if (s > x)
 			break;
 	}
 
-	if (i == bounds.size())
-	{
-		do {
-			i--;
-		} while (subsets[i].size() == 0);
-	}
-
-	return i;
+	return last;
 }
 
-bool PolarisPolicy::matching_instances(struct destination_bound *dst_bounds,
+void PolarisPolicy::matching_instances(const struct policy_snapshot *snap,
+									   const struct destination_bound *dst_bounds,
 									   std::vector<EndpointAddress *>& subset)
 {
 	// fill all servers which match all the meta in dst_bounds
 	// no matter they are heathy or not
-	// if no healty instances : return false; else : return true;
 	PolarisInstanceParams *params;
 	bool flag;
 
-	for (size_t i = 0; i < this->servers.size(); i++)
+	for (size_t i = 0; i < snap->servers.size(); i++)
 	{
-		params = static_cast<PolarisInstanceParams *>(this->servers[i]->params);
+		params = static_cast<PolarisInstanceParams *>(snap->servers[i]->params);
 
 		if (dst_bounds->service_namespace != params->get_namespace())
 			continue;
@@ -522,16 +913,14 @@ bool PolarisPolicy::matching_instances(struct destination_bound *dst_bounds,
 		}
 
 		if (flag == true)
-			subset.push_back(this->servers[i]);
+			subset.push_back(snap->servers[i]);
 	}
-
-	return true;
 }
 
 bool PolarisPolicy::matching_rules(
 					const std::string& caller_name,
 					const std::string& caller_namespace,
-					const std::map<std::string, std::string>& meta,
+					const struct fragment_meta& meta,
 					const std::vector<struct source_bound>& src_bounds) const
 {
 	const struct source_bound& src = src_bounds[0]; // make sure there`s only one src
@@ -544,8 +933,9 @@ bool PolarisPolicy::matching_rules(
 		return false;
 	}
 
-	for (const auto &m : meta)
+	for (size_t i = 0; i < meta.size; i++)
 	{
+		const auto& m = meta.pairs[i];
 		const auto label_it = src.metadata.find(m.first);
 		if (label_it == src.metadata.end() ||
 			(label_it->second.value != "*" &&
@@ -602,10 +992,14 @@ bool inline PolarisPolicy::nearby_match_degrade(size_t unhealthy, size_t total)
 		   unhealthy * 100 / total > this->config.nearby_unhealthy_percentage);
 }
 
+/*
+ * Fill nearby_inst with the nearby ones of instances.
+ * Returning true with empty nearby_inst means using all the instances.
+ */
 bool PolarisPolicy::nearby_router_filter(
-						std::vector<EndpointAddress *>& instances)
+						const std::vector<EndpointAddress *>& instances,
+						std::vector<EndpointAddress *>& nearby_inst)
 {
-	std::vector<EndpointAddress *> nearby_inst;
 	size_t unhealthy_count = 0;
 
 	if (this->config.nearby_strict_nearby &&
@@ -644,12 +1038,18 @@ bool PolarisPolicy::nearby_router_filter(
 				!this->config.nearby_strict_nearby;
 	}
 
-	instances.assign(nearby_inst.begin(), nearby_inst.end());
 	return true;
 }
 
+/*
+ * With the prefix sums of weights, pick by binary search and retry a few
+ * times if the one picked is unhealthy. That gives the same distribution
+ * as weighting the healthy ones only, in O(log n) while most are healthy.
+ * Otherwise fall back to scanning the instances.
+ */
 EndpointAddress *PolarisPolicy::get_one(
-						std::vector<EndpointAddress *>& instances,
+						const std::vector<EndpointAddress *>& instances,
+						const std::vector<int> *weights,
 						WFNSTracing *tracing)
 {
 	int x, s = 0;
@@ -657,10 +1057,20 @@ EndpointAddress *PolarisPolicy::get_one(
 	size_t i;
 	PolarisInstanceParams *params;
 
-	if (this->config.enable_nearby_based_router)
+	if (instances.empty())
+		return NULL;
+
+	if (weights && weights->back() > 0)
 	{
-		if (!this->nearby_router_filter(instances))
-			return NULL;
+		for (int retry = 0; retry < GET_ONE_MAX_RETRY; retry++)
+		{
+			x = Random::uniform(weights->back());
+			i = std::upper_bound(weights->begin(), weights->end(), x) -
+				weights->begin();
+
+			if (this->check_server_health(instances[i]))
+				return instances[i];
+		}
 	}
 
 	for (i = 0; i < instances.size(); i++)
@@ -673,10 +1083,10 @@ EndpointAddress *PolarisPolicy::get_one(
 	}
 
 	if (total_weight == 0) // no healthy servers in the top priority subset
-		return instances[rand() % instances.size()];
+		return instances[Random::uniform(instances.size())];
 
 	if (total_weight > 0)
-		x = rand() % total_weight;
+		x = Random::uniform(total_weight);
 
 	for (i = 0; i < instances.size(); i++)
 	{
@@ -695,68 +1105,463 @@ EndpointAddress *PolarisPolicy::get_one(
 	return instances[i];
 }
 
+/*
+ * Power of two choices: draw two by weight and take the one with fewer
+ * requests in flight. The counters are released in success()/failed().
+ */
+EndpointAddress *PolarisPolicy::get_one_by_load(
+						const std::vector<EndpointAddress *>& instances,
+						const std::vector<int> *weights,
+						WFNSTracing *tracing)
+{
+	EndpointAddress *first = this->get_one(instances, weights, tracing);
+	EndpointAddress *second;
+	PolarisInstanceParams *params;
+
+	if (!first)
+		return NULL;
+
+	second = this->get_one(instances, weights, tracing);
+	if (second != first &&
+		static_cast<PolarisInstanceParams *>(second->params)->get_inflight() <
+		static_cast<PolarisInstanceParams *>(first->params)->get_inflight())
+	{
+		first = second;
+	}
+
+	params = static_cast<PolarisInstanceParams *>(first->params);
+	params->inc_inflight();
+	return first;
+}
+
+void PolarisPolicy::finish_one_server(WFNSTracing *tracing)
+{
+	struct TracingData *data;
+	PolarisInstanceParams *params;
+
+	if (this->config.load_balancer_type != LoadBalancerP2C ||
+		!tracing || !tracing->data)
+	{
+		return;
+	}
+
+	data = (struct TracingData *)tracing->data;
+	if (data->history.empty())
+		return;
+
+	params = static_cast<PolarisInstanceParams *>(data->history.back()->params);
+	params->dec_inflight();
+}
+
+void PolarisPolicy::success(RouteManager::RouteResult *result,
+							WFNSTracing *tracing,
+							CommTarget *target)
+{
+	this->finish_one_server(tracing);
+	this->WFServiceGovernance::success(result, tracing, target);
+}
+
+void PolarisPolicy::failed(RouteManager::RouteResult *result,
+						   WFNSTracing *tracing,
+						   CommTarget *target)
+{
+	this->finish_one_server(tracing);
+	this->WFServiceGovernance::failed(result, tracing, target);
+}
+
+/*
+ * ringHash: every server owns points on the ring in proportion to its
+ * weight. maglev: servers fill the lookup table in turn by their own
+ * permutations, the ones of smaller weights skip some turns.
+ */
+void PolarisPolicy::build_hash_ring(const std::vector<EndpointAddress *>& servers,
+									struct hash_ring& ring) const
+{
+	PolarisInstanceParams *params;
+	double total_weight = 0;
+	double max_weight = 0;
+	size_t n = servers.size();
+	size_t i;
+
+	for (i = 0; i < n; i++)
+	{
+		params = static_cast<PolarisInstanceParams *>(servers[i]->params);
+		if (params->get_weight() > 0)
+		{
+			total_weight += params->get_weight();
+			if (params->get_weight() > max_weight)
+				max_weight = params->get_weight();
+		}
+	}
+
+	if (total_weight == 0)
+		return;
+
+	if (this->config.load_balancer_type == LoadBalancerRingHash)
+	{
+		size_t ring_size = n * RING_HASH_POINTS_PER_SERVER;
+
+		ring_size = std::max(ring_size, RING_HASH_MIN_POINTS);
+		ring_size = std::min(ring_size, RING_HASH_MAX_POINTS);
+		ring.points.reserve(ring_size + n);
+
+		for (i = 0; i < n; i++)
+		{
+			const std::string& address = servers[i]->address;
+			size_t count;
+
+			params = static_cast<PolarisInstanceParams *>(servers[i]->params);
+			if (params->get_weight() <= 0)
+				continue;
+
+			count = (size_t)(params->get_weight() * ring_size / total_weight + 0.5);
+			if (count == 0)
+				count = 1;
+
+			for (size_t j = 0; j < count; j++)
+			{
+				ring.points.emplace_back(hash_bytes(address.c_str(),
+													address.size(), j), i);
+			}
+		}
+
+		std::sort(ring.points.begin(), ring.points.end());
+		return;
+	}
+
+	// keep the table small when there are many subsets of few servers
+	size_t table_size = std::min(n * MAGLEV_SLOTS_PER_SERVER,
+								 std::max(n * 10, MAGLEV_SMALL_TABLE_SIZE));
+	std::vector<uint64_t> offset(n), skip(n), next(n, 0);
+	std::vector<double> target(n, 0);
+	size_t filled = 0;
+
+	table_size = next_prime(std::max(table_size, MAGLEV_MIN_TABLE_SIZE));
+	ring.lookup.assign(table_size, (unsigned int)-1);
+
+	for (i = 0; i < n; i++)
+	{
+		const std::string& address = servers[i]->address;
+
+		offset[i] = hash_bytes(address.c_str(), address.size(), 0) % table_size;
+		skip[i] = hash_bytes(address.c_str(), address.size(), 1) %
+				  (table_size - 1) + 1;
+	}
+
+	for (size_t turn = 0; filled < table_size; turn++)
+	{
+		for (i = 0; i < n && filled < table_size; i++)
+		{
+			params = static_cast<PolarisInstanceParams *>(servers[i]->params);
+			if (params->get_weight() <= 0 ||
+				turn * params->get_weight() < target[i])
+			{
+				continue;
+			}
+
+			target[i] += max_weight;
+			uint64_t slot = (offset[i] + skip[i] * next[i]) % table_size;
+			while (ring.lookup[slot] != (unsigned int)-1)
+			{
+				next[i]++;
+				slot = (offset[i] + skip[i] * next[i]) % table_size;
+			}
+
+			ring.lookup[slot] = i;
+			next[i]++;
+			filled++;
+		}
+	}
+}
+
+/*
+ * Walk on from the hashed position to the first healthy server.
+ * Without a ring, as for the subsets filtered per request, use weighted
+ * rendezvous hashing, which is consistent as well.
+ */
+EndpointAddress *PolarisPolicy::get_one_by_hash(
+						const std::vector<EndpointAddress *>& instances,
+						const struct hash_ring *ring,
+						uint64_t hash)
+{
+	EndpointAddress *first = NULL;
+	EndpointAddress *addr;
+	size_t i;
+
+	if (instances.empty())
+		return NULL;
+
+	if (ring && ring->points.size())
+	{
+		auto it = std::lower_bound(ring->points.begin(), ring->points.end(),
+								   std::make_pair(hash, 0U));
+
+		for (i = 0; i < ring->points.size(); i++, it++)
+		{
+			if (it == ring->points.end())
+				it = ring->points.begin();
+
+			addr = instances[it->second];
+			if (this->check_server_health(addr))
+				return addr;
+
+			if (!first)
+				first = addr;
+		}
+
+		return first;
+	}
+
+	if (ring && ring->lookup.size())
+	{
+		size_t slot = hash % ring->lookup.size();
+
+		for (i = 0; i < ring->lookup.size(); i++)
+		{
+			addr = instances[ring->lookup[slot]];
+			if (this->check_server_health(addr))
+				return addr;
+
+			if (!first)
+				first = addr;
+
+			if (++slot == ring->lookup.size())
+				slot = 0;
+		}
+
+		return first;
+	}
+
+	PolarisInstanceParams *params;
+	double best_score = -1;
+	double score;
+	double u;
+	bool healthy;
+	bool best_healthy = false;
+
+	for (EndpointAddress *addr : instances)
+	{
+		params = static_cast<PolarisInstanceParams *>(addr->params);
+		healthy = this->check_server_health(addr);
+		if (best_healthy && !healthy)
+			continue;
+
+		// u in (0, 1), score = weight / -ln(u)
+		u = ((hash_bytes(addr->address.c_str(), addr->address.size(), hash)
+			  >> 11) + 0.5) / 9007199254740992.0;
+		score = std::max(params->get_weight(), 1) / -log(u);
+
+		if ((healthy && !best_healthy) || score > best_score)
+		{
+			first = addr;
+			best_score = score;
+			best_healthy = healthy;
+		}
+	}
+
+	return first;
+}
+
+static inline size_t fragment_hash(const char *fragment, size_t len)
+{
+	size_t hash = 2166136261UL;
+
+	for (size_t i = 0; i < len; i++)
+	{
+		hash ^= (unsigned char)fragment[i];
+		hash *= 16777619UL;
+	}
+
+	return hash;
+}
+
+// the value of "hash_key" in fragment, or the whole fragment without it
+static uint64_t fragment_hash_key(const char *fragment, size_t len)
+{
+	size_t key_len = strlen(FRAGMENT_HASH_KEY);
+	const char *end = fragment + len;
+	const char *ele = fragment;
+	const char *next;
+
+	while (ele < end)
+	{
+		next = (const char *)memchr(ele, '&', end - ele);
+		if (!next)
+			next = end;
+
+		if ((size_t)(next - ele) > key_len &&
+			memcmp(ele, FRAGMENT_HASH_KEY, key_len) == 0 && ele[key_len] == '=')
+		{
+			ele += key_len + 1;
+			return hash_bytes(ele, next - ele, 0);
+		}
+
+		ele = next + 1;
+	}
+
+	return hash_bytes(fragment, len, 0);
+}
+
+/*
+ * Look up the fragment in the thread`s cache, parse it and match the
+ * rules only when it`s missing or the rules have changed since then.
+ * The returned entry is valid until the next call in the same thread.
+ */
+const struct PolarisPolicy::fragment_entry *
+PolarisPolicy::parse_fragment(const char *fragment,
+							  const struct policy_snapshot *snap,
+							  struct select_scratch *scratch)
+{
+	size_t len = strlen(fragment);
+	size_t hash = fragment_hash(fragment, len);
+	struct fragment_entry *set = scratch->fragments[hash % FRAGMENT_CACHE_SETS];
+	struct fragment_entry *entry = &set[0];
+
+	scratch->tick++;
+	for (size_t i = 0; i < FRAGMENT_CACHE_WAYS; i++)
+	{
+		if (set[i].revision == snap->rules_revision &&
+			set[i].fragment.size() == len &&
+			memcmp(set[i].fragment.c_str(), fragment, len) == 0)
+		{
+			set[i].last_used = scratch->tick;
+			return &set[i];
+		}
+
+		if (set[i].last_used < entry->last_used)
+			entry = &set[i];
+	}
+
+	entry->fragment.assign(fragment, len);
+	entry->hash = fragment_hash_key(fragment, len);
+	entry->revision = snap->rules_revision;
+	entry->last_used = scratch->tick;
+	entry->dst_bounds = NULL;
+	entry->valid = this->split_fragment(fragment, entry->caller_name,
+										entry->caller_namespace,
+										entry->meta);
+
+	if (entry->valid && entry->meta.size &&
+		this->config.enable_rule_base_router)
+	{
+		this->matching_bounds(snap, entry->caller_name,
+							  entry->caller_namespace,
+							  entry->meta, &entry->dst_bounds);
+	}
+
+	return entry;
+}
+
+static void fragment_meta_add(const char *key, size_t key_len,
+							  const char *value, size_t value_len,
+							  std::vector<std::pair<std::string, std::string>>& pairs,
+							  size_t& size)
+{
+	for (size_t i = 0; i < size; i++)
+	{
+		const std::string& k = pairs[i].first;
+
+		if (k.size() == key_len && memcmp(k.c_str(), key, key_len) == 0)
+			return;
+	}
+
+	if (size == pairs.size())
+		pairs.emplace_back();
+
+	pairs[size].first.assign(key, key_len);
+	pairs[size].second.assign(value, value_len);
+	size++;
+}
+
 /*
  * fragment format: #k1=v1&k2=v2&caller_namespace.caller_name
  *
  * if kv pair is for meta router, add "meta" as prefix of each key:
  * 					#meta.k1=v1&meta.k2=v2&caller_namespace.caller_name
+ *
+ * Parsed in place without any temporary strings, select() calls it for
+ * every request.
  */
 bool PolarisPolicy::split_fragment(const char *fragment,
 								   std::string& caller_name,
 								   std::string& caller_namespace,
-								   std::map<std::string, std::string>& meta)
+								   struct fragment_meta& meta)
 {
+	const char *caller_info;
+	const char *caller_end;
+	const char *frag_end;
+	const char *ele;
+	const char *end;
+	const char *eq;
+	const char *val_end;
+	const char *pos;
+
+	meta.size = 0;
 	if (fragment == NULL)
 		return false;
 
-	std::string caller_info = fragment;
-	std::vector<std::string> arr = StringUtil::split(caller_info, '&');
-	std::size_t pos;
+	frag_end = fragment + strlen(fragment);
+	caller_info = fragment;
+	caller_end = frag_end;
 
-	if (!arr.empty())
+	for (ele = fragment; ele < frag_end; ele = end + 1)
 	{
-		for (const auto& ele : arr)
-		{
-			if (ele.empty())
-				continue;
+		end = (const char *)memchr(ele, '&', frag_end - ele);
+		if (!end)
+			end = frag_end;
 
-			std::vector<std::string> kv = StringUtil::split(ele, '=');
+		if (ele == end)
+			continue;
 
-			if (kv.size() == 1)
-			{
-				caller_info = ele;
-				continue;
-			}
+		eq = (const char *)memchr(ele, '=', end - ele);
+		if (!eq)
+		{
+			caller_info = ele;
+			caller_end = end;
+			continue;
+		}
 
-			if (kv[0].empty() || kv[1].empty())
-				return false;
+		val_end = (const char *)memchr(eq + 1, '=', end - eq - 1);
+		if (!val_end)
+			val_end = end;
 
-			if (meta.count(kv[0]) > 0)
-				continue;
+		if (eq == ele || val_end == eq + 1)
+			return false;
 
-			// If rule_base_router enable, key "meta.xxx" means "meta.xxx".
-			// If dst_meta_router enable, key "meta.xxx" means "xxx".
-			if (this->config.enable_dst_meta_router)
+		// for load balancer only, not a meta to match
+		if ((size_t)(eq - ele) == strlen(FRAGMENT_HASH_KEY) &&
+			memcmp(ele, FRAGMENT_HASH_KEY, eq - ele) == 0)
+		{
+			continue;
+		}
+
+		// If rule_base_router enable, key "meta.xxx" means "meta.xxx".
+		// If dst_meta_router enable, key "meta.xxx" means "xxx".
+		if (this->config.enable_dst_meta_router)
+		{
+			for (pos = ele; pos + 5 <= eq; pos++)
 			{
-				pos = kv[0].find("meta.");
-				if (pos == std::string::npos)
-					continue;
-				else
-					meta.emplace(kv[0].substr(pos + 5), std::move(kv[1]));
+				if (memcmp(pos, "meta.", 5) == 0)
+					break;
 			}
-			else
-				meta.emplace(std::move(kv[0]), std::move(kv[1]));
+
+			if (pos + 5 <= eq)
+				fragment_meta_add(pos + 5, eq - pos - 5, eq + 1,
+								  val_end - eq - 1, meta.pairs, meta.size);
 		}
+		else
+			fragment_meta_add(ele, eq - ele, eq + 1, val_end - eq - 1,
+							  meta.pairs, meta.size);
 	}
 
 	if (this->config.enable_rule_base_router)
 	{
-		pos = caller_info.find(".");
-		if (pos == std::string::npos)
+		pos = (const char *)memchr(caller_info, '.', caller_end - caller_info);
+		if (!pos)
 			return false;
 
-		caller_namespace = caller_info.substr(0, pos);
-		caller_name = caller_info.substr(pos + 1);
+		caller_namespace.assign(caller_info, pos - caller_info);
+		caller_name.assign(pos + 1, caller_end - pos - 1);
 	}
 
 	return true;
@@ -780,21 +1585,23 @@ bool PolarisPolicy::check_server_health(const EndpointAddress *addr)
  * 2. else if all instances are unheathy, return them, too;
  * 3. else use failover strategy.
  */
-bool PolarisPolicy::matching_meta(const std::map<std::string, std::string>& meta,
-								  std::vector<EndpointAddress *>& subset)
+bool PolarisPolicy::matching_meta(const struct policy_snapshot *snap,
+								  const struct fragment_meta& meta,
+								  std::vector<EndpointAddress *>& subset,
+								  std::vector<EndpointAddress *>& unhealthy)
 {
 	PolarisInstanceParams *params;
 	bool flag;
-	std::vector<EndpointAddress *> unhealthy;
 
-	for (size_t i = 0; i < this->servers.size(); i++)
+	for (size_t i = 0; i < snap->servers.size(); i++)
 	{
-		params = static_cast<PolarisInstanceParams *>(this->servers[i]->params);
+		params = static_cast<PolarisInstanceParams *>(snap->servers[i]->params);
 		const std::map<std::string, std::string>& inst_meta = params->get_meta();
 		flag = true;
 
-		for (const auto &kv : meta)
+		for (size_t j = 0; j < meta.size; j++)
 		{
+			const auto& kv = meta.pairs[j];
 			const auto inst_meta_it = inst_meta.find(kv.first);
 
 			if (inst_meta_it == inst_meta.end() ||
@@ -807,12 +1614,10 @@ bool PolarisPolicy::matching_meta(const std::map<std::string, std::string>& meta
 
 		if (flag == true)
 		{
-			++this->servers[i]->ref;
-
-			if (this->check_server_health(this->servers[i]))
-				subset.push_back(this->servers[i]);
+			if (this->check_server_health(snap->servers[i]))
+				subset.push_back(snap->servers[i]);
 			else
-				unhealthy.push_back(this->servers[i]);
+				unhealthy.push_back(snap->servers[i]);
 		}
 	}
 
@@ -828,32 +1633,33 @@ bool PolarisPolicy::matching_meta(const std::map<std::string, std::string>& meta
 	switch (this->config.failover_type)
 	{
 	case MetadataFailoverAll:
-		subset = this->servers;
+		// empty subset means all the servers
 		return true;
 	case MetadataFailoverNotKey:
-		return this->matching_meta_notkey(meta, subset);
+		return this->matching_meta_notkey(snap, meta, subset, unhealthy);
 	default:
 		return false;
 	}
 }
 
 // find instances which don`t contain any keys in meta
-bool PolarisPolicy::matching_meta_notkey(const std::map<std::string, std::string>& meta,
-										 std::vector<EndpointAddress *>& subset)
+bool PolarisPolicy::matching_meta_notkey(const struct policy_snapshot *snap,
+										 const struct fragment_meta& meta,
+										 std::vector<EndpointAddress *>& subset,
+										 std::vector<EndpointAddress *>& unhealthy)
 {
 	PolarisInstanceParams *params;
 	bool flag;
-	std::vector<EndpointAddress *> unhealthy;
 
-	for (size_t i = 0; i < this->servers.size(); i++)
+	for (size_t i = 0; i < snap->servers.size(); i++)
 	{
-		params = static_cast<PolarisInstanceParams *>(this->servers[i]->params);
+		params = static_cast<PolarisInstanceParams *>(snap->servers[i]->params);
 		const std::map<std::string, std::string>& inst_meta = params->get_meta();
 		flag = true;
 
-		for (const auto &kv : meta)
+		for (size_t j = 0; j < meta.size; j++)
 		{
-			if (inst_meta.find(kv.first) != inst_meta.end())
+			if (inst_meta.find(meta.pairs[j].first) != inst_meta.end())
 			{
 				flag = false;
 				break;
@@ -862,11 +1668,10 @@ bool PolarisPolicy::matching_meta_notkey(const std::map<std::string, std::string
 
 		if (flag == true)
 		{
-			++this->servers[i]->ref;
-			if (this->check_server_health(this->servers[i]))
-				subset.push_back(this->servers[i]);
+			if (this->check_server_health(snap->servers[i]))
+				subset.push_back(snap->servers[i]);
 			else
-				unhealthy.push_back(this->servers[i]);
+				unhealthy.push_back(snap->servers[i]);
 		}
 	}
 
@@ -1,6 +1,10 @@
 #ifndef _POLARISPOLICIES_H_
 #define _POLARISPOLICIES_H_
 
+#include <stdint.h>
+#include <atomic>
+#include <deque>
+#include <memory>
 #include <utility>
 #include <string>
 #include <vector>
@@ -20,6 +24,13 @@ enum MetadataFailoverType {
 	MetadataFailoverNotKey,
 };
 
+enum LoadBalancerType {
+	LoadBalancerWeightedRandom, // default
+	LoadBalancerRingHash,
+	LoadBalancerMaglev,
+	LoadBalancerP2C,
+};
+
 enum NearbyMatchLevelType {
 	NearbyMatchLevelZone, // default
 	NearbyMatchLevelRegion,
@@ -61,6 +72,7 @@ private:
 	bool enable_dst_meta_router;
 	bool enable_nearby_based_router;
 	enum MetadataFailoverType failover_type;
+	enum LoadBalancerType load_balancer_type;
 	// for ruleBaseRouter
 	enum NearbyMatchLevelType nearby_match_level;
 	enum NearbyMatchLevelType nearby_max_match_level;
@@ -100,12 +112,20 @@ public:
 		this->failover_type = type;
 	}
 
+	// ringHash and maglev hash "hash_key" in uri fragment, or the fragment
+	void set_load_balancer_type(enum LoadBalancerType type)
+	{
+		this->load_balancer_type = type;
+	}
+
 	friend class PolarisPolicy;
 };
 
 class PolarisInstanceParams : public PolicyAddrParams
 {
 public:
+	const std::string& get_id() const { return this->id; }
+	const std::string& get_revision() const { return this->revision; }
 	int get_weight() const { return this->weight; }
 	const std::string& get_namespace() const { return this->service_namespace; }
 	const std::map<std::string, std::string>& get_meta() const
@@ -117,11 +137,19 @@ public:
 	const std::string& get_zone() const { return this->zone; }
 	const std::string& get_campus() const { return this->campus; }
 
+	// requests selected to this instance and not finished yet
+	int get_inflight() const { return this->inflight.load(std::memory_order_relaxed); }
+	void inc_inflight() { this->inflight.fetch_add(1, std::memory_order_relaxed); }
+	void dec_inflight();
+
 public:
 	PolarisInstanceParams(const struct instance *inst,
 						  const struct AddressParams *params);
 
 private:
+	std::atomic<int> inflight;
+	std::string id;
+	std::string revision;
 	int priority;
 	int weight;
 	bool enable_healthcheck;
@@ -139,10 +167,18 @@ class PolarisPolicy : public WFServiceGovernance
 {
 public:
 	PolarisPolicy(const PolarisPolicyConfig *config);
+	virtual ~PolarisPolicy();
 
 	virtual bool select(const ParsedURI& uri, WFNSTracing *tracing,
 						EndpointAddress **addr);
 
+	virtual void success(RouteManager::RouteResult *result,
+						 WFNSTracing *tracing,
+						 CommTarget *target);
+	virtual void failed(RouteManager::RouteResult *result,
+						WFNSTracing *tracing,
+						CommTarget *target);
+
 	void update_instances(const std::vector<struct instance>& instances);
 	void update_inbounds(const std::vector<struct routing_bound>& inbounds);
 	void update_outbounds(const std::vector<struct routing_bound>& outbounds);
@@ -151,12 +187,123 @@ private:
 	using BoundRulesMap = std::unordered_map<std::string,
 											 std::vector<struct routing_bound>>;
 
-	PolarisPolicyConfig config;
-	BoundRulesMap inbound_rules;
-	BoundRulesMap outbound_rules;
-	pthread_rwlock_t inbound_rwlock;
-	pthread_rwlock_t outbound_rwlock;
+	/*
+	 * Consistent hash of some servers, by the indexes in their vector.
+	 * ringHash uses points sorted by hash, maglev uses the lookup table.
+	 */
+	struct hash_ring
+	{
+		std::vector<std::pair<uint64_t, unsigned int>> points;
+		std::vector<unsigned int> lookup;
+	};
 
+	// the instances matched by one dst_bound, no matter healthy or not
+	struct bound_subset
+	{
+		const struct destination_bound *bound;
+		std::vector<EndpointAddress *> servers;
+		std::vector<int> weights;
+		struct hash_ring ring;
+	};
+
+	// subsets of one rule's dst_bounds, grouped by ascending priority
+	using BoundSubsets = std::vector<std::vector<struct bound_subset>>;
+	using RuleIndex = std::unordered_map<const std::vector<struct destination_bound> *,
+										 BoundSubsets>;
+
+	/*
+	 * Everything select() reads is published as one immutable snapshot.
+	 * Writers build a new one and swap it in, readers never take a lock.
+	 * Each snapshot holds one ref of every EndpointAddress in servers.
+	 * The weights vectors are the prefix sums of their servers` weights.
+	 * rules_revision changes with the rules, unique among all policies.
+	 */
+	struct policy_snapshot
+	{
+		std::vector<EndpointAddress *> servers;
+		std::vector<int> server_weights;
+		std::shared_ptr<const struct hash_ring> server_ring;
+		std::shared_ptr<const BoundRulesMap> inbound_rules;
+		std::shared_ptr<const BoundRulesMap> outbound_rules;
+		RuleIndex rule_index;
+		unsigned long long rules_revision;
+	};
+
+	/*
+	 * Readers count themselves into one of the slots picked by thread,
+	 * on the side chosen by snapshot_epoch. Replaced snapshots are retired
+	 * and freed by later writers, once the readers of their epoch are gone.
+	 */
+	struct snapshot_reader
+	{
+		std::atomic<long> count[2];
+		char padding[64 - 2 * sizeof (std::atomic<long>)];
+	};
+
+	enum
+	{
+		SNAPSHOT_READER_SLOTS	=	64,
+	};
+
+	/*
+	 * The kv pairs parsed from uri fragment. Only the first size pairs
+	 * are valid, the rest are kept to reuse their strings` capacity.
+	 */
+	struct fragment_meta
+	{
+		std::vector<std::pair<std::string, std::string>> pairs;
+		size_t size;
+	};
+
+	/*
+	 * A parsed uri fragment, and the dst_bounds it matched with the rules
+	 * of revision. Entries of other revisions are stale.
+	 */
+	struct fragment_entry
+	{
+		std::string fragment;
+		unsigned long long revision;
+		unsigned long long last_used;
+		bool valid;
+		uint64_t hash;
+		std::string caller_name;
+		std::string caller_namespace;
+		struct fragment_meta meta;
+		const std::vector<struct destination_bound> *dst_bounds;
+	};
+
+	enum
+	{
+		FRAGMENT_CACHE_SETS		=	32,
+		FRAGMENT_CACHE_WAYS		=	2,
+	};
+
+	/*
+	 * Per thread buffers of select(). They are reset but never shrunk,
+	 * so select() doesn`t allocate any memory once they have grown.
+	 * Most calls come from a few callers, so the parsed fragments are
+	 * kept in a small set associative LRU cache.
+	 */
+	struct select_scratch
+	{
+		struct fragment_entry fragments[FRAGMENT_CACHE_SETS][FRAGMENT_CACHE_WAYS];
+		unsigned long long tick;
+		std::vector<EndpointAddress *> subset;
+		std::vector<EndpointAddress *> unhealthy;
+		std::vector<EndpointAddress *> nearby;
+	};
+
+	PolarisPolicyConfig config;
+	std::atomic<struct policy_snapshot *> snapshot;
+	std::atomic<unsigned int> snapshot_epoch;
+	unsigned int drained_epoch;
+	std::deque<std::pair<struct policy_snapshot *, unsigned int>> retired;
+	struct snapshot_reader readers[SNAPSHOT_READER_SLOTS];
+	pthread_mutex_t update_lock;
+	std::atomic<long long> next_breaker_check;
+
+	// the EndpointAddress of each instance id in servers, by update_lock
+	std::unordered_map<std::string, EndpointAddress *> instance_ids;
 	int total_weight;
 	int available_weight;
 
@@ -164,46 +311,88 @@ private:
 	virtual void recover_one_server(const EndpointAddress *addr);
 	virtual void fuse_one_server(const EndpointAddress *addr);
 	virtual void add_server_locked(EndpointAddress *addr);
-	void clear_instances_locked();
-
-	void matching_bounds(const std::string& caller_name,
+	void add_instance_locked(EndpointAddress *addr);
+	void remove_instance_locked(EndpointAddress *addr);
+	bool instance_unchanged(const EndpointAddress *addr,
+							const struct instance *inst,
+							const std::string& name) const;
+
+	struct policy_snapshot *acquire_snapshot(unsigned int *side);
+	void release_snapshot(unsigned int side);
+	void publish_snapshot(struct policy_snapshot *snap);
+	bool try_advance_epoch();
+	void reclaim_snapshots();
+	void delete_snapshot(struct policy_snapshot *snap);
+	void check_breaker_periodically();
+
+	void update_bounds(const std::vector<struct routing_bound>& bounds,
+					   const BoundRulesMap *prev_rules,
+					   BoundRulesMap& rules);
+	void build_rule_index(struct policy_snapshot *snap);
+	void index_rules(struct policy_snapshot *snap, const BoundRulesMap *rules);
+
+	void matching_bounds(const struct policy_snapshot *snap,
+						 const std::string& caller_name,
 						 const std::string& caller_namespace,
-						 const std::map<std::string, std::string>& meta,
-						 std::vector<struct destination_bound> **dst_bounds);
+						 const struct fragment_meta& meta,
+						 const std::vector<struct destination_bound> **dst_bounds);
 
 	bool matching_subset(
-			std::vector<struct destination_bound> *dest_bounds,
-			std::vector<EndpointAddress *>& matched_subset);
+			const struct policy_snapshot *snap,
+			const std::vector<struct destination_bound> *dest_bounds,
+			const struct bound_subset **matched_subset);
 
 	bool matching_rules(
 			const std::string& caller_name,
 			const std::string& caller_namespace,
-			const std::map<std::string, std::string>& meta,
+			const struct fragment_meta& meta,
 			const std::vector<struct source_bound>& src_bounds) const;
 
-	bool matching_instances(struct destination_bound *dst_bounds,
-							std::vector<EndpointAddress *>& subsets);
-
-	bool matching_meta(const std::map<std::string, std::string>& meta,
-					   std::vector<EndpointAddress *>& subset);
-	bool matching_meta_notkey(const std::map<std::string, std::string>& meta,
-							  std::vector<EndpointAddress *>& subset);
-
-	size_t subsets_weighted_random(
-			const std::vector<struct destination_bound *>& bounds,
-			const std::vector<std::vector<EndpointAddress *>>& subsets);
-
-	EndpointAddress *get_one(std::vector<EndpointAddress *>& instances,
+	void matching_instances(const struct policy_snapshot *snap,
+							const struct destination_bound *dst_bounds,
+							std::vector<EndpointAddress *>& subset);
+
+	bool matching_meta(const struct policy_snapshot *snap,
+					   const struct fragment_meta& meta,
+					   std::vector<EndpointAddress *>& subset,
+					   std::vector<EndpointAddress *>& unhealthy);
+	bool matching_meta_notkey(const struct policy_snapshot *snap,
+							  const struct fragment_meta& meta,
+							  std::vector<EndpointAddress *>& subset,
+							  std::vector<EndpointAddress *>& unhealthy);
+
+	const struct bound_subset *subsets_weighted_random(
+			const std::vector<struct bound_subset>& subsets,
+			bool healthy_only);
+	bool subset_available(const struct bound_subset& subset,
+						  bool healthy_only);
+
+	EndpointAddress *get_one(const std::vector<EndpointAddress *>& instances,
+							 const std::vector<int> *weights,
 							 WFNSTracing *tracing);
-	bool nearby_router_filter(std::vector<EndpointAddress *>& instances);
+	void build_hash_ring(const std::vector<EndpointAddress *>& servers,
+						 struct hash_ring& ring) const;
+	EndpointAddress *get_one_by_load(const std::vector<EndpointAddress *>& instances,
+									 const std::vector<int> *weights,
+									 WFNSTracing *tracing);
+	void finish_one_server(WFNSTracing *tracing);
+	EndpointAddress *get_one_by_hash(const std::vector<EndpointAddress *>& instances,
+									 const struct hash_ring *ring,
+									 uint64_t hash);
+	bool nearby_router_filter(const std::vector<EndpointAddress *>& instances,
+							  std::vector<EndpointAddress *>& nearby_inst);
 	bool nearby_match_level(const EndpointAddress *instance,
 							NearbyMatchLevelType level);
 	bool nearby_match_degrade(size_t unhealth, size_t total);
 
+	const struct fragment_entry *parse_fragment(
+			const char *fragment,
+			const struct policy_snapshot *snap,
+			struct select_scratch *scratch);
 	bool split_fragment(const char *fragment,
 						std::string& caller_name,
 						std::string& caller_namespace,
-						std::map<std::string, std::string>& meta);
+						struct fragment_meta& meta);
 
 	bool check_server_health(const EndpointAddress *addr);
 };
@@ -0,0 +1,72 @@
+#include <time.h>
+#include <atomic>
+#include "PolarisRandom.h"
+
+namespace polaris {
+
+struct random_state {
+    uint32_t s[4];
+    uint64_t generation;
+};
+
+// 0 means not seeded, every thread starts from its own random state
+static std::atomic<uint64_t> seed_generation(0);
+static std::atomic<uint64_t> seed_value(0);
+
+static inline uint32_t rotl(uint32_t x, int k) { return (x << k) | (x >> (32 - k)); }
+
+static void fill_state(struct random_state *state, uint64_t z) {
+    // splitmix64
+    for (int i = 0; i < 4; i++) {
+        z += 0x9e3779b97f4a7c15ULL;
+        uint64_t x = z;
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+        state->s[i] = (uint32_t)((x ^ (x >> 31)) >> 16);
+    }
+}
+
+static struct random_state *get_state() {
+    static thread_local struct random_state state = {{0, 0, 0, 0}, 0};
+    static thread_local bool initialized = false;
+    uint64_t generation = seed_generation.load(std::memory_order_acquire);
+
+    if (!initialized || state.generation != generation) {
+        if (generation == 0) {
+            struct timespec ts;
+
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            fill_state(&state, ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec) ^
+                                   (uint64_t)(uintptr_t)&state);
+        } else {
+            fill_state(&state, seed_value.load(std::memory_order_relaxed));
+        }
+
+        state.generation = generation;
+        initialized = true;
+    }
+
+    return &state;
+}
+
+uint32_t Random::next() {
+    struct random_state *state = get_state();
+    uint32_t *s = state->s;
+    uint32_t result = rotl(s[1] * 5, 7) * 9;
+    uint32_t t = s[1] << 9;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl(s[3], 11);
+    return result;
+}
+
+void Random::seed(uint64_t seed) {
+    seed_value.store(seed, std::memory_order_relaxed);
+    seed_generation.fetch_add(1, std::memory_order_release);
+}
+
+};  // namespace polaris
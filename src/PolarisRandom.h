@@ -0,0 +1,27 @@
+#ifndef _POLARISRANDOM_H_
+#define _POLARISRANDOM_H_
+
+#include <stdint.h>
+
+namespace polaris {
+
+/*
+ * xoshiro128** with one state per thread. Use it instead of rand(),
+ * which serializes all the callers on a lock in glibc.
+ */
+class Random {
+  public:
+    static uint32_t next();
+
+    // uniform in [0, n), n must not be 0
+    static uint32_t uniform(uint32_t n) {
+        return (uint32_t)(((uint64_t)Random::next() * n) >> 32);
+    }
+
+    // Restart the sequence of every thread from seed, for repeatable tests.
+    static void seed(uint64_t seed);
+};
+
+};  // namespace polaris
+
+#endif
@@ -1,5 +1,6 @@
 #include "PolarisTask.h"
 #include "PolarisClient.h"
+#include "PolarisDecoder.h"
 #include "json.hpp"
 
 using nlohmann::json;
@@ -7,7 +8,8 @@ using nlohmann::json;
 namespace polaris {
 
 #define REDIRECT_MAX       5
-#define CLUSTER_FAILED_MAX 20
+// the connections to the clusters are reused by every following request
+#define CLUSTER_KEEP_ALIVE (300 * 1000)
 
 #define CLUSTER_STATE_DISCOVER     1
 #define CLUSTER_STATE_HEALTHCHECK (1 << 1)
@@ -23,6 +25,85 @@ void from_json(const json &j, struct route_result &response);
 void from_json(const json &j, struct ratelimit_result &response);
 void from_json(const json &j, struct circuitbreaker_result &response);
 
+// the requests to discover/healthcheck clusters are routed by their upstreams
+static WFHttpTask *create_cluster_http_task(const PolarisUpstream *upstream,
+                                            const char *path, int retry_max,
+                                            http_callback_t callback,
+                                            bool long_poll = false) {
+    const std::string &name = long_poll ? upstream->get_long_poll_name()
+                                        : upstream->get_name();
+    auto *task = WFTaskFactory::create_http_task("http://" + name + path,
+                                                 REDIRECT_MAX,
+                                                 retry_max,
+                                                 std::move(callback));
+    task->set_keep_alive(CLUSTER_KEEP_ALIVE);
+    return task;
+}
+
+// the body is held by the PolarisTask, which finishes after the http task
+static void append_discover_body(protocol::HttpRequest *req, const std::string &prefix,
+                                 const std::string &revision, const std::string &suffix) {
+    std::string quoted = json(revision).dump();
+    req->append_output_body_nocopy(prefix.data(), prefix.size());
+    req->append_output_body(quoted.data(), quoted.size());
+    req->append_output_body_nocopy(suffix.data(), suffix.size());
+}
+
+static void split_discover_request(int type, const std::string &snamespace,
+                                   const std::string &sname,
+                                   std::string &prefix, std::string &suffix) {
+    static const std::string placeholder = "\x01revision\x01";
+    struct discover_request request {
+        .type = type, .service_name = sname,
+        .service_namespace = snamespace, .revision = placeholder,
+    };
+    const json j = request;
+    std::string body = j.dump();
+    std::string quoted = json(placeholder).dump();
+    std::string::size_type pos = body.find(quoted);
+    prefix = body.substr(0, pos);
+    suffix = body.substr(pos + quoted.size());
+}
+
+// the request of heartbeat is the same as deregister
+static struct deregister_request create_instance_request(const std::string &snamespace,
+                                                         const std::string &sname,
+                                                         const std::string &token,
+                                                         const struct instance *inst) {
+    struct deregister_request request;
+    if (!inst->id.empty()) {
+        request.id = inst->id;
+    } else {
+        request.service = sname;
+        request.service_namespace = snamespace;
+        request.host = inst->host;
+        request.port = inst->port;
+    }
+    if (!token.empty()) {
+        request.service_token = token;
+    }
+    return request;
+}
+
+std::shared_ptr<const struct discover_body>
+PolarisTask::create_discover_body(const std::string &snamespace, const std::string &sname) {
+    auto *body = new struct discover_body;
+    split_discover_request(INSTANCE, snamespace, sname,
+                           body->instances_prefix, body->instances_suffix);
+    split_discover_request(ROUTING, snamespace, sname,
+                           body->route_prefix, body->route_suffix);
+    return std::shared_ptr<const struct discover_body>(body);
+}
+
+std::shared_ptr<const std::string>
+PolarisTask::create_heartbeat_body(const std::string &snamespace, const std::string &sname,
+                                   const std::string &token,
+                                   const PolarisInstance &instance) {
+    const json j = create_instance_request(snamespace, sname, token,
+                                           instance.get_instance());
+    return std::make_shared<const std::string>(j.dump());
+}
+
 void PolarisTask::dispatch() {
     if (this->finish) {
         this->check_failed();
@@ -33,11 +114,21 @@ void PolarisTask::dispatch() {
     this->cluster.get_mutex()->lock();
     // todo: set cluster ttl for update
 
+    // without platform, the server connectors serve everything. set them
+    // once, not on every dispatch, or the lists grow with each request
     if (this->platform_id.empty() && this->platform_token.empty()) {
-        this->cluster.get_discover_clusters()->emplace_back(this->url);
-        this->cluster.get_healthcheck_clusters()->emplace_back(this->url);
-        *this->cluster.get_status() |= CLUSTER_STATE_DISCOVER;
-        *this->cluster.get_status() |= CLUSTER_STATE_HEALTHCHECK;
+        if (!(*this->cluster.get_status() & CLUSTER_STATE_DISCOVER)) {
+            *this->cluster.get_discover_clusters() = *this->cluster.get_server_connectors();
+            this->cluster.get_discover_upstream()->update_servers(
+                *this->cluster.get_discover_clusters());
+            *this->cluster.get_status() |= CLUSTER_STATE_DISCOVER;
+        }
+        if (!(*this->cluster.get_status() & CLUSTER_STATE_HEALTHCHECK)) {
+            *this->cluster.get_healthcheck_clusters() = *this->cluster.get_server_connectors();
+            this->cluster.get_healthcheck_upstream()->update_servers(
+                *this->cluster.get_healthcheck_clusters());
+            *this->cluster.get_status() |= CLUSTER_STATE_HEALTHCHECK;
+        }
     }
 
     if (!(*this->cluster.get_status() & CLUSTER_STATE_DISCOVER)) {
@@ -61,7 +152,7 @@ void PolarisTask::dispatch() {
             switch (this->apitype) {
                 case API_DISCOVER:
                     if (this->protocol == P_HTTP) {
-                        task = create_instances_http_task();
+                        task = create_discover_parallel_work();
                         break;
                     }
                 case API_REGISTER:
@@ -153,23 +244,30 @@ WFHttpTask *PolarisTask::create_discover_cluster_http_task() {
 }
 
 WFHttpTask *PolarisTask::create_instances_http_task() {
-    int pos = rand() % this->cluster.get_discover_clusters()->size();
-    std::string url = this->cluster.get_discover_clusters()->at(pos) +
-                      "/v1/Discover";
-
-    auto *task = WFTaskFactory::create_http_task(url,
-                                                 REDIRECT_MAX,
-                                                 this->retry_max,
-                                                 instances_http_callback);
+    auto *task = create_cluster_http_task(this->cluster.get_discover_upstream(),
+                                          "/v1/Discover", this->retry_max,
+                                          instances_http_callback,
+                                          this->long_poll_timeout > 0);
     protocol::HttpRequest *req = task->get_req();
     task->user_data = this;
     req->set_method(HttpMethodPost);
     req->add_header_pair("Content-Type", "application/json");
-    std::string servicekey = this->service_name + "." +
-                             this->service_namespace;
-    std::string revision = this->cluster.get_revision_map()->count(servicekey)
-                               ? (*this->cluster.get_revision_map())[servicekey]
-                               : "0";
+    std::string servicekey = this->service_namespace + "." +
+                             this->service_name;
+    auto *revision_map = this->cluster.get_revision_map();
+    auto iter = revision_map->find(servicekey);
+    std::string revision = iter != revision_map->end() ? iter->second : "0";
+    if (this->long_poll_timeout > 0) {
+        req->add_header_pair("Polaris-Long-Poll-Timeout",
+                             std::to_string(this->long_poll_timeout));
+        task->set_receive_timeout(this->long_poll_timeout +
+                                  this->config.get_api_timeout_milliseconds());
+    }
+    if (this->discover_body) {
+        append_discover_body(req, this->discover_body->instances_prefix,
+                             revision, this->discover_body->instances_suffix);
+        return task;
+    }
     struct discover_request request {
         .type = INSTANCE,
         .service_name = this->service_name,
@@ -178,26 +276,43 @@ WFHttpTask *PolarisTask::create_instances_http_task() {
     };
     std::string output = create_discover_request(request);
     req->append_output_body(output.c_str(), output.length());
-    series_of(this)->push_front(this);
     return task;
 }
 
+// instances and routing are independent, so send both at once
+ParallelWork *PolarisTask::create_discover_parallel_work() {
+    SeriesWork *series[2];
+
+    series[0] = Workflow::create_series_work(create_instances_http_task(), nullptr);
+    series[1] = Workflow::create_series_work(create_route_http_task(), nullptr);
+
+    auto *pwork = Workflow::create_parallel_work(series, 2, discover_parallel_callback);
+    pwork->set_context(this);
+    series_of(this)->push_front(this);
+    return pwork;
+}
+
 WFHttpTask *PolarisTask::create_route_http_task() {
-    int pos = rand() % this->cluster.get_discover_clusters()->size();
-    std::string url = this->cluster.get_discover_clusters()->at(pos) +
-                      "/v1/Discover";
-    auto *task = WFTaskFactory::create_http_task(url,
-                                                 REDIRECT_MAX,
-                                                 this->retry_max,
-                                                 route_http_callback);
+    auto *task = create_cluster_http_task(this->cluster.get_discover_upstream(),
+                                          "/v1/Discover", this->retry_max,
+                                          route_http_callback);
     task->user_data = this;
     protocol::HttpRequest *req = task->get_req();
     req->set_method(HttpMethodPost);
     req->add_header_pair("Content-Type", "application/json");
-    // todo: use route revision instead of 0
+    std::string servicekey = this->service_namespace + "." +
+                             this->service_name;
+    auto *routing_revision_map = this->cluster.get_routing_revision_map();
+    auto iter = routing_revision_map->find(servicekey);
+    std::string revision = iter != routing_revision_map->end() ? iter->second : "0";
+    if (this->discover_body) {
+        append_discover_body(req, this->discover_body->route_prefix,
+                             revision, this->discover_body->route_suffix);
+        return task;
+    }
     struct discover_request request {
         .type = ROUTING, .service_name = this->service_name,
-        .service_namespace = this->service_namespace, .revision = "0",
+        .service_namespace = this->service_namespace, .revision = revision,
     };
     std::string output = create_discover_request(request);
     req->append_output_body(output.c_str(), output.length());
@@ -205,13 +320,9 @@ WFHttpTask *PolarisTask::create_route_http_task() {
 }
 
 WFHttpTask *PolarisTask::create_register_http_task() {
-    int pos = rand() % this->cluster.get_discover_clusters()->size();
-    std::string url = this->cluster.get_discover_clusters()->at(pos) +
-                      "/v1/RegisterInstance";
-    auto *task = WFTaskFactory::create_http_task(url,
-                                                 REDIRECT_MAX,
-                                                 this->retry_max,
-                                                 register_http_callback);
+    auto *task = create_cluster_http_task(this->cluster.get_discover_upstream(),
+                                          "/v1/RegisterInstance", this->retry_max,
+                                          register_http_callback);
     protocol::HttpRequest *req = task->get_req();
     task->user_data = this;
     req->set_method(HttpMethodPost);
@@ -231,29 +342,17 @@ WFHttpTask *PolarisTask::create_register_http_task() {
 }
 
 WFHttpTask *PolarisTask::create_deregister_http_task() {
-    int pos = rand() % this->cluster.get_discover_clusters()->size();
-    std::string url = this->cluster.get_discover_clusters()->at(pos) +
-                      "/v1/DeregisterInstance";
-    auto *task = WFTaskFactory::create_http_task(url,
-                                                 REDIRECT_MAX,
-                                                 this->retry_max,
-                                                 register_http_callback);
+    auto *task = create_cluster_http_task(this->cluster.get_discover_upstream(),
+                                          "/v1/DeregisterInstance", this->retry_max,
+                                          register_http_callback);
     protocol::HttpRequest *req = task->get_req();
     task->user_data = this;
     req->set_method(HttpMethodPost);
     req->add_header_pair("Content-Type", "application/json");
-    struct deregister_request request;
-    if (!this->polaris_instance.get_instance()->id.empty()) {
-        request.id = this->polaris_instance.get_instance()->id;
-    } else {
-        request.service = this->service_name;
-        request.service_namespace = this->service_namespace;
-        request.host = this->polaris_instance.get_instance()->host;
-        request.port = this->polaris_instance.get_instance()->port;
-    }
-    if (!this->service_token.empty()) {
-        request.service_token = this->service_token;
-    }
+    struct deregister_request request =
+        create_instance_request(this->service_namespace, this->service_name,
+                                this->service_token,
+                                this->polaris_instance.get_instance());
     std::string output = create_deregister_request(request);
     req->append_output_body(output.c_str(), output.length());
     series_of(this)->push_front(this);
@@ -261,13 +360,9 @@ WFHttpTask *PolarisTask::create_deregister_http_task() {
 }
 
 WFHttpTask *PolarisTask::create_ratelimit_http_task() {
-    int pos = rand() % this->cluster.get_discover_clusters()->size();
-    std::string url = this->cluster.get_discover_clusters()->at(pos) +
-                      "/v1/Discover";
-    auto *task = WFTaskFactory::create_http_task(url,
-                                                 REDIRECT_MAX,
-                                                 this->retry_max,
-                                                 ratelimit_http_callback);
+    auto *task = create_cluster_http_task(this->cluster.get_discover_upstream(),
+                                          "/v1/Discover", this->retry_max,
+                                          ratelimit_http_callback);
     protocol::HttpRequest *req = task->get_req();
     task->user_data = this;
     req->set_method(HttpMethodPost);
@@ -283,13 +378,9 @@ WFHttpTask *PolarisTask::create_ratelimit_http_task() {
 }
 
 WFHttpTask *PolarisTask::create_circuitbreaker_http_task() {
-    int pos = rand() % this->cluster.get_discover_clusters()->size();
-    std::string url = this->cluster.get_discover_clusters()->at(pos) +
-                      "/v1/Discover";
-    auto *task = WFTaskFactory::create_http_task(url,
-                                                 REDIRECT_MAX,
-                                                 this->retry_max,
-                                                 circuitbreaker_http_callback);
+    auto *task = create_cluster_http_task(this->cluster.get_discover_upstream(),
+                                          "/v1/Discover", this->retry_max,
+                                          circuitbreaker_http_callback);
     protocol::HttpRequest *req = task->get_req();
     task->user_data = this;
     req->set_method(HttpMethodPost);
@@ -304,34 +395,26 @@ WFHttpTask *PolarisTask::create_circuitbreaker_http_task() {
     return task;
 }
 
-// the request is the same as deregister
 // the response is the same as register/deregister
 WFHttpTask *PolarisTask::create_heartbeat_http_task() {
-    int pos = rand() % this->cluster.get_healthcheck_clusters()->size();
-    std::string url = this->cluster.get_healthcheck_clusters()->at(pos) +
-                      "/v1/Heartbeat";
-    auto *task = WFTaskFactory::create_http_task(url,
-                                                 REDIRECT_MAX,
-                                                 this->retry_max,
-                                                 register_http_callback);
+    auto *task = create_cluster_http_task(this->cluster.get_healthcheck_upstream(),
+                                          "/v1/Heartbeat", this->retry_max,
+                                          register_http_callback);
     protocol::HttpRequest *req = task->get_req();
     task->user_data = this;
     req->set_method(HttpMethodPost);
     req->add_header_pair("Content-Type", "application/json");
-    struct deregister_request request;
-    if (!this->polaris_instance.get_instance()->id.empty()) {
-        request.id = this->polaris_instance.get_instance()->id;
+    if (this->heartbeat_body) {
+        req->append_output_body_nocopy(this->heartbeat_body->data(),
+                                       this->heartbeat_body->size());
     } else {
-        request.service = this->service_name;
-        request.service_namespace = this->service_namespace;
-        request.host = this->polaris_instance.get_instance()->host;
-        request.port = this->polaris_instance.get_instance()->port;
+        struct deregister_request request =
+            create_instance_request(this->service_namespace, this->service_name,
+                                    this->service_token,
+                                    this->polaris_instance.get_instance());
+        std::string output = create_deregister_request(request);
+        req->append_output_body(output.c_str(), output.length());
     }
-    if (!this->service_token.empty()) {
-        request.service_token = this->service_token;
-    }
-    std::string output = create_deregister_request(request);
-    req->append_output_body(output.c_str(), output.length());
     series_of(this)->push_front(this);
     return task;
 }
@@ -382,49 +465,68 @@ void PolarisTask::discover_cluster_http_callback(WFHttpTask *task) {
     t->cluster.get_mutex()->unlock();
 }
 
+// runs at the same time as route_http_callback(), so only touch its own fields
 void PolarisTask::instances_http_callback(WFHttpTask *task) {
     PolarisTask *t = (PolarisTask *)task->user_data;
-    t->cluster.get_mutex()->lock();
     if (task->get_state() == WFT_STATE_SUCCESS) {
         protocol::HttpResponse *resp = task->get_resp();
         std::string revision;
-        std::string body = protocol::HttpUtil::decode_chunked_body(resp);
-        int error = t->parse_instances_response(body, revision);
+        int error = t->parse_instances_response(resp, revision);
         if (error) {
-            t->state = POLARIS_STATE_ERROR;
-            t->error = error;
-            t->finish = true;
+            t->instances_state = POLARIS_STATE_ERROR;
+            t->instances_error = error;
         } else {
-            std::string servicekey = t->service_namespace + "." +
-                                     t->service_name;
-            (*t->cluster.get_revision_map())[servicekey] = revision;
-            auto *task = t->create_route_http_task();
-            series_of(t)->push_front(task);
+            t->instances_state = task->get_state();
         }
     } else {
-        t->state = task->get_state();
-        t->error = task->get_error();
-        t->finish = true;
+        t->instances_state = task->get_state();
+        t->instances_error = task->get_error();
     }
-    t->cluster.get_mutex()->unlock();
 }
 
 void PolarisTask::route_http_callback(WFHttpTask *task) {
     PolarisTask *t = (PolarisTask *)task->user_data;
     if (task->get_state() == WFT_STATE_SUCCESS) {
         protocol::HttpResponse *resp = task->get_resp();
-        std::string revision; //todo: unsued var revision
+        std::string revision;
         std::string body = protocol::HttpUtil::decode_chunked_body(resp);
         int error = t->parse_route_response(body, revision);
         if (error) {
-            t->state = POLARIS_STATE_ERROR;
-            t->error = error;
+            t->route_state = POLARIS_STATE_ERROR;
+            t->route_error = error;
         } else {
-            t->state = task->get_state();
+            t->route_state = task->get_state();
         }
     } else {
-        t->state = task->get_state();
-        t->error = task->get_error();
+        t->route_state = task->get_state();
+        t->route_error = task->get_error();
+    }
+}
+
+void PolarisTask::discover_parallel_callback(const ParallelWork *pwork) {
+    PolarisTask *t = (PolarisTask *)pwork->get_context();
+    if (t->instances_state != WFT_STATE_SUCCESS) {
+        t->state = t->instances_state;
+        t->error = t->instances_error;
+    } else if (t->route_state != WFT_STATE_SUCCESS) {
+        t->state = t->route_state;
+        t->error = t->route_error;
+    } else {
+        // keep the revisions only when the whole discover succeeds, or the
+        // next one may get 200001 for results that were never used
+        std::string servicekey = t->service_namespace + "." +
+                                 t->service_name;
+        t->cluster.get_mutex()->lock();
+        if (t->has_discover_res) {
+            (*t->cluster.get_revision_map())[servicekey] =
+                t->discover_res.service_revision;
+        }
+        if (t->has_route_res) {
+            (*t->cluster.get_routing_revision_map())[servicekey] =
+                t->route_res.routing_revision;
+        }
+        t->cluster.get_mutex()->unlock();
+        t->state = WFT_STATE_SUCCESS;
     }
     t->finish = true;
 }
@@ -527,12 +629,16 @@ bool PolarisTask::parse_cluster_response(const std::string &body) {
     } else {
         if (response.code != 200001) {
             std::vector<std::string> *cluster;
-            if (response.instances[0].service.compare("polaris.discover") == 0)
+            PolarisUpstream *upstream;
+            if (response.instances[0].service.compare("polaris.discover") == 0) {
                 cluster = this->cluster.get_discover_clusters();
-            else if (response.instances[0].service.compare("polaris.healthcheck") == 0)
+                upstream = this->cluster.get_discover_upstream();
+            } else if (response.instances[0].service.compare("polaris.healthcheck") == 0) {
                 cluster = this->cluster.get_healthcheck_clusters();
-            else
+                upstream = this->cluster.get_healthcheck_upstream();
+            } else {
                 return false;
+            }
 
             cluster->clear();
             auto iter = response.instances.begin();
@@ -542,23 +648,28 @@ bool PolarisTask::parse_cluster_response(const std::string &body) {
                     cluster->emplace_back(url);
                 }
             }
+            upstream->update_servers(*cluster);
         }
     }
 
     return true;
 }
 
-int PolarisTask::parse_instances_response(const std::string &body, std::string &revision) {
-    json j = json::parse(body, nullptr, false);
-    if (j.is_discarded()) {
+int PolarisTask::parse_instances_response(const protocol::HttpResponse *resp,
+                                          std::string &revision) {
+    if (!decode_discover_result(resp, &this->discover_res)) {
         return POLARIS_ERR_SERVER_PARSE;
     }
-    int code = j.at("code").get<int>();
-    if (code != 200000 && code != 200001) {
+    int code = this->discover_res.code;
+    if (code == 200001) {
+        this->instances_unchanged = true;
+        return 0;
+    }
+    if (code != 200000) {
         return code;
     }
-    revision = j.at("service").at("revision").get<std::string>();
-    this->discover_res = body;
+    revision = this->discover_res.service_revision;
+    this->has_discover_res = true;
     return 0;
 }
 
@@ -568,13 +679,20 @@ int PolarisTask::parse_route_response(const std::string &body, std::string &revi
         return POLARIS_ERR_SERVER_PARSE;
     }
     int code = j.at("code").get<int>();
-    if (code != 200000 && code != 200001) {
+    if (code == 200001) {
+        this->routing_unchanged = true;
+        return 0;
+    }
+    if (code != 200000) {
         return code;
     }
-    this->route_res = body;
-    if (j.find("routing") != j.end() && j.at("routing").find("revision") != j.at("routing").end()) {
-        revision = j.at("routing").at("revision").get<std::string>();
+    try {
+        from_json(j, this->route_res);
+    } catch (const json::exception &e) {
+        return POLARIS_ERR_SERVER_PARSE;
     }
+    revision = this->route_res.routing_revision;
+    this->has_route_res = true;
     return 0;
 }
 
@@ -622,23 +740,17 @@ int PolarisTask::parse_circuitbreaker_response(const std::string &body, std::str
     return 0;
 }
 
-bool PolarisTask::get_discover_result(struct discover_result *result) const {
-    if (this->discover_res.empty()) return false;
-    json j = json::parse(this->discover_res, nullptr, false);
-    if (j.is_discarded()) {
-        return false;
-    }
-    *result = j;
+bool PolarisTask::get_discover_result(struct discover_result *result) {
+    if (!this->has_discover_res) return false;
+    *result = std::move(this->discover_res);
+    this->has_discover_res = false;
     return true;
 }
 
-bool PolarisTask::get_route_result(struct route_result *result) const {
-    if (this->route_res.empty()) return false;
-    json j = json::parse(this->route_res, nullptr, false);
-    if (j.is_discarded()) {
-        return false;
-    }
-    *result = j;
+bool PolarisTask::get_route_result(struct route_result *result) {
+    if (!this->has_route_res) return false;
+    *result = std::move(this->route_res);
+    this->has_route_res = false;
     return true;
 }
 
@@ -662,17 +774,16 @@ bool PolarisTask::get_circuitbreaker_result(struct circuitbreaker_result *result
     return true;
 }
 
+// the failing servers are fused by the upstreams, refresh when none is left
 void PolarisTask::check_failed() {
     if (this->state != WFT_STATE_SUCCESS) {
         this->cluster.get_mutex()->lock();
         if (this->apitype == API_HEARTBEAT) {
-            if (this->cluster.healthcheck_failed() >= CLUSTER_FAILED_MAX) {
-                this->cluster.clear_healthcheck_failed();
+            if (this->cluster.get_healthcheck_upstream()->is_unavailable()) {
                 *this->cluster.get_status() &= ~CLUSTER_STATE_HEALTHCHECK;
             }
         } else {
-            if (this->cluster.discover_failed() >= CLUSTER_FAILED_MAX) {
-                this->cluster.clear_discover_failed();
+            if (this->cluster.get_discover_upstream()->is_unavailable()) {
                 *this->cluster.get_status() &= ~CLUSTER_STATE_DISCOVER;
             }
         }
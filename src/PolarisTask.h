@@ -2,12 +2,15 @@
 #define _POLARISTASK_H_
 
 #include "workflow/WFTaskFactory.h"
+#include "workflow/Workflow.h"
 #include "workflow/HttpMessage.h"
 #include "workflow/HttpUtil.h"
 #include "PolarisConfig.h"
 #include "PolarisCluster.h"
+#include "PolarisRandom.h"
 #include <stdlib.h>
 #include <functional>
+#include <memory>
 
 namespace polaris {
 
@@ -36,6 +39,18 @@ enum DiscoverRequestType {
     CIRCUITBREAKER,
 };
 
+/*
+ * The body of a discover request is the same for every refresh of a service
+ * but the revision, so it is serialized once and the revision is put between
+ * prefix and suffix.
+ */
+struct discover_body {
+    std::string instances_prefix;
+    std::string instances_suffix;
+    std::string route_prefix;
+    std::string route_suffix;
+};
+
 class PolarisTask;
 
 using polaris_callback_t = std::function<void(PolarisTask *)>;
@@ -46,13 +61,22 @@ class PolarisTask : public WFGenericTask {
         : service_namespace(snamespace),
           service_name(sname),
           retry_max(retry_max),
-          callback(std::move(cb)) {
+          callback(std::move(cb)),
+          cluster(*cluster) {
         this->finish = false;
+        this->has_discover_res = false;
+        this->instances_unchanged = false;
+        this->routing_unchanged = false;
+        this->has_route_res = false;
+        this->long_poll_timeout = 0;
+        this->instances_state = WFT_STATE_UNDEFINED;
+        this->instances_error = 0;
+        this->route_state = WFT_STATE_UNDEFINED;
+        this->route_error = 0;
         this->apitype = API_UNKNOWN;
         this->protocol = P_UNKNOWN;
-        int pos = rand() % cluster->get_server_connectors()->size();
+        int pos = Random::uniform(cluster->get_server_connectors()->size());
         this->url = cluster->get_server_connectors()->at(pos);
-        this->cluster = *cluster;
     }
 
     void set_apitype(ApiType apitype) { this->apitype = apitype; }
@@ -65,12 +89,34 @@ class PolarisTask : public WFGenericTask {
     void set_platform_id(const std::string &id) { this->platform_id = id; }
     void set_platform_token(const std::string &token) { this->platform_token = token; }
 
+    // ask the server to hold the instances request until the revision changes
+    void set_long_poll_timeout(int timeout) { this->long_poll_timeout = timeout; }
+
     void set_polaris_instance(const PolarisInstance &instance) {
         this->polaris_instance = instance;
     }
 
-    bool get_discover_result(struct discover_result *result) const;
-    bool get_route_result(struct route_result *result) const;
+    // serialized by the following functions once, and shared by the tasks
+    // of the same service or instance, instead of building them every time
+    void set_discover_body(std::shared_ptr<const struct discover_body> body) {
+        this->discover_body = std::move(body);
+    }
+    void set_heartbeat_body(std::shared_ptr<const std::string> body) {
+        this->heartbeat_body = std::move(body);
+    }
+
+    static std::shared_ptr<const struct discover_body>
+    create_discover_body(const std::string &snamespace, const std::string &sname);
+    static std::shared_ptr<const std::string>
+    create_heartbeat_body(const std::string &snamespace, const std::string &sname,
+                          const std::string &token, const PolarisInstance &instance);
+
+    // the results are parsed in the task and moved out, so get them only once
+    bool get_discover_result(struct discover_result *result);
+    bool get_route_result(struct route_result *result);
+    // code 200001, the instances are the same as the revision sent
+    bool is_instances_unchanged() const { return this->instances_unchanged; }
+    bool is_routing_unchanged() const { return this->routing_unchanged; }
     bool get_ratelimit_result(struct ratelimit_result *result) const;
     bool get_circuitbreaker_result(struct circuitbreaker_result *result) const;
 
@@ -80,6 +126,7 @@ class PolarisTask : public WFGenericTask {
     WFHttpTask *create_healthcheck_cluster_http_task();
     WFHttpTask *create_instances_http_task();
     WFHttpTask *create_route_http_task();
+    ParallelWork *create_discover_parallel_work();
     WFHttpTask *create_register_http_task();
     WFHttpTask *create_deregister_http_task();
     WFHttpTask *create_ratelimit_http_task();
@@ -90,6 +137,7 @@ class PolarisTask : public WFGenericTask {
     static void healthcheck_cluster_http_callback(WFHttpTask *task);
     static void instances_http_callback(WFHttpTask *task);
     static void route_http_callback(WFHttpTask *task);
+    static void discover_parallel_callback(const ParallelWork *pwork);
     static void register_http_callback(WFHttpTask *task);
     static void ratelimit_http_callback(WFHttpTask *task);
     static void circuitbreaker_http_callback(WFHttpTask *task);
@@ -102,7 +150,7 @@ class PolarisTask : public WFGenericTask {
     std::string create_circuitbreaker_request(const struct circuitbreaker_request &request);
 
     bool parse_cluster_response(const std::string &body);
-    int parse_instances_response(const std::string &body, std::string &revision);
+    int parse_instances_response(const protocol::HttpResponse *resp, std::string &revision);
     int parse_route_response(const std::string &body, std::string &revision);
     int parse_register_response(const std::string &body);
     int parse_ratelimit_response(const std::string &body, std::string &revision);
@@ -111,7 +159,7 @@ class PolarisTask : public WFGenericTask {
     virtual void dispatch();
     virtual SubTask *done();
 
-    void check_failed(); // pull cluster instances again if failed many times
+    void check_failed(); // pull cluster instances again if all servers are fused
 
   private:
     std::string service_namespace;
@@ -125,11 +173,23 @@ class PolarisTask : public WFGenericTask {
     bool finish;
     ApiType apitype;
     PolarisProtocol protocol;
-    std::string discover_res;
-    std::string route_res;
+    bool has_discover_res;
+    bool has_route_res;
+    bool instances_unchanged;
+    bool routing_unchanged;
+    int long_poll_timeout;
+    // the results of the instances and routing requests of a discover
+    int instances_state;
+    int instances_error;
+    int route_state;
+    int route_error;
+    struct discover_result discover_res;
+    struct route_result route_res;
     std::string ratelimit_res;
     std::string circuitbreaker_res;
     PolarisInstance polaris_instance;
+    std::shared_ptr<const struct discover_body> discover_body;
+    std::shared_ptr<const std::string> heartbeat_body;
     PolarisConfig config;
     PolarisCluster cluster;
 };
@@ -0,0 +1,89 @@
+#ifndef _POLARISTIMINGWHEEL_H_
+#define _POLARISTIMINGWHEEL_H_
+
+#include <stddef.h>
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+namespace polaris {
+
+/*
+ * A hashed timing wheel. An entry goes to the slot of its expire tick, so
+ * adding one is O(1) however far away it is, and a turn only looks at the
+ * slots passed since the last one. Entries more than a lap away stay in
+ * their slot until their round comes.
+ *
+ * ENTRY has a long long expire, set by add(). The wheel has no clock of its
+ * own, the caller passes the current tick, so tests can turn it by hand.
+ */
+template<class ENTRY>
+class TimingWheel {
+  public:
+    TimingWheel(size_t slots) : slots(slots), current(0), count(0) { }
+
+    // expires ticks after now, at least one. returns the expire tick
+    long long add(ENTRY entry, long long ticks, long long now) {
+        long long expire = now + std::max(ticks, 1LL);
+
+        if (this->count == 0)
+            this->current = now;
+
+        entry.expire = expire;
+        this->slots[expire % this->slots.size()].push_back(std::move(entry));
+        this->count++;
+        return expire;
+    }
+
+    // take out the entries expired by now, even if more than a lap late
+    void advance(long long now, std::vector<ENTRY> &due) {
+        long long end = std::min(now, this->current + (long long)this->slots.size());
+        size_t i;
+
+        while (this->current < end) {
+            this->current++;
+            std::vector<ENTRY> &slot = this->slots[this->current % this->slots.size()];
+
+            i = 0;
+            while (i < slot.size()) {
+                if (slot[i].expire <= now) {
+                    due.push_back(std::move(slot[i]));
+                    slot[i] = std::move(slot.back());
+                    slot.pop_back();
+                    this->count--;
+                } else {
+                    i++;
+                }
+            }
+        }
+
+        this->current = std::max(this->current, now);
+    }
+
+    // the earliest expire tick, or a lap after the last turn if every entry
+    // is further away. the wheel must not be empty
+    long long next_expire() const {
+        long long lap = this->slots.size();
+
+        for (long long tick = this->current + 1; tick <= this->current + lap; tick++) {
+            for (const ENTRY &entry : this->slots[tick % lap]) {
+                if (entry.expire == tick)
+                    return tick;
+            }
+        }
+
+        return this->current + lap;
+    }
+
+    bool empty() const { return this->count == 0; }
+    size_t size() const { return this->count; }
+
+  private:
+    std::vector<std::vector<ENTRY>> slots;
+    long long current;
+    size_t count;
+};
+
+};  // namespace polaris
+
+#endif
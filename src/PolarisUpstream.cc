@@ -0,0 +1,283 @@
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <set>
+#include "workflow/WFGlobal.h"
+#include "PolarisUpstream.h"
+
+#define UPSTREAM_MAX_FAILS			3
+// a long poll holds one connection until it returns
+#define UPSTREAM_MAX_CONNECTIONS	1024
+
+namespace polaris {
+
+static inline long long monotonic_us()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+PolarisServerParams::PolarisServerParams(const struct AddressParams *params) :
+	PolicyAddrParams(params),
+	latency(0),
+	inflight(0)
+{
+}
+
+// moves 1/4 toward each sample, so a server recovers in a few requests
+void PolarisServerParams::update_latency(long long sample)
+{
+	long long old = this->latency.load(std::memory_order_relaxed);
+
+	if (sample <= 0)
+		sample = 1;
+
+	if (old > 0)
+		sample = old + (sample - old) / 4;
+
+	this->latency.store(sample, std::memory_order_relaxed);
+}
+
+void PolarisServerParams::dec_inflight()
+{
+	int n = this->inflight.load(std::memory_order_relaxed);
+
+	while (n > 0 && !this->inflight.compare_exchange_weak(n, n - 1,
+												std::memory_order_relaxed))
+	{
+	}
+}
+
+PolarisUpstream::PolarisUpstream(const std::string& name) :
+	name(name),
+	long_poll_name(name + ".poll"),
+	next_breaker_check(0)
+{
+}
+
+PolarisUpstream *PolarisUpstream::create(const std::string& prefix)
+{
+	static std::atomic<int> next_id(0);
+	WFNameService *ns = WFGlobal::get_name_service();
+	std::string name = prefix + "." + std::to_string(++next_id);
+	PolarisUpstream *upstream = new PolarisUpstream(name);
+
+	ns->add_policy(upstream->name.c_str(), upstream);
+	ns->add_policy(upstream->long_poll_name.c_str(), upstream);
+	return upstream;
+}
+
+void PolarisUpstream::destroy(PolarisUpstream *upstream)
+{
+	WFNameService *ns = WFGlobal::get_name_service();
+
+	ns->del_policy(upstream->long_poll_name.c_str());
+	ns->del_policy(upstream->name.c_str());
+	delete upstream;
+}
+
+/*
+ * Called with the lock of the cluster held, so there is only one update
+ * at a time. The servers still in the list keep their latency and breaker
+ * state.
+ */
+void PolarisUpstream::update_servers(const std::vector<std::string>& urls)
+{
+	struct AddressParams params = ADDRESS_PARAMS_DEFAULT;
+	std::vector<std::string> removed;
+	std::set<std::string> addresses;
+	std::string::size_type pos;
+
+	params.max_fails = UPSTREAM_MAX_FAILS;
+	params.endpoint_params.max_connections = UPSTREAM_MAX_CONNECTIONS;
+
+	for (const std::string& url : urls)
+	{
+		pos = url.find("://");
+		addresses.insert(pos == std::string::npos ? url : url.substr(pos + 3));
+	}
+
+	pthread_rwlock_rdlock(&this->rwlock);
+	for (const auto& kv : this->server_map)
+	{
+		if (addresses.erase(kv.first) == 0)
+			removed.push_back(kv.first);
+	}
+	pthread_rwlock_unlock(&this->rwlock);
+
+	for (const std::string& address : removed)
+		this->remove_server(address);
+
+	for (const std::string& address : addresses)
+		this->add_server(address, &params);
+}
+
+void PolarisUpstream::add_server(const std::string& address,
+								 const struct AddressParams *params)
+{
+	EndpointAddress *addr = new EndpointAddress(address,
+												new PolarisServerParams(params));
+
+	pthread_rwlock_wrlock(&this->rwlock);
+	this->add_server_locked(addr);
+	pthread_rwlock_unlock(&this->rwlock);
+}
+
+/*
+ * Select the server of the least latency weighted by its requests in
+ * flight, the ones without any response yet go first. Fused servers are
+ * skipped, and so are the ones tried by this request already, unless
+ * nothing else is left.
+ */
+bool PolarisUpstream::select(const ParsedURI& uri, WFNSTracing *tracing,
+							 EndpointAddress **addr)
+{
+	struct UpstreamTracingData *data = this->get_tracing_data(tracing);
+	PolarisServerParams *params;
+	EndpointAddress *one = NULL;
+	bool one_tried = false;
+	long long one_score = 0;
+	long long score;
+	bool tried;
+
+	this->check_breaker_periodically();
+
+	pthread_rwlock_rdlock(&this->rwlock);
+	for (EndpointAddress *server : this->servers)
+	{
+		if (server->fail_count >= server->params->max_fails)
+			continue;
+
+		params = static_cast<PolarisServerParams *>(server->params);
+		score = (params->get_latency() + 1) * (params->get_inflight() + 1);
+		tried = data && std::find(data->history.begin(), data->history.end(),
+								  server) != data->history.end();
+
+		if (!one || (one_tried && !tried) ||
+			(one_tried == tried && score < one_score))
+		{
+			one = server;
+			one_score = score;
+			one_tried = tried;
+		}
+	}
+
+	if (one)
+		++one->ref;
+	pthread_rwlock_unlock(&this->rwlock);
+
+	if (!one)
+		return false;
+
+	static_cast<PolarisServerParams *>(one->params)->inc_inflight();
+	if (data)
+	{
+		data->start = monotonic_us();
+		data->timed = !uri.host || this->long_poll_name != uri.host;
+	}
+
+	*addr = one;
+	return true;
+}
+
+void PolarisUpstream::success(RouteManager::RouteResult *result,
+							  WFNSTracing *tracing,
+							  CommTarget *target)
+{
+	this->finish_one_server(tracing, true);
+	this->WFServiceGovernance::success(result, tracing, target);
+}
+
+void PolarisUpstream::failed(RouteManager::RouteResult *result,
+							 WFNSTracing *tracing,
+							 CommTarget *target)
+{
+	this->finish_one_server(tracing, false);
+	this->WFServiceGovernance::failed(result, tracing, target);
+}
+
+/*
+ * The history of servers is appended by workflow after select(), as it
+ * does to its own TracingData, so it is created here to keep the start
+ * time with it.
+ */
+struct PolarisUpstream::UpstreamTracingData *
+PolarisUpstream::get_tracing_data(WFNSTracing *tracing)
+{
+	struct UpstreamTracingData *data;
+
+	if (!tracing)
+		return NULL;
+
+	if (!tracing->data)
+	{
+		data = new struct UpstreamTracingData;
+		data->sg = this;
+		data->start = 0;
+		data->timed = false;
+		tracing->data = data;
+		tracing->deleter = PolarisUpstream::tracing_deleter;
+		return data;
+	}
+
+	if (tracing->deleter == PolarisUpstream::tracing_deleter)
+		return (struct UpstreamTracingData *)tracing->data;
+
+	return NULL;
+}
+
+// release the servers referenced by select(), the same as workflow does
+void PolarisUpstream::tracing_deleter(void *data)
+{
+	struct UpstreamTracingData *tracing_data = (struct UpstreamTracingData *)data;
+	PolarisUpstream *upstream = static_cast<PolarisUpstream *>(tracing_data->sg);
+
+	for (EndpointAddress *addr : tracing_data->history)
+	{
+		if (--addr->ref == 0)
+		{
+			upstream->pre_delete_server(addr);
+			delete addr;
+		}
+	}
+
+	delete tracing_data;
+}
+
+void PolarisUpstream::finish_one_server(WFNSTracing *tracing, bool success)
+{
+	struct UpstreamTracingData *data;
+	PolarisServerParams *params;
+
+	if (!tracing || !tracing->data ||
+		tracing->deleter != PolarisUpstream::tracing_deleter)
+	{
+		return;
+	}
+
+	data = (struct UpstreamTracingData *)tracing->data;
+	if (data->history.empty())
+		return;
+
+	params = static_cast<PolarisServerParams *>(data->history.back()->params);
+	params->dec_inflight();
+	if (success && data->timed)
+		params->update_latency(monotonic_us() - data->start);
+}
+
+// the same as PolarisPolicy, fused servers wait in the breaker for long
+void PolarisUpstream::check_breaker_periodically()
+{
+	long long now = monotonic_us() / 1000;
+	long long next = this->next_breaker_check.load(std::memory_order_relaxed);
+
+	if (now >= next &&
+		this->next_breaker_check.compare_exchange_strong(next, now + 1000))
+	{
+		this->check_breaker();
+	}
+}
+
+};  // namespace polaris
@@ -0,0 +1,94 @@
+#ifndef _POLARISUPSTREAM_H_
+#define _POLARISUPSTREAM_H_
+
+#include <atomic>
+#include <string>
+#include <vector>
+#include "workflow/URIParser.h"
+#include "workflow/EndpointParams.h"
+#include "workflow/WFNameService.h"
+#include "workflow/WFServiceGovernance.h"
+
+namespace polaris {
+
+class PolarisServerParams : public PolicyAddrParams
+{
+public:
+	// smoothed response time in microseconds, 0 before the first response
+	long long get_latency() const { return this->latency.load(std::memory_order_relaxed); }
+	void update_latency(long long sample);
+
+	int get_inflight() const { return this->inflight.load(std::memory_order_relaxed); }
+	void inc_inflight() { this->inflight.fetch_add(1, std::memory_order_relaxed); }
+	void dec_inflight();
+
+public:
+	PolarisServerParams(const struct AddressParams *params);
+
+private:
+	std::atomic<long long> latency;
+	std::atomic<int> inflight;
+};
+
+/*
+ * The polaris servers of the discover or healthcheck cluster, registered to
+ * the global name service so that the requests to them go through workflow`s
+ * upstream: keep-alive connections are pooled per server, the one with the
+ * least latency is selected, and a server failing max_fails times in a row
+ * is fused until workflow`s breaker tries it again.
+ *
+ * Long polls are held by the server as long as nothing changes, so they are
+ * sent to get_long_poll_name() and not counted into the latency.
+ */
+class PolarisUpstream : public WFServiceGovernance
+{
+public:
+	// registered with a unique name made of prefix
+	static PolarisUpstream *create(const std::string& prefix);
+	static void destroy(PolarisUpstream *upstream);
+
+	const std::string& get_name() const { return this->name; }
+	const std::string& get_long_poll_name() const { return this->long_poll_name; }
+
+	// urls are "http://host:port", the servers of the same address are kept
+	void update_servers(const std::vector<std::string>& urls);
+
+	// every server is fused, the cluster may have moved
+	bool is_unavailable() const { return this->nalives <= 0; }
+
+	virtual bool select(const ParsedURI& uri, WFNSTracing *tracing,
+						EndpointAddress **addr);
+	virtual void success(RouteManager::RouteResult *result,
+						 WFNSTracing *tracing,
+						 CommTarget *target);
+	virtual void failed(RouteManager::RouteResult *result,
+						WFNSTracing *tracing,
+						CommTarget *target);
+	virtual void add_server(const std::string& address,
+							const struct AddressParams *params);
+
+protected:
+	PolarisUpstream(const std::string& name);
+
+	struct UpstreamTracingData : public TracingData
+	{
+		long long start;
+		bool timed;
+	};
+
+	static void tracing_deleter(void *data);
+
+private:
+	struct UpstreamTracingData *get_tracing_data(WFNSTracing *tracing);
+	void finish_one_server(WFNSTracing *tracing, bool success);
+	void check_breaker_periodically();
+
+private:
+	std::string name;
+	std::string long_poll_name;
+	std::atomic<long long> next_breaker_check;
+};
+
+};  // namespace polaris
+
+#endif
@@ -0,0 +1,179 @@
+#include <string.h>
+#include <string>
+#include <gtest/gtest.h>
+
+#include "PolarisConfig.h"
+#include "PolarisDecoder.h"
+#include "json.hpp"
+
+using namespace polaris;
+using nlohmann::json;
+
+namespace polaris {
+void from_json(const json &j, struct discover_result &response);
+};
+
+static const std::string discover_body = R"({
+	"code": 200000,
+	"info": "execute success",
+	"type": "INSTANCE",
+	"service": {
+		"name": "b",
+		"namespace": "b_namespace",
+		"revision": "rev_1",
+		"metadata": {"owner": "polaris"},
+		"ports": "8000,8001",
+		"comment": "",
+		"platform_id": null
+	},
+	"instances": [
+		{
+			"id": "instance_0",
+			"service": "b",
+			"namespace": "b_namespace",
+			"host": "10.0.0.1",
+			"port": 8000,
+			"protocol": "http",
+			"weight": 10,
+			"priority": 1,
+			"healthy": false,
+			"isolate": true,
+			"enableHealthCheck": true,
+			"healthCheck": {"type": "HEARTBEAT", "heartbeat": {"ttl": 3}},
+			"location": {"region": "r", "zone": "z", "campus": "c"},
+			"metadata": {"k1": "v1", "k2": "v2"},
+			"logic_set": "set_1",
+			"mtime": "2021-01-01 00:00:00",
+			"revision": "inst_rev_0"
+		},
+		{
+			"id": "instance_1",
+			"service": "b",
+			"namespace": "b_namespace",
+			"host": "10.0.0.2",
+			"vpc_id": "vpc",
+			"version": "1.0",
+			"weight": null,
+			"healthCheck": {"heartbeat": {}},
+			"tags": [1, [2, 3], {"a": "b"}],
+			"mtime": "2021-01-01 00:00:01",
+			"revision": "inst_rev_1"
+		}
+	]
+})";
+
+static void check_same_instance(const struct instance& a, const struct instance& b)
+{
+	EXPECT_EQ(a.id, b.id);
+	EXPECT_EQ(a.service, b.service);
+	EXPECT_EQ(a.service_namespace, b.service_namespace);
+	EXPECT_EQ(a.vpc_id, b.vpc_id);
+	EXPECT_EQ(a.host, b.host);
+	EXPECT_EQ(a.port, b.port);
+	EXPECT_EQ(a.protocol, b.protocol);
+	EXPECT_EQ(a.version, b.version);
+	EXPECT_EQ(a.priority, b.priority);
+	EXPECT_EQ(a.weight, b.weight);
+	EXPECT_EQ(a.enable_healthcheck, b.enable_healthcheck);
+	EXPECT_EQ(a.healthcheck_type, b.healthcheck_type);
+	EXPECT_EQ(a.healthcheck_ttl, b.healthcheck_ttl);
+	EXPECT_EQ(a.healthy, b.healthy);
+	EXPECT_EQ(a.isolate, b.isolate);
+	EXPECT_EQ(a.logic_set, b.logic_set);
+	EXPECT_EQ(a.mtime, b.mtime);
+	EXPECT_EQ(a.revision, b.revision);
+	EXPECT_EQ(a.metadata, b.metadata);
+}
+
+TEST(polaris_decoder_unittest, same_as_from_json)
+{
+	struct discover_result expected;
+	struct discover_result result;
+	json j = json::parse(discover_body);
+
+	from_json(j, expected);
+
+	EXPECT_TRUE(decode_discover_result(discover_body.c_str(),
+									   discover_body.size(), &result));
+	EXPECT_EQ(result.code, expected.code);
+	EXPECT_EQ(result.info, expected.info);
+	EXPECT_EQ(result.type, expected.type);
+	EXPECT_EQ(result.service_name, expected.service_name);
+	EXPECT_EQ(result.service_namespace, expected.service_namespace);
+	EXPECT_EQ(result.service_revision, expected.service_revision);
+	EXPECT_EQ(result.service_ports, expected.service_ports);
+	EXPECT_EQ(result.service_comment, expected.service_comment);
+	EXPECT_EQ(result.service_platform_id, expected.service_platform_id);
+	EXPECT_EQ(result.service_metadata, expected.service_metadata);
+
+	ASSERT_EQ(result.instances.size(), expected.instances.size());
+	for (size_t i = 0; i < result.instances.size(); i++)
+		check_same_instance(result.instances[i], expected.instances[i]);
+
+	EXPECT_EQ(result.instances[0].healthcheck_ttl, 3);
+	EXPECT_EQ(result.instances[1].healthcheck_ttl, 5);
+	EXPECT_EQ(result.instances[1].weight, 100);
+}
+
+TEST(polaris_decoder_unittest, revision_unchanged)
+{
+	struct discover_result result;
+	std::string body = discover_body;
+
+	body.replace(body.find("200000"), 6, "200001");
+	EXPECT_TRUE(decode_discover_result(body.c_str(), body.size(), &result));
+	EXPECT_EQ(result.code, 200001);
+	EXPECT_TRUE(result.service_revision.empty());
+	EXPECT_TRUE(result.instances.empty());
+
+	// nothing after the code is read, even if it is broken
+	body = R"({"code": 200001, "info": "not changed", "service": {"name": )";
+	EXPECT_TRUE(decode_discover_result(body.c_str(), body.size(), &result));
+	EXPECT_EQ(result.code, 200001);
+
+	// or if the code comes last
+	body = discover_body;
+	body.replace(body.find("\"code\": 200000,"), 16, "");
+	body.replace(body.rfind('}'), 1, ", \"code\": 200001}");
+	EXPECT_TRUE(decode_discover_result(body.c_str(), body.size(), &result));
+	EXPECT_EQ(result.code, 200001);
+	EXPECT_TRUE(result.instances.empty());
+}
+
+TEST(polaris_decoder_unittest, error_code)
+{
+	struct discover_result result;
+	std::string body = R"({"code": 400202, "info": "not found", "service": null})";
+
+	EXPECT_TRUE(decode_discover_result(body.c_str(), body.size(), &result));
+	EXPECT_EQ(result.code, 400202);
+}
+
+TEST(polaris_decoder_unittest, invalid_response)
+{
+	struct discover_result result;
+	std::string body;
+
+	body = discover_body.substr(0, discover_body.size() / 2);
+	EXPECT_FALSE(decode_discover_result(body.c_str(), body.size(), &result));
+
+	body = discover_body;
+	body.replace(body.find("\"host\""), 6, "\"addr\"");
+	EXPECT_FALSE(decode_discover_result(body.c_str(), body.size(), &result));
+
+	body = discover_body;
+	body.replace(body.find("\"port\": 8000"), 12, "\"port\": \"8000\"");
+	EXPECT_FALSE(decode_discover_result(body.c_str(), body.size(), &result));
+
+	body = R"({"info": "no code"})";
+	EXPECT_FALSE(decode_discover_result(body.c_str(), body.size(), &result));
+}
+
+int main(int argc, char* argv[])
+{
+	::testing::InitGoogleTest(&argc, argv);
+
+	EXPECT_EQ(RUN_ALL_TESTS(), 0);
+
+	return 0;
+}
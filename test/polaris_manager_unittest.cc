@@ -0,0 +1,1099 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <utime.h>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <gtest/gtest.h>
+
+#include "PolarisCache.h"
+#include "PolarisManager.h"
+#include "PolarisTimingWheel.h"
+#include "json.hpp"
+
+#include "workflow/HttpUtil.h"
+#include "workflow/WFFacilities.h"
+#include "workflow/WFHttpServer.h"
+#include "workflow/WFTaskFactory.h"
+
+using namespace polaris;
+using nlohmann::json;
+
+#define MOCK_PORT		8866
+#define MOCK_URL		"http://127.0.0.1:8866"
+#define MOCK_TIMER		"mock_discover"
+#define YAML_FILE		"./polaris_manager_unittest.yaml"
+#define PERSIST_DIR		"./polaris_manager_unittest_cache"
+#define CACHE_EXPIRE	60000
+// services watched and instances registered by the stress tests
+#define STRESS_ENTRIES	500
+// of them watched or registered at the same time
+#define STRESS_BATCH	100
+// how long the stress tests wait for all the refreshes or heartbeats
+#define STRESS_DEADLINE	30
+
+/*
+ * A mock of the /v1/Discover API of polaris server. If long_poll is set,
+ * an instances request with the current revision is held until the test
+ * changes the instances, or its Polaris-Long-Poll-Timeout expires. If
+ * churn is set, the revision changes on every instances request. If
+ * delay_ms is set, every instances request is answered that late. If
+ * routing_fail is set, the routing requests get an error code.
+ * Registers and heartbeats always succeed.
+ */
+static struct
+{
+	std::mutex mutex;
+	bool long_poll;
+	bool churn;
+	unsigned int delay_ms;
+	bool routing_fail;
+	std::string revision;
+	int port;
+	// the revision of each instances request, by service name
+	std::map<std::string, std::vector<std::string>> requests;
+	// the same of the routing requests
+	std::map<std::string, std::vector<std::string>> routing_requests;
+	// when each instances request arrived, by service name
+	std::map<std::string, std::vector<std::chrono::steady_clock::time_point>> request_times;
+	// instances requests not answered yet, and the most of them at a time
+	int in_flight;
+	int max_in_flight;
+	std::map<std::string, int> service_in_flight;
+	int max_service_in_flight;
+	std::vector<std::chrono::steady_clock::time_point> heartbeats;
+} mock;
+
+static void mock_reply(WFHttpServerTask *task, const std::string& service_namespace,
+					   const std::string& service_name, int type,
+					   const std::string& revision)
+{
+	json j;
+
+	j["info"] = "execute success";
+	j["service"] = { { "name", service_name }, { "namespace", service_namespace } };
+
+	if (type == ROUTING)
+	{
+		std::lock_guard<std::mutex> lock(mock.mutex);
+
+		j["code"] = mock.routing_fail ? 500000 : 200000;
+		j["type"] = "ROUTING";
+		j["routing"] = {
+			{ "revision", "routing_rev_1" },
+			{ "inbounds", json::array() },
+			{ "outbounds", json::array() },
+		};
+	}
+	else
+	{
+		std::lock_guard<std::mutex> lock(mock.mutex);
+
+		mock.in_flight--;
+		mock.service_in_flight[service_name]--;
+		j["type"] = "INSTANCE";
+		j["service"]["revision"] = mock.revision;
+		if (revision == mock.revision)
+			j["code"] = 200001;
+		else
+		{
+			j["code"] = 200000;
+			j["instances"] = json::array({ {
+				{ "id", "instance_" + std::to_string(mock.port) },
+				{ "service", service_name },
+				{ "namespace", service_namespace },
+				{ "host", "127.0.0.1" },
+				{ "port", mock.port },
+				{ "mtime", "2021-01-01 00:00:00" },
+				{ "revision", mock.revision },
+			} });
+		}
+	}
+
+	task->get_resp()->append_output_body(j.dump());
+}
+
+static void mock_process(WFHttpServerTask *task)
+{
+	protocol::HttpRequest *req = task->get_req();
+	protocol::HttpHeaderCursor cursor(req);
+	std::string body = protocol::HttpUtil::decode_chunked_body(req);
+	json j = json::parse(body, nullptr, false);
+	std::string timeout;
+	std::string uri;
+
+	req->get_request_uri(uri);
+	if (uri != "/v1/Discover")
+	{
+		if (uri == "/v1/Heartbeat")
+		{
+			std::lock_guard<std::mutex> lock(mock.mutex);
+			mock.heartbeats.push_back(std::chrono::steady_clock::now());
+		}
+
+		json ok = { { "code", 200000 }, { "info", "execute success" } };
+
+		task->get_resp()->append_output_body(ok.dump());
+		return;
+	}
+
+	if (j.is_discarded())
+	{
+		task->get_resp()->set_status_code("400");
+		return;
+	}
+
+	int type = j["type"].get<int>();
+	std::string service_namespace = j["service"]["namespace"].get<std::string>();
+	std::string service_name = j["service"]["name"].get<std::string>();
+	std::string revision = j["service"]["revision"].get<std::string>();
+	unsigned int ms = 0;
+	bool hold = false;
+
+	if (type == INSTANCE)
+	{
+		std::lock_guard<std::mutex> lock(mock.mutex);
+
+		mock.requests[service_name].push_back(revision);
+		mock.request_times[service_name].push_back(std::chrono::steady_clock::now());
+		mock.max_in_flight = std::max(mock.max_in_flight, ++mock.in_flight);
+		mock.max_service_in_flight = std::max(mock.max_service_in_flight,
+											  ++mock.service_in_flight[service_name]);
+		if (mock.churn)
+			mock.revision = "churn_" + std::to_string(mock.requests[service_name].size());
+		hold = mock.long_poll && revision == mock.revision &&
+			   cursor.find("Polaris-Long-Poll-Timeout", timeout);
+		if (hold)
+			ms = atoi(timeout.c_str());
+		else if (mock.delay_ms > 0)
+		{
+			ms = mock.delay_ms;
+			hold = true;
+		}
+	}
+	else if (type == ROUTING)
+	{
+		std::lock_guard<std::mutex> lock(mock.mutex);
+
+		mock.routing_requests[service_name].push_back(revision);
+	}
+
+	if (hold)
+	{
+		WFTimerTask *timer;
+
+		// WFTaskFactory::cancel_by_name() wakes it up at once
+		timer = WFTaskFactory::create_timer_task(MOCK_TIMER, ms / 1000,
+												 ms % 1000 * 1000000,
+			[=](WFTimerTask *) {
+				mock_reply(task, service_namespace, service_name, type, revision);
+			});
+		series_of(task)->push_back(timer);
+	}
+	else
+		mock_reply(task, service_namespace, service_name, type, revision);
+}
+
+// the options of discoverCluster, indented by 6 spaces
+static void write_yaml(const char *discover_cluster)
+{
+	FILE *fp = fopen(YAML_FILE, "w");
+
+	ASSERT_TRUE(fp != NULL);
+	fprintf(fp, "global:\n"
+				"  system:\n"
+				"    discoverCluster:\n"
+				"%s", discover_cluster);
+	fclose(fp);
+}
+
+static size_t count_requests(const std::string& service_name,
+							 const std::string& revision,
+							 bool routing = false)
+{
+	std::lock_guard<std::mutex> lock(mock.mutex);
+	auto& requests = routing ? mock.routing_requests : mock.requests;
+	size_t n = 0;
+
+	for (const std::string& r : requests[service_name])
+	{
+		if (revision.empty() || r == revision)
+			n++;
+	}
+
+	return n;
+}
+
+static std::vector<std::string> get_requests(const std::string& service_name)
+{
+	std::lock_guard<std::mutex> lock(mock.mutex);
+
+	return mock.requests[service_name];
+}
+
+// polls pred until it is true, or false after seconds
+static bool wait_until(std::function<bool ()> pred, int seconds)
+{
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(seconds);
+
+	while (!pred())
+	{
+		if (std::chrono::steady_clock::now() > deadline)
+			return false;
+
+		usleep(10000);
+	}
+
+	return true;
+}
+
+struct test_entry
+{
+	int id;
+	long long expire;
+};
+
+static std::vector<int> advance_ids(TimingWheel<struct test_entry>& wheel, long long now)
+{
+	std::vector<struct test_entry> due;
+	std::vector<int> ids;
+
+	wheel.advance(now, due);
+	for (const struct test_entry& entry : due)
+		ids.push_back(entry.id);
+
+	std::sort(ids.begin(), ids.end());
+	return ids;
+}
+
+TEST(polaris_manager_unittest, timing_wheel_order)
+{
+	TimingWheel<struct test_entry> wheel(8);
+
+	// 3 and 19 share a slot, 19 is two laps later
+	EXPECT_EQ(wheel.add({ 1, 0 }, 3, 100), 103);
+	EXPECT_EQ(wheel.add({ 2, 0 }, 5, 100), 105);
+	EXPECT_EQ(wheel.add({ 3, 0 }, 19, 100), 119);
+	// due at the next tick at the earliest
+	EXPECT_EQ(wheel.add({ 4, 0 }, 0, 100), 101);
+	EXPECT_EQ(wheel.size(), 4u);
+	EXPECT_EQ(wheel.next_expire(), 101);
+
+	EXPECT_EQ(advance_ids(wheel, 101), std::vector<int>({ 4 }));
+	EXPECT_EQ(wheel.next_expire(), 103);
+	EXPECT_TRUE(advance_ids(wheel, 102).empty());
+	EXPECT_EQ(advance_ids(wheel, 103), std::vector<int>({ 1 }));
+	EXPECT_EQ(advance_ids(wheel, 105), std::vector<int>({ 2 }));
+
+	// a lap from the last turn if all is further away than that
+	EXPECT_EQ(wheel.next_expire(), 105 + 8);
+	EXPECT_TRUE(advance_ids(wheel, 113).empty());
+	EXPECT_EQ(wheel.next_expire(), 119);
+	EXPECT_EQ(advance_ids(wheel, 119), std::vector<int>({ 3 }));
+	EXPECT_TRUE(wheel.empty());
+}
+
+TEST(polaris_manager_unittest, timing_wheel_catch_up)
+{
+	TimingWheel<struct test_entry> wheel(8);
+
+	for (int i = 1; i <= 20; i++)
+		wheel.add({ i, 0 }, i, 0);
+
+	// a timer late by more than a lap takes out all expired at once
+	EXPECT_EQ(advance_ids(wheel, 12).size(), 12u);
+	EXPECT_EQ(wheel.size(), 8u);
+	EXPECT_EQ(wheel.next_expire(), 13);
+
+	// added while the wheel is behind, it goes by the tick passed in
+	wheel.add({ 100, 0 }, 1, 14);
+	EXPECT_EQ(advance_ids(wheel, 15), std::vector<int>({ 13, 14, 15, 100 }));
+	EXPECT_EQ(advance_ids(wheel, 40), std::vector<int>({ 16, 17, 18, 19, 20 }));
+	EXPECT_TRUE(wheel.empty());
+
+	// empty again, the turn restarts from the tick of the next add
+	wheel.add({ 200, 0 }, 2, 1000);
+	EXPECT_EQ(wheel.next_expire(), 1002);
+	EXPECT_EQ(advance_ids(wheel, 1002), std::vector<int>({ 200 }));
+}
+
+TEST(polaris_manager_unittest, long_poll_converges)
+{
+	WFHttpServer server(mock_process);
+
+	mock.long_poll = true;
+	mock.revision = "rev_1";
+	mock.port = 8001;
+	write_yaml("      refreshInterval: 10m\n"
+			   "      longPollTimeout: 1s\n");
+	ASSERT_EQ(server.start(MOCK_PORT), 0);
+
+	{
+		PolarisManager mgr(MOCK_URL, YAML_FILE);
+
+		ASSERT_EQ(mgr.watch_service("b_namespace", "b"), 0);
+
+		// the first poll is held till it times out, which shows the server
+		// supports long poll, then the second one is held
+		ASSERT_TRUE(wait_until([]() {
+			return count_requests("b", "rev_1") == 2;
+		}, 5));
+
+		mock.mutex.lock();
+		mock.revision = "rev_2";
+		mock.port = 8002;
+		mock.mutex.unlock();
+
+		WFTaskFactory::cancel_by_name(MOCK_TIMER);
+
+		// polled again at once with rev_2, far before refreshInterval
+		ASSERT_TRUE(wait_until([]() {
+			return count_requests("b", "rev_2") >= 1;
+		}, 5));
+
+		// and never with rev_1 once the manager applied rev_2
+		std::vector<std::string> requests = get_requests("b");
+		auto first = std::find(requests.begin(), requests.end(), "rev_2");
+		EXPECT_TRUE(std::find(first, requests.end(), "rev_1") == requests.end());
+
+		// release the held poll before stopping the server
+		mock.mutex.lock();
+		mock.long_poll = false;
+		mock.mutex.unlock();
+		WFTaskFactory::cancel_by_name(MOCK_TIMER);
+	}
+
+	server.stop();
+	remove(YAML_FILE);
+}
+
+TEST(polaris_manager_unittest, long_poll_unsupported)
+{
+	WFHttpServer server(mock_process);
+
+	// answers at once, as a server without long poll does
+	mock.long_poll = false;
+	mock.revision = "rev_1";
+	mock.port = 8001;
+	write_yaml("      refreshInterval: 10m\n"
+			   "      longPollTimeout: 5s\n");
+	ASSERT_EQ(server.start(MOCK_PORT), 0);
+
+	{
+		PolarisManager mgr(MOCK_URL, YAML_FILE);
+
+		ASSERT_EQ(mgr.watch_service("b_namespace", "c"), 0);
+
+		// the watch, one poll with rev_1, then back to refreshInterval
+		ASSERT_TRUE(wait_until([]() {
+			return count_requests("c", "rev_1") == 1;
+		}, 5));
+		EXPECT_FALSE(wait_until([]() {
+			return count_requests("c", "") > 2;
+		}, 1));
+		EXPECT_EQ(count_requests("c", "rev_1"), 1u);
+	}
+
+	server.stop();
+	remove(YAML_FILE);
+}
+
+TEST(polaris_manager_unittest, long_poll_unsupported_churn)
+{
+	WFHttpServer server(mock_process);
+
+	// ignores the header, and has another revision on every answer
+	mock.long_poll = false;
+	mock.churn = true;
+	mock.revision = "rev_1";
+	mock.port = 8001;
+	write_yaml("      refreshInterval: 10m\n"
+			   "      longPollTimeout: 5s\n");
+	ASSERT_EQ(server.start(MOCK_PORT), 0);
+
+	{
+		PolarisManager mgr(MOCK_URL, YAML_FILE);
+
+		ASSERT_EQ(mgr.watch_service("b_namespace", "churn"), 0);
+
+		// changed on every answer, but never held, so not polled again
+		ASSERT_TRUE(wait_until([]() {
+			return count_requests("churn", "") == 2;
+		}, 5));
+		EXPECT_FALSE(wait_until([]() {
+			return count_requests("churn", "") > 2;
+		}, 1));
+	}
+
+	mock.mutex.lock();
+	mock.churn = false;
+	mock.mutex.unlock();
+	server.stop();
+	remove(YAML_FILE);
+}
+
+TEST(polaris_manager_unittest, adaptive_refresh_interval)
+{
+	WFHttpServer server(mock_process);
+
+	mock.long_poll = false;
+	mock.revision = "rev_1";
+	mock.port = 8001;
+	write_yaml("      refreshInterval: 100ms\n"
+			   "      minRefreshInterval: 100ms\n"
+			   "      maxRefreshInterval: 800ms\n");
+	ASSERT_EQ(server.start(MOCK_PORT), 0);
+
+	{
+		PolarisManager mgr(MOCK_URL, YAML_FILE);
+
+		std::vector<std::chrono::steady_clock::time_point> times;
+
+		ASSERT_EQ(mgr.watch_service("b_namespace", "d"), 0);
+
+		// the watch, then 3 refreshes at each of 100ms, 200ms and 400ms
+		ASSERT_TRUE(wait_until([]() {
+			return count_requests("d", "") >= 10;
+		}, 10));
+
+		mock.mutex.lock();
+		times = mock.request_times["d"];
+		mock.mutex.unlock();
+
+		// it doubles every 3 unchanged rounds, so the last 3 refreshes
+		// take longer than the first 3, which a fixed interval would not
+		EXPECT_GT(times[9] - times[6], times[3] - times[0]);
+	}
+
+	server.stop();
+	remove(YAML_FILE);
+}
+
+// runs a discover task of service b_namespace.task with client
+static void run_discover_task(PolarisClient& client,
+							  std::function<void (PolarisTask *)> check)
+{
+	WFFacilities::WaitGroup wait_group(1);
+	PolarisConfig config;
+	PolarisTask *task;
+
+	task = client.create_discover_task("b_namespace", "task", 0,
+									   [&wait_group, &check](PolarisTask *task) {
+		check(task);
+		wait_group.done();
+	});
+	task->set_config(config);
+	task->start();
+	wait_group.wait();
+}
+
+TEST(polaris_manager_unittest, discover_task_results)
+{
+	WFHttpServer server(mock_process);
+	PolarisClient client;
+
+	mock.long_poll = false;
+	mock.revision = "rev_1";
+	mock.port = 8001;
+	ASSERT_EQ(server.start(MOCK_PORT), 0);
+	ASSERT_EQ(client.init(MOCK_URL), 0);
+
+	run_discover_task(client, [](PolarisTask *task) {
+		struct discover_result discover;
+		struct route_result route;
+
+		ASSERT_EQ(task->get_state(), WFT_STATE_SUCCESS);
+		EXPECT_FALSE(task->is_instances_unchanged());
+		EXPECT_FALSE(task->is_routing_unchanged());
+
+		ASSERT_TRUE(task->get_discover_result(&discover));
+		EXPECT_EQ(discover.service_revision, "rev_1");
+		ASSERT_EQ(discover.instances.size(), 1u);
+		EXPECT_EQ(discover.instances[0].port, 8001);
+
+		ASSERT_TRUE(task->get_route_result(&route));
+		EXPECT_EQ(route.routing_revision, "routing_rev_1");
+
+		// moved out by the first get, the results are left alone
+		EXPECT_FALSE(task->get_discover_result(&discover));
+		EXPECT_FALSE(task->get_route_result(&route));
+		EXPECT_EQ(discover.instances.size(), 1u);
+		EXPECT_EQ(route.routing_revision, "routing_rev_1");
+	});
+
+	// sent with rev_1 kept by the last one, the instances are unchanged
+	run_discover_task(client, [](PolarisTask *task) {
+		struct discover_result discover;
+		struct route_result route;
+
+		ASSERT_EQ(task->get_state(), WFT_STATE_SUCCESS);
+		EXPECT_TRUE(task->is_instances_unchanged());
+		EXPECT_FALSE(task->get_discover_result(&discover));
+		EXPECT_TRUE(discover.instances.empty());
+		EXPECT_TRUE(task->get_route_result(&route));
+	});
+
+	EXPECT_EQ(count_requests("task", "0"), 1u);
+	EXPECT_EQ(count_requests("task", "rev_1"), 1u);
+
+	client.deinit();
+	server.stop();
+}
+
+TEST(polaris_manager_unittest, routing_failure)
+{
+	WFHttpServer server(mock_process);
+
+	mock.long_poll = false;
+	mock.revision = "rev_1";
+	mock.port = 8001;
+	write_yaml("      refreshInterval: 100ms\n"
+			   "      minRefreshInterval: 100ms\n"
+			   "      maxRefreshInterval: 100ms\n");
+	ASSERT_EQ(server.start(MOCK_PORT), 0);
+
+	{
+		PolarisManager mgr(MOCK_URL, YAML_FILE);
+
+		ASSERT_EQ(mgr.watch_service("b_namespace", "half"), 0);
+
+		// the instances succeed with rev_2, but the routing fails
+		mock.mutex.lock();
+		mock.revision = "rev_2";
+		mock.port = 8002;
+		mock.routing_fail = true;
+		mock.mutex.unlock();
+
+		// rev_2 of the failed refreshes is not kept, both keep asking
+		// with the revisions of the watch
+		size_t routing = count_requests("half", "routing_rev_1", true);
+
+		ASSERT_TRUE(wait_until([]() {
+			return count_requests("half", "rev_1") >= 3;
+		}, 10));
+		EXPECT_EQ(count_requests("half", "rev_2"), 0u);
+		EXPECT_GE(count_requests("half", "routing_rev_1", true), routing + 2);
+
+		mock.mutex.lock();
+		mock.routing_fail = false;
+		mock.mutex.unlock();
+
+		// the next refresh gets both again, and rev_2 is kept after it
+		EXPECT_TRUE(wait_until([]() {
+			return count_requests("half", "rev_2") >= 1;
+		}, 10));
+	}
+
+	server.stop();
+	remove(YAML_FILE);
+}
+
+TEST(polaris_manager_unittest, watch_services)
+{
+	WFHttpServer server(mock_process);
+
+	mock.long_poll = false;
+	mock.revision = "rev_1";
+	mock.port = 8001;
+	write_yaml("      refreshInterval: 10m\n");
+	ASSERT_EQ(server.start(MOCK_PORT), 0);
+
+	{
+		PolarisManager mgr(MOCK_URL, YAML_FILE);
+		std::vector<std::string> list;
+
+		EXPECT_EQ(mgr.watch_services({ { "b_namespace", "e" },
+									   { "b_namespace", "f" } }), 0);
+		mgr.get_watching_list(list);
+		EXPECT_EQ(list.size(), 2u);
+
+		// one of them is watched already
+		EXPECT_EQ(mgr.watch_services({ { "b_namespace", "f" },
+									   { "b_namespace", "g" } }), -1);
+		EXPECT_EQ(mgr.get_error(), POLARIS_ERR_DOUBLE_OPERATION);
+
+		WFFacilities::WaitGroup wait_group(1);
+		int error = -1;
+
+		mgr.async_watch_service("b_namespace", "h", [&](int ret) {
+			error = ret;
+			wait_group.done();
+		});
+		wait_group.wait();
+		EXPECT_EQ(error, 0);
+
+		list.clear();
+		mgr.get_watching_list(list);
+		EXPECT_EQ(list.size(), 4u);
+
+		EXPECT_EQ(mgr.unwatch_service("b_namespace", "h"), 0);
+		EXPECT_EQ(mgr.unwatch_service("b_namespace", "h"), -1);
+		EXPECT_EQ(mgr.get_error(), POLARIS_ERR_SERVICE_NOT_FOUND);
+	}
+
+	server.stop();
+	remove(YAML_FILE);
+}
+
+TEST(polaris_manager_unittest, heartbeat_buckets)
+{
+	WFHttpServer server(mock_process);
+
+	mock.long_poll = false;
+	write_yaml("      refreshInterval: 10m\n");
+	ASSERT_EQ(server.start(MOCK_PORT), 0);
+
+	{
+		PolarisManager mgr(MOCK_URL, YAML_FILE);
+		std::vector<std::chrono::steady_clock::time_point> heartbeats;
+		size_t bursts = 0;
+
+		// 100ms apart, they would be on their own timers otherwise
+		for (int i = 0; i < 10; i++)
+		{
+			PolarisInstance instance;
+
+			instance.set_host("127.0.0.1");
+			instance.set_port(9000 + i);
+			instance.set_enable_healthcheck(true);
+			ASSERT_EQ(mgr.register_service("b_namespace", "b", "", 1,
+										   std::move(instance)), 0);
+			usleep(100000);
+		}
+
+		mock.mutex.lock();
+		mock.heartbeats.clear();
+		mock.mutex.unlock();
+		ASSERT_TRUE(wait_until([]() {
+			std::lock_guard<std::mutex> lock(mock.mutex);
+			return mock.heartbeats.size() >= 20;
+		}, 10));
+
+		mock.mutex.lock();
+		heartbeats = mock.heartbeats;
+		mock.mutex.unlock();
+
+		// all the heartbeats of a tick arrive together, a burst every
+		// interval. on their own timers they would come 100ms apart
+		for (size_t i = 1; i < heartbeats.size(); i++)
+		{
+			auto gap = heartbeats[i] - heartbeats[i - 1];
+
+			if (gap > std::chrono::milliseconds(200))
+			{
+				EXPECT_GT(gap, std::chrono::milliseconds(500));
+				bursts++;
+			}
+		}
+
+		EXPECT_GE(bursts, 1u);
+	}
+
+	server.stop();
+	remove(YAML_FILE);
+}
+
+TEST(polaris_manager_unittest, stress_watch)
+{
+	WFHttpServer server(mock_process);
+
+	mock.long_poll = false;
+	mock.revision = "rev_1";
+	mock.port = 8001;
+	mock.requests.clear();
+	write_yaml("      refreshInterval: 1s\n"
+			   "      minRefreshInterval: 1s\n"
+			   "      maxRefreshInterval: 1s\n");
+	ASSERT_EQ(server.start(MOCK_PORT), 0);
+
+	{
+		PolarisManager mgr(MOCK_URL, YAML_FILE);
+		std::vector<std::pair<std::string, std::string>> services;
+		std::vector<std::string> list;
+
+		for (int i = 0; i < STRESS_ENTRIES; i++)
+		{
+			services.emplace_back("b_namespace", "stress_" + std::to_string(i));
+			if (services.size() == STRESS_BATCH)
+			{
+				ASSERT_EQ(mgr.watch_services(services), 0);
+				services.clear();
+			}
+		}
+
+		mgr.get_watching_list(list);
+		EXPECT_EQ(list.size(), (size_t)STRESS_ENTRIES);
+
+		// every one of them is refreshed by the wheel, none is left behind
+		EXPECT_TRUE(wait_until([]() {
+			for (int i = 0; i < STRESS_ENTRIES; i++)
+			{
+				if (count_requests("stress_" + std::to_string(i), "") < 3)
+					return false;
+			}
+
+			return true;
+		}, STRESS_DEADLINE));
+	}
+
+	server.stop();
+	remove(YAML_FILE);
+}
+
+TEST(polaris_manager_unittest, stress_register)
+{
+	WFHttpServer server(mock_process);
+
+	mock.long_poll = false;
+	write_yaml("      refreshInterval: 10m\n");
+	ASSERT_EQ(server.start(MOCK_PORT), 0);
+
+	{
+		PolarisManager mgr(MOCK_URL, YAML_FILE);
+		std::vector<std::string> list;
+		int i = 0;
+
+		while (i < STRESS_ENTRIES)
+		{
+			WFFacilities::WaitGroup wait_group(STRESS_BATCH);
+			std::mutex mutex;
+			int error = 0;
+
+			for (int j = 0; j < STRESS_BATCH; j++, i++)
+			{
+				PolarisInstance instance;
+
+				instance.set_host("127.0.0.1");
+				instance.set_port(10000 + i);
+				instance.set_enable_healthcheck(true);
+				mgr.async_register_service("b_namespace", "b", "", 1,
+										   std::move(instance),
+										   [&wait_group, &mutex, &error](int ret) {
+					std::lock_guard<std::mutex> lock(mutex);
+					if (ret != 0)
+						error = ret;
+					wait_group.done();
+				});
+			}
+
+			wait_group.wait();
+			ASSERT_EQ(error, 0);
+		}
+
+		mgr.get_register_list(list);
+		EXPECT_EQ(list.size(), (size_t)STRESS_ENTRIES);
+
+		mock.mutex.lock();
+		mock.heartbeats.clear();
+		mock.mutex.unlock();
+
+		// at least two ticks of the bucket, each one for all of them
+		EXPECT_TRUE(wait_until([]() {
+			std::lock_guard<std::mutex> lock(mock.mutex);
+			return mock.heartbeats.size() >= 2u * STRESS_ENTRIES;
+		}, STRESS_DEADLINE));
+	}
+
+	server.stop();
+	remove(YAML_FILE);
+}
+
+TEST(polaris_manager_unittest, request_body)
+{
+	auto body = PolarisTask::create_discover_body("b_namespace", "b");
+	std::string revision = "rev_\"1\"";
+	json j;
+
+	// the revision put in, even with the characters to escape
+	j = json::parse(body->instances_prefix + json(revision).dump() +
+					body->instances_suffix);
+	EXPECT_EQ(j["type"].get<int>(), INSTANCE);
+	EXPECT_EQ(j["service"]["namespace"], "b_namespace");
+	EXPECT_EQ(j["service"]["name"], "b");
+	EXPECT_EQ(j["service"]["revision"], revision);
+
+	j = json::parse(body->route_prefix + json("0").dump() + body->route_suffix);
+	EXPECT_EQ(j["type"].get<int>(), ROUTING);
+	EXPECT_EQ(j["service"]["revision"], "0");
+
+	PolarisInstance instance;
+
+	instance.set_host("127.0.0.1");
+	instance.set_port(8001);
+	j = json::parse(*PolarisTask::create_heartbeat_body("b_namespace", "b",
+														"token", instance));
+	EXPECT_EQ(j["host"], "127.0.0.1");
+	EXPECT_EQ(j["port"], 8001);
+	EXPECT_EQ(j["service_token"], "token");
+
+	instance.set_id("instance_8001");
+	j = json::parse(*PolarisTask::create_heartbeat_body("b_namespace", "b",
+														"", instance));
+	EXPECT_EQ(j["id"], "instance_8001");
+	EXPECT_EQ(j.count("host"), 0u);
+}
+
+TEST(polaris_manager_unittest, batch_refresh)
+{
+	WFHttpServer server(mock_process);
+	std::vector<std::string> names = { "batch_0", "batch_1", "batch_2", "batch_3" };
+	struct discover_result discover;
+	struct route_result route;
+
+	// a round of 5 services in batches of 2 takes 3 delays, longer than
+	// the refresh interval
+	mock.long_poll = false;
+	mock.revision = "rev_1";
+	mock.port = 8001;
+	mock.delay_ms = 300;
+	mock.max_service_in_flight = 0;
+	write_yaml("      refreshInterval: 100ms\n"
+			   "consumer:\n"
+			   "  localCache:\n"
+			   "    serviceRefreshBatch: true\n"
+			   "    serviceRefreshBatchSize: 2\n"
+			   "    persistDir: " PERSIST_DIR "\n");
+	ASSERT_EQ(server.start(MOCK_PORT), 0);
+
+	// watched from persistDir, its revalidation is on the way when the
+	// first rounds are due
+	discover.service_namespace = "b_namespace";
+	discover.service_name = "batch_cached";
+	discover.service_revision = "rev_1";
+	route.service_namespace = "b_namespace";
+	route.service_name = "batch_cached";
+	route.routing_revision = "routing_rev_1";
+	ASSERT_TRUE(save_discover_cache(PERSIST_DIR, discover));
+	ASSERT_TRUE(save_route_cache(PERSIST_DIR, route));
+
+	{
+		PolarisManager mgr(MOCK_URL, YAML_FILE);
+		std::vector<std::pair<std::string, std::string>> services;
+
+		ASSERT_EQ(mgr.watch_service("b_namespace", "batch_cached"), 0);
+		for (const std::string& name : names)
+			services.emplace_back("b_namespace", name);
+		ASSERT_EQ(mgr.watch_services(services), 0);
+
+		// the watches are all sent at once, only the rounds count
+		mock.mutex.lock();
+		mock.max_in_flight = mock.in_flight;
+		mock.mutex.unlock();
+
+		names.push_back("batch_cached");
+		EXPECT_TRUE(wait_until([&names]() {
+			for (const std::string& name : names)
+			{
+				if (count_requests(name, "") < 3)
+					return false;
+			}
+
+			return true;
+		}, 10));
+
+		mock.mutex.lock();
+		EXPECT_LE(mock.max_in_flight, 2);
+		// a service on the way is skipped by the rounds
+		EXPECT_EQ(mock.max_service_in_flight, 1);
+		mock.mutex.unlock();
+	}
+
+	server.stop();
+	mock.delay_ms = 0;
+
+	for (const std::string& name : names)
+	{
+		remove((PERSIST_DIR "/b_namespace#" + name + ".instances").c_str());
+		remove((PERSIST_DIR "/b_namespace#" + name + ".routing").c_str());
+	}
+
+	rmdir(PERSIST_DIR);
+	remove(YAML_FILE);
+}
+
+TEST(polaris_manager_unittest, cache_round_trip)
+{
+	struct discover_result discover;
+	struct discover_result discover_loaded;
+	struct route_result route;
+	struct route_result route_loaded;
+	struct instance inst;
+	struct routing_bound bound;
+	struct source_bound src;
+	struct destination_bound dst;
+
+	discover.type = "INSTANCE";
+	discover.service_namespace = "b_namespace";
+	// not a plain file name
+	discover.service_name = "../b/c";
+	discover.service_revision = "rev_1";
+	discover.service_metadata["owner"] = "polaris";
+	inst.id = "instance_0";
+	inst.host = "127.0.0.1";
+	inst.port = 8001;
+	inst.priority = 1;
+	inst.weight = 100;
+	inst.enable_healthcheck = true;
+	inst.healthcheck_ttl = 5;
+	inst.healthy = true;
+	inst.isolate = false;
+	inst.revision = "inst_rev_0";
+	inst.metadata["k1"] = "v1";
+	discover.instances.push_back(inst);
+	inst.port = 8002;
+	inst.healthy = false;
+	discover.instances.push_back(inst);
+
+	route.type = "ROUTING";
+	route.service_namespace = "b_namespace";
+	route.service_name = "../b/c";
+	route.routing_revision = "routing_rev_1";
+	src.service = "*";
+	src.metadata["env"] = { "EXACT", "TEXT", "test" };
+	dst.service = "../b/c";
+	dst.priority = 0;
+	dst.weight = 100;
+	dst.metadata["set"] = { "REGEX", "TEXT", "s.*" };
+	bound.source_bounds.push_back(src);
+	bound.destination_bounds.push_back(dst);
+	route.routing_inbounds.push_back(bound);
+
+	ASSERT_TRUE(save_discover_cache(PERSIST_DIR, discover));
+	ASSERT_TRUE(save_route_cache(PERSIST_DIR, route));
+
+	ASSERT_TRUE(load_discover_cache(PERSIST_DIR, "b_namespace", "../b/c",
+									CACHE_EXPIRE, &discover_loaded));
+	EXPECT_EQ(discover_loaded.code, 200000);
+	EXPECT_EQ(discover_loaded.service_revision, "rev_1");
+	EXPECT_EQ(discover_loaded.service_metadata, discover.service_metadata);
+	ASSERT_EQ(discover_loaded.instances.size(), 2u);
+	EXPECT_EQ(discover_loaded.instances[1].host, "127.0.0.1");
+	EXPECT_EQ(discover_loaded.instances[1].port, 8002);
+	EXPECT_FALSE(discover_loaded.instances[1].healthy);
+	EXPECT_EQ(discover_loaded.instances[1].metadata, inst.metadata);
+
+	ASSERT_TRUE(load_route_cache(PERSIST_DIR, "b_namespace", "../b/c",
+								 CACHE_EXPIRE, &route_loaded));
+	EXPECT_EQ(route_loaded.routing_revision, "routing_rev_1");
+	ASSERT_EQ(route_loaded.routing_inbounds.size(), 1u);
+	EXPECT_TRUE(route_loaded.routing_outbounds.empty());
+	ASSERT_EQ(route_loaded.routing_inbounds[0].destination_bounds.size(), 1u);
+	EXPECT_EQ(route_loaded.routing_inbounds[0].source_bounds[0].metadata["env"].value,
+			  "test");
+	EXPECT_EQ(route_loaded.routing_inbounds[0].destination_bounds[0].metadata["set"].type,
+			  "REGEX");
+
+	// an expired file is not used
+	const char *route_path = PERSIST_DIR "/b_namespace#..%2Fb%2Fc.routing";
+	struct utimbuf times;
+
+	times.actime = times.modtime = time(NULL) - 3600;
+	ASSERT_EQ(utime(route_path, &times), 0);
+	EXPECT_FALSE(load_route_cache(PERSIST_DIR, "b_namespace", "../b/c",
+								  CACHE_EXPIRE, &route_loaded));
+
+	// a damaged file is not used
+	const char *path = PERSIST_DIR "/b_namespace#..%2Fb%2Fc.instances";
+	FILE *fp = fopen(path, "r+b");
+
+	ASSERT_TRUE(fp != NULL);
+	fseek(fp, -1, SEEK_END);
+	fputc('x', fp);
+	fclose(fp);
+	EXPECT_FALSE(load_discover_cache(PERSIST_DIR, "b_namespace", "../b/c",
+									 CACHE_EXPIRE, &discover_loaded));
+	EXPECT_FALSE(load_discover_cache(PERSIST_DIR, "b_namespace", "d",
+									 CACHE_EXPIRE, &discover_loaded));
+
+	remove(path);
+	remove(route_path);
+	rmdir(PERSIST_DIR);
+}
+
+TEST(polaris_manager_unittest, watch_from_cache)
+{
+	WFHttpServer server(mock_process);
+	struct discover_result discover;
+
+	mock.long_poll = false;
+	mock.revision = "rev_1";
+	mock.port = 8001;
+	write_yaml("      refreshInterval: 10m\n"
+			   "consumer:\n"
+			   "  localCache:\n"
+			   "    persistDir: " PERSIST_DIR "\n");
+	ASSERT_EQ(server.start(MOCK_PORT), 0);
+
+	{
+		PolarisManager mgr(MOCK_URL, YAML_FILE);
+
+		ASSERT_EQ(mgr.watch_service("b_namespace", "cached"), 0);
+	}
+
+	// written in the background after the watch
+	for (int i = 0; i < 100; i++)
+	{
+		if (load_discover_cache(PERSIST_DIR, "b_namespace", "cached",
+								CACHE_EXPIRE, &discover))
+			break;
+		usleep(10000);
+	}
+
+	ASSERT_EQ(discover.service_revision, "rev_1");
+
+	mock.mutex.lock();
+	mock.revision = "rev_2";
+	mock.port = 8002;
+	mock.requests.clear();
+	mock.mutex.unlock();
+
+	{
+		PolarisManager mgr(MOCK_URL, YAML_FILE);
+
+		// seeded from the cache, then revalidated by the cached revision
+		ASSERT_EQ(mgr.watch_service("b_namespace", "cached"), 0);
+		EXPECT_TRUE(WFGlobal::get_name_service()->get_policy("b_namespace.cached") != NULL);
+		ASSERT_TRUE(wait_until([]() {
+			return count_requests("cached", "rev_1") == 1;
+		}, 5));
+	}
+
+	// rev_2 is written in the background after the revalidation
+	EXPECT_TRUE(wait_until([&discover]() {
+		return load_discover_cache(PERSIST_DIR, "b_namespace", "cached",
+								   CACHE_EXPIRE, &discover) &&
+			   discover.service_revision == "rev_2";
+	}, 5));
+	EXPECT_EQ(discover.service_revision, "rev_2");
+	ASSERT_EQ(discover.instances.size(), 1u);
+	EXPECT_EQ(discover.instances[0].port, 8002);
+
+	server.stop();
+
+	{
+		PolarisManager mgr(MOCK_URL, YAML_FILE);
+
+		// polaris server is unreachable
+		EXPECT_EQ(mgr.watch_service("b_namespace", "cached"), 0);
+	}
+
+	remove(PERSIST_DIR "/b_namespace#cached.instances");
+	remove(PERSIST_DIR "/b_namespace#cached.routing");
+	rmdir(PERSIST_DIR);
+	remove(YAML_FILE);
+}
+
+int main(int argc, char* argv[])
+{
+	::testing::InitGoogleTest(&argc, argv);
+
+	EXPECT_EQ(RUN_ALL_TESTS(), 0);
+
+	return 0;
+}
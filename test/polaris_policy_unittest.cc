@@ -1,8 +1,12 @@
 #include <stdlib.h>
 #include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
 #include <gtest/gtest.h>
 
 #include "PolarisPolicy.h"
+#include "PolarisRandom.h"
 
 #include "workflow/UpstreamManager.h"
 #include "workflow/WFHttpServer.h"
@@ -11,6 +15,28 @@
 
 using namespace polaris;
 
+static std::atomic<bool> count_alloc(false);
+static std::atomic<long> alloc_count(0);
+
+void *operator new(size_t size)
+{
+	void *p;
+
+	if (count_alloc)
+		alloc_count++;
+
+	p = malloc(size ? size : 1);
+	if (!p)
+		throw std::bad_alloc();
+
+	return p;
+}
+
+void operator delete(void *p) noexcept
+{
+	free(p);
+}
+
 PolarisConfig config;
 static PolarisPolicyConfig conf("b", config);
 
@@ -34,10 +60,10 @@ void fill_inbounds_a_b(std::vector<struct routing_bound>& bounds)
 		  "destination": [
 		  	{ "service": "b",
 			  "namespace": "b_namespace",
-			  "metadata": {"k1_for_inst_env": "v1_for_inst_base"}, "priority": 1 },
+			  "metadata": {"k1_for_inst_env": "v1_for_inst_base"}, "priority": 1, "weight": 0 },
 			{ "service": "b",
 			  "namespace": "b_namespace",
-			  "metadata": {"k1_for_inst_env": "v1_for_inst_grey"}, "priority": 1 },
+			  "metadata": {"k1_for_inst_env": "v1_for_inst_grey"}, "priority": 1, "weight": 100 },
 			{ "service": "b",
 			  "namespace": "b_namespace",
 			  "metadata": {"k1": "v1"}, {{"k2": "v2"}}, "priority": 2}]
@@ -65,6 +91,7 @@ void fill_inbounds_a_b(std::vector<struct routing_bound>& bounds)
 	struct destination_bound dst_a_b_1, dst_a_b_2, dst_a_b_3;
 	dst_a_b_1.service = "b";
 	dst_a_b_1.priority = 1;
+	dst_a_b_1.weight = 0;
 	dst_a_b_1.service_namespace = "b_namespace";
 	dst_a_b_2 = dst_a_b_1;
 	dst_a_b_3 = dst_a_b_1;
@@ -79,6 +106,7 @@ void fill_inbounds_a_b(std::vector<struct routing_bound>& bounds)
 	label_2.value = "v1_for_inst_grey";
 	meta["k1_for_inst_env"] = label_2;
 	dst_a_b_2.metadata = meta;
+	dst_a_b_2.weight = 100;
 	element0.destination_bounds.push_back(dst_a_b_2);
 	
 	meta.clear();
@@ -223,7 +251,7 @@ void fill_instances(std::vector<struct instance>& instances)
 		 meta : {"k1_for_inst_env": "v1_for_inst_grey"}, },
 		{id: "instance_2", host: "b", port: 8002, weight: 10000, service_namespace: "b_namespace",
 		 meta : {"k1_for_inst_env": "v1_for_inst_grey"}, {"k1": "v1"} },
-		{id: "instance_3", host: "b", port: 8003, priority: 9,
+		{id: "instance_3", host: "b", port: 8003, weight: 1, priority: 9,
 		 meta : {"k1": "v1"}, {"k2": "v2"} },
 	];
 */
@@ -255,6 +283,7 @@ void fill_instances(std::vector<struct instance>& instances)
 	inst3.host = "b";
 	inst3.id = "instance_3";
 	inst3.port = 8003;
+	inst3.weight = 1;
 	inst3.priority = 9;
 	inst3.metadata["k1"] = "v1";
 	inst3.metadata["k2"] = "v2";
@@ -490,10 +519,39 @@ TEST(polaris_policy_unittest, select)
 	std::string url = "http://b_namespace.b:8080#k1_env=v1_base&k2_number=v2_prime&a_namespace.a";
 	EXPECT_EQ(URIParser::parse(url, uri), 0);
 
+	Random::seed(1);
 	pp.select(uri, NULL, &addr);
 	EXPECT_EQ(atoi(addr->port.c_str()), 8002);
 }
 
+TEST(polaris_policy_unittest, select_with_seed)
+{
+	std::vector<struct instance> instances;
+	fill_instances(instances);
+
+	PolarisPolicy pp(&conf);
+	pp.update_instances(instances);
+
+	EndpointAddress *addr;
+	ParsedURI uri;
+	std::string url = "http://b_namespace.b:8080#a_namespace.a";
+	EXPECT_EQ(URIParser::parse(url, uri), 0);
+
+	std::vector<std::string> picks[2];
+	for (int round = 0; round < 2; round++)
+	{
+		Random::seed(12345);
+		for (int i = 0; i < 100; i++)
+		{
+			EXPECT_TRUE(pp.select(uri, NULL, &addr));
+			picks[round].push_back(addr->port);
+			--addr->ref;
+		}
+	}
+
+	EXPECT_TRUE(picks[0] == picks[1]);
+}
+
 TEST(polaris_policy_unittest, meta_router)
 {
 	std::vector<struct routing_bound> routing_inbounds;
@@ -518,11 +576,440 @@ TEST(polaris_policy_unittest, meta_router)
 	url = "http://b_namespace.b:8080#meta.k1=v1";
 	EXPECT_EQ(URIParser::parse(url, uri), 0);
 
+	Random::seed(1);
 	pp.select(uri, NULL, &addr);
 	EXPECT_EQ(atoi(addr->port.c_str()), 8002);
 	conf.set_rule_base_router(true);
 }
 
+TEST(polaris_policy_unittest, select_by_weight)
+{
+	std::vector<struct instance> instances;
+	struct instance inst;
+
+	inst.host = "b";
+	inst.service_namespace = "b_namespace";
+	inst.priority = 0;
+	inst.healthy = true;
+
+	inst.id = "instance_0";
+	inst.port = 8000;
+	inst.weight = 0;
+	instances.push_back(inst);
+
+	inst.id = "instance_1";
+	inst.port = 8001;
+	inst.weight = 1;
+	instances.push_back(inst);
+
+	inst.id = "instance_2";
+	inst.port = 8002;
+	inst.weight = 99;
+	instances.push_back(inst);
+
+	PolarisPolicy pp(&conf);
+	pp.update_instances(instances);
+
+	EndpointAddress *addr;
+	ParsedURI uri;
+	std::string url = "http://b_namespace.b:8080#a_namespace.a";
+	EXPECT_EQ(URIParser::parse(url, uri), 0);
+
+	int count[3] = {0, 0, 0};
+	for (int i = 0; i < 1000; i++)
+	{
+		EXPECT_TRUE(pp.select(uri, NULL, &addr));
+		count[atoi(addr->port.c_str()) - 8000]++;
+		--addr->ref;
+	}
+
+	EXPECT_EQ(count[0], 0);
+	EXPECT_GT(count[2], 900);
+}
+
+static void select_all(PolarisPolicy& pp,
+					   std::map<std::string, EndpointAddress *>& addrs)
+{
+	EndpointAddress *addr;
+	ParsedURI uri;
+	std::string url = "http://b_namespace.b:8080#a_namespace.a";
+	EXPECT_EQ(URIParser::parse(url, uri), 0);
+
+	addrs.clear();
+	for (int i = 0; i < 200; i++)
+	{
+		EXPECT_TRUE(pp.select(uri, NULL, &addr));
+		addrs[addr->port] = addr;
+		--addr->ref;
+	}
+}
+
+TEST(polaris_policy_unittest, update_instances_incremental)
+{
+	std::vector<struct instance> instances;
+	std::map<std::string, EndpointAddress *> addrs;
+	fill_instances(instances);
+
+	for (size_t i = 0; i < instances.size(); i++)
+	{
+		instances[i].weight = 1;
+		instances[i].revision = "r" + std::to_string(i);
+	}
+
+	PolarisPolicy pp(&conf);
+	pp.update_instances(instances);
+
+	Random::seed(1);
+	select_all(pp, addrs);
+	EXPECT_EQ(addrs.size(), 4);
+
+	EndpointAddress *kept = addrs["8000"];
+	EndpointAddress *changed = addrs["8001"];
+	kept->fail_count = 5;
+	++changed->ref; // make sure the address is not reused
+
+	instances[1].revision = "r1_new";
+	instances[1].weight = 2;
+	instances.pop_back();
+	pp.update_instances(instances);
+
+	select_all(pp, addrs);
+	EXPECT_EQ(addrs.size(), 3);
+	EXPECT_TRUE(addrs["8000"] == kept);
+	EXPECT_EQ(kept->fail_count, 5);
+	EXPECT_TRUE(addrs["8001"] != changed);
+	EXPECT_TRUE(addrs.find("8003") == addrs.end());
+
+	if (--changed->ref == 0)
+		delete changed;
+}
+
+static void fill_hash_instances(std::vector<struct instance>& instances, int n)
+{
+	struct instance inst;
+
+	inst.host = "b";
+	inst.service_namespace = "b_namespace";
+	inst.priority = 0;
+	inst.weight = 100;
+	inst.healthy = true;
+
+	for (int i = 0; i < n; i++)
+	{
+		inst.id = "instance_" + std::to_string(i);
+		inst.revision = "r0";
+		inst.port = 8000 + i;
+		instances.push_back(inst);
+	}
+}
+
+static void select_by_keys(PolarisPolicy& pp, std::vector<std::string>& ports)
+{
+	EndpointAddress *addr;
+	ParsedURI uri;
+
+	ports.clear();
+	for (int i = 0; i < 10000; i++)
+	{
+		std::string url = "http://b_namespace.b:8080#hash_key=" +
+						  std::to_string(i) + "&a_namespace.a";
+
+		EXPECT_EQ(URIParser::parse(url, uri), 0);
+		EXPECT_TRUE(pp.select(uri, NULL, &addr));
+		ports.push_back(addr->port);
+		--addr->ref;
+	}
+}
+
+static void check_hash_balancer(enum LoadBalancerType type)
+{
+	std::vector<struct instance> instances;
+	std::vector<std::string> before, after, again;
+	fill_hash_instances(instances, 50);
+
+	PolarisPolicyConfig hash_conf("b", config);
+	hash_conf.set_load_balancer_type(type);
+	PolarisPolicy pp(&hash_conf);
+	pp.update_instances(instances);
+
+	select_by_keys(pp, before);
+	select_by_keys(pp, again);
+	EXPECT_TRUE(before == again);
+
+	std::map<std::string, int> load;
+	for (const std::string& port : before)
+		load[port]++;
+
+	// 200 keys for each in average
+	EXPECT_EQ(load.size(), 50);
+	for (const auto& kv : load)
+		EXPECT_LT(kv.second, 400);
+
+	// remove one of 50, only about 1/50 keys should move
+	instances.erase(instances.begin() + 10);
+	pp.update_instances(instances);
+	select_by_keys(pp, after);
+
+	int moved = 0;
+	for (size_t i = 0; i < before.size(); i++)
+	{
+		if (before[i] != after[i])
+		{
+			EXPECT_TRUE(before[i] == "8010");
+			moved++;
+		}
+	}
+
+	EXPECT_LT(moved, 400);
+}
+
+TEST(polaris_policy_unittest, ring_hash_balancer)
+{
+	check_hash_balancer(LoadBalancerRingHash);
+}
+
+TEST(polaris_policy_unittest, maglev_balancer)
+{
+	check_hash_balancer(LoadBalancerMaglev);
+}
+
+class FinishPolicy : public PolarisPolicy
+{
+public:
+	FinishPolicy(const PolarisPolicyConfig *config) : PolarisPolicy(config) { }
+
+	void finish(EndpointAddress *addr)
+	{
+		struct TracingData data;
+		WFNSTracing tracing;
+		RouteManager::RouteResult result;
+
+		data.history.push_back(addr);
+		data.sg = this;
+		tracing.data = &data;
+		tracing.deleter = NULL;
+		result.cookie = NULL;
+		this->success(&result, &tracing, NULL);
+	}
+};
+
+/*
+ * 20 instances of the same weight, one of them is 10 times slower.
+ * 10 requests arrive every tick, returns the p99 latency in ticks.
+ */
+static int simulate_p99(enum LoadBalancerType type)
+{
+	std::vector<struct instance> instances;
+	fill_hash_instances(instances, 20);
+
+	PolarisPolicyConfig sim_conf("b", config);
+	sim_conf.set_load_balancer_type(type);
+	FinishPolicy pp(&sim_conf);
+	pp.update_instances(instances);
+
+	const int ticks = 2000;
+	std::vector<std::vector<EndpointAddress *>> finishing(ticks + 100);
+	std::vector<int> latency;
+	EndpointAddress *addr;
+	ParsedURI uri;
+	std::string url = "http://b_namespace.b:8080#a_namespace.a";
+	EXPECT_EQ(URIParser::parse(url, uri), 0);
+
+	Random::seed(7);
+	for (int now = 0; now < ticks; now++)
+	{
+		for (EndpointAddress *done : finishing[now])
+		{
+			pp.finish(done);
+			--done->ref;
+		}
+
+		for (int i = 0; i < 10; i++)
+		{
+			EXPECT_TRUE(pp.select(uri, NULL, &addr));
+			int cost = addr->port == "8000" ? 50 : 5;
+			finishing[now + cost].push_back(addr);
+			latency.push_back(cost);
+		}
+	}
+
+	for (size_t now = ticks; now < finishing.size(); now++)
+	{
+		for (EndpointAddress *done : finishing[now])
+		{
+			pp.finish(done);
+			--done->ref;
+		}
+	}
+
+	std::sort(latency.begin(), latency.end());
+	return latency[latency.size() * 99 / 100];
+}
+
+TEST(polaris_policy_unittest, p2c_balancer)
+{
+	int random_p99 = simulate_p99(LoadBalancerWeightedRandom);
+	int p2c_p99 = simulate_p99(LoadBalancerP2C);
+
+	EXPECT_EQ(random_p99, 50);
+	EXPECT_LT(p2c_p99, random_p99);
+}
+
+TEST(polaris_policy_unittest, select_unmatched_bounds)
+{
+	std::vector<struct routing_bound> routing_inbounds;
+	fill_inbounds_a_b(routing_inbounds);
+
+	std::vector<struct instance> instances;
+	fill_instances(instances);
+
+	// no instance matches any dst_bound of the same priority
+	for (auto& dst : routing_inbounds[0].destination_bounds)
+	{
+		dst.priority = 1;
+		dst.weight = 1;
+		dst.service_namespace = "c_namespace";
+	}
+
+	PolarisPolicy pp(&conf);
+	pp.update_instances(instances);
+	pp.update_inbounds(routing_inbounds);
+
+	EndpointAddress *addr;
+	ParsedURI uri;
+
+	std::string url = "http://b_namespace.b:8080#k1_env=v1_base&k2_number=v2_prime&a_namespace.a";
+	EXPECT_EQ(URIParser::parse(url, uri), 0);
+
+	// the rule matches the caller, none of the instances is allowed
+	EXPECT_FALSE(pp.select(uri, NULL, &addr));
+}
+
+TEST(polaris_policy_unittest, select_after_rules_update)
+{
+	std::vector<struct routing_bound> routing_inbounds;
+	fill_inbounds_a_b(routing_inbounds);
+
+	std::vector<struct instance> instances;
+	fill_instances(instances);
+
+	PolarisPolicy pp(&conf);
+	pp.update_instances(instances);
+	pp.update_inbounds(routing_inbounds);
+
+	EndpointAddress *addr;
+	ParsedURI uri;
+	std::string url = "http://b_namespace.b:8080#k1_env=v1_base&k2_number=v2_prime&a_namespace.a";
+	EXPECT_EQ(URIParser::parse(url, uri), 0);
+
+	EXPECT_TRUE(pp.select(uri, NULL, &addr));
+	EXPECT_NE(atoi(addr->port.c_str()), 8003);
+	--addr->ref;
+
+	// the same fragment must be matched with the new rules
+	struct destination_bound dst = routing_inbounds[0].destination_bounds[2];
+	dst.service_namespace = "";
+	routing_inbounds[0].destination_bounds.assign(1, dst);
+	pp.update_inbounds(routing_inbounds);
+
+	EXPECT_TRUE(pp.select(uri, NULL, &addr));
+	EXPECT_EQ(atoi(addr->port.c_str()), 8003);
+	--addr->ref;
+}
+
+TEST(polaris_policy_unittest, select_without_allocation)
+{
+	std::vector<struct routing_bound> routing_inbounds;
+	fill_inbounds_a_b(routing_inbounds);
+
+	std::vector<struct instance> instances;
+	fill_instances(instances);
+
+	PolarisPolicy pp(&conf);
+	pp.update_instances(instances);
+	pp.update_inbounds(routing_inbounds);
+
+	EndpointAddress *addr;
+	ParsedURI uri;
+	std::string url = "http://b_namespace.b:8080#k1_env=v1_base&k2_number=v2_prime&a_namespace.a";
+	EXPECT_EQ(URIParser::parse(url, uri), 0);
+
+	// let the per thread buffers grow
+	for (int i = 0; i < 10; i++)
+	{
+		EXPECT_TRUE(pp.select(uri, NULL, &addr));
+		--addr->ref;
+	}
+
+	alloc_count = 0;
+	count_alloc = true;
+	for (int i = 0; i < 1000; i++)
+	{
+		pp.select(uri, NULL, &addr);
+		--addr->ref;
+	}
+	count_alloc = false;
+
+	EXPECT_EQ(alloc_count, 0);
+}
+
+TEST(polaris_policy_unittest, select_while_updating)
+{
+	std::vector<struct routing_bound> routing_inbounds;
+	fill_inbounds_a_b(routing_inbounds);
+
+	std::vector<struct instance> instances;
+	fill_instances(instances);
+
+	PolarisPolicy pp(&conf);
+	pp.update_instances(instances);
+	pp.update_inbounds(routing_inbounds);
+
+	std::atomic<bool> stop(false);
+	std::atomic<int> failed(0);
+	std::vector<std::thread> threads;
+
+	for (int i = 0; i < 4; i++)
+	{
+		threads.emplace_back([&pp, &stop, &failed]() {
+			std::string url = "http://b_namespace.b:8080#k1_env=v1_base&k2_number=v2_prime&a_namespace.a";
+			EndpointAddress *addr;
+			ParsedURI uri;
+			int port;
+
+			URIParser::parse(url, uri);
+			while (!stop)
+			{
+				if (!pp.select(uri, NULL, &addr))
+				{
+					failed++;
+					continue;
+				}
+
+				// any subset of the first priority
+				port = atoi(addr->port.c_str());
+				if (port != 8000 && port != 8001 && port != 8002)
+					failed++;
+
+				if (--addr->ref == 0)
+					delete addr;
+			}
+		});
+	}
+
+	for (int i = 0; i < 200; i++)
+	{
+		pp.update_instances(instances);
+		pp.update_inbounds(routing_inbounds);
+	}
+
+	stop = true;
+	for (auto& t : threads)
+		t.join();
+
+	EXPECT_EQ(failed, 0);
+}
+
 int main(int argc, char* argv[])
 {
 	::testing::InitGoogleTest(&argc, argv);
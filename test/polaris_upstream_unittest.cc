@@ -0,0 +1,108 @@
+#include <stdlib.h>
+#include <string>
+#include <gtest/gtest.h>
+
+#include "PolarisUpstream.h"
+
+#include "workflow/URIParser.h"
+
+using namespace polaris;
+
+class TestUpstream : public PolarisUpstream
+{
+public:
+	TestUpstream() : PolarisUpstream("polaris.test") { }
+
+	// one request which takes latency_us, returns the port selected
+	int request(const std::string& host, long long latency_us, bool ok)
+	{
+		std::string url = "http://" + host + "/v1/Discover";
+		RouteManager::RouteResult result;
+		struct UpstreamTracingData *data;
+		WFNSTracing tracing;
+		EndpointAddress *addr;
+		ParsedURI uri;
+		int port;
+
+		URIParser::parse(url, uri);
+		tracing.data = NULL;
+		tracing.deleter = NULL;
+		if (!this->select(uri, &tracing, &addr))
+		{
+			if (tracing.deleter)
+				tracing.deleter(tracing.data);
+			return -1;
+		}
+
+		// workflow appends the history after select()
+		data = (struct UpstreamTracingData *)tracing.data;
+		data->history.push_back(addr);
+		data->start -= latency_us;
+		port = atoi(addr->port.c_str());
+
+		result.cookie = NULL;
+		if (ok)
+			this->success(&result, &tracing, NULL);
+		else
+			this->failed(&result, &tracing, NULL);
+
+		tracing.deleter(tracing.data);
+		return port;
+	}
+
+	long long get_latency(const std::string& address)
+	{
+		auto it = this->server_map.find(address);
+
+		if (it == this->server_map.end())
+			return -1;
+
+		return static_cast<PolarisServerParams *>(it->second[0]->params)->get_latency();
+	}
+};
+
+TEST(polaris_upstream_unittest, select)
+{
+	TestUpstream upstream;
+	const std::string& name = upstream.get_name();
+	long long latency;
+
+	upstream.update_servers({ "http://127.0.0.1:8091", "http://127.0.0.1:8092" });
+
+	// the one without any response yet goes first
+	EXPECT_EQ(upstream.request(name, 20000, true), 8091);
+	EXPECT_EQ(upstream.request(name, 1000, true), 8092);
+	for (int i = 0; i < 10; i++)
+		EXPECT_EQ(upstream.request(name, 1000, true), 8092);
+
+	// fused after 3 failures in a row
+	for (int i = 0; i < 3; i++)
+		EXPECT_EQ(upstream.request(name, 1000, false), 8092);
+	EXPECT_EQ(upstream.request(name, 20000, true), 8091);
+
+	// a long poll is held by the server, it says nothing about the latency
+	latency = upstream.get_latency("127.0.0.1:8091");
+	EXPECT_EQ(upstream.request(upstream.get_long_poll_name(), 30000000, true), 8091);
+	EXPECT_EQ(upstream.get_latency("127.0.0.1:8091"), latency);
+
+	// the servers still in the cluster keep their latency
+	upstream.update_servers({ "http://127.0.0.1:8091", "http://127.0.0.1:8093" });
+	EXPECT_EQ(upstream.get_latency("127.0.0.1:8091"), latency);
+	EXPECT_EQ(upstream.get_latency("127.0.0.1:8092"), -1);
+	EXPECT_EQ(upstream.request(name, 1000, true), 8093);
+
+	EXPECT_FALSE(upstream.is_unavailable());
+	for (int i = 0; i < 6; i++)
+		upstream.request(name, 1000, false);
+	EXPECT_TRUE(upstream.is_unavailable());
+	EXPECT_EQ(upstream.request(name, 1000, true), -1);
+}
+
+int main(int argc, char* argv[])
+{
+	::testing::InitGoogleTest(&argc, argv);
+
+	EXPECT_EQ(RUN_ALL_TESTS(), 0);
+
+	return 0;
+}